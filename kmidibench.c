@@ -0,0 +1,601 @@
+/****************************************************************************
+**
+** K MIDI Bench - Benchmark of K MIDI DECoder
+**
+** Copyright (C) 2018 by KO Myung-Hun <komh@chollian.net>
+**
+** This file is part of K MIDI DECoder.
+**
+** $BEGIN_LICENSE$
+**
+** GNU General Public License Usage
+** This file may be used under the terms of the GNU
+** General Public License version 3.0 as published by the Free Software
+** Foundation and appearing in the file LICENSE.GPL included in the
+** packaging of this file.  Please review the following information to
+** ensure the GNU General Public License version 3.0 requirements will be
+** met: http://www.gnu.org/copyleft/gpl.html.
+**
+** $END_LICENSE$
+**
+****************************************************************************/
+
+/** @file kmidibench.c */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "kmididec.h"
+
+#define SAMPLE_RATE 44100
+#define CHANNELS    2
+
+#define BUF_SIZE    ( 64 * 1024 )
+
+#define DIVISION    480     /* ticks per quarter note */
+
+#define SEEK_INTERVAL   5000    /* ms */
+#define SEEK_COUNT      100
+
+/* bench options */
+static int sampleRate = SAMPLE_RATE;
+static int preset = KMDEC_PRESET_DEFAULT;
+static int scale = 1;
+static int seekCount = SEEK_COUNT;
+static const char *sf2name;
+
+/**
+ * Growable buffer for MIDI data
+ */
+typedef struct mididata
+{
+    uint8_t *data;  /**< MIDI data */
+    size_t len;     /**< length of data */
+    size_t size;    /**< allocated size of data */
+    size_t track;   /**< start of a track being written */
+    bool failed;    /**< out of memory */
+} MIDIDATA, *PMIDIDATA;
+
+/* append bytes */
+static void putBytes( PMIDIDATA md, const void *p, size_t n )
+{
+    if( md->failed )
+        return;
+
+    if( md->len + n > md->size )
+    {
+        size_t size = md->size ? md->size : 4096;
+        uint8_t *data;
+
+        while( md->len + n > size )
+            size *= 2;
+
+        data = realloc( md->data, size );
+        if( !data )
+        {
+            md->failed = true;
+
+            return;
+        }
+
+        md->data = data;
+        md->size = size;
+    }
+
+    memcpy( md->data + md->len, p, n );
+    md->len += n;
+}
+
+/* append a byte */
+static void putByte( PMIDIDATA md, uint8_t v )
+{
+    putBytes( md, &v, 1 );
+}
+
+/* append a 16-bit value in big endian */
+static void putBE16( PMIDIDATA md, uint16_t v )
+{
+    putByte( md, v >> 8 );
+    putByte( md, v & 0xFF );
+}
+
+/* append a variable quantity */
+static void putVarQ( PMIDIDATA md, uint32_t v )
+{
+    uint8_t buf[ 5 ];
+    int n = 0;
+
+    buf[ n++ ] = v & 0x7F;
+    while(( v >>= 7 ) > 0 )
+        buf[ n++ ] = 0x80 | ( v & 0x7F );
+
+    while( n > 0 )
+        putByte( md, buf[ --n ]);
+}
+
+/* append a header of SMF */
+static void putHeader( PMIDIDATA md, int format, int tracks )
+{
+    putBytes( md, "MThd\x00\x00\x00\x06", 8 );
+    putBE16( md, format );
+    putBE16( md, tracks );
+    putBE16( md, DIVISION );
+}
+
+/* start a track */
+static void beginTrack( PMIDIDATA md )
+{
+    putBytes( md, "MTrk\x00\x00\x00\x00", 8 );
+    md->track = md->len;
+}
+
+/* finish a track with an end of track */
+static void endTrack( PMIDIDATA md )
+{
+    putBytes( md, "\x00\xFF\x2F\x00", 4 );
+
+    if( md->failed )
+        return;
+
+    uint32_t len = md->len - md->track;
+    uint8_t *p = md->data + md->track - 4;
+
+    p[ 0 ] = len >> 24;
+    p[ 1 ] = ( len >> 16 ) & 0xFF;
+    p[ 2 ] = ( len >> 8 ) & 0xFF;
+    p[ 3 ] = len & 0xFF;
+}
+
+/* append a channel event */
+static void putEvent( PMIDIDATA md, uint32_t delta, uint8_t status,
+                      uint8_t data0, uint8_t data1 )
+{
+    putVarQ( md, delta );
+    putByte( md, status );
+    putByte( md, data0 );
+    if(( status & 0xF0 ) != 0xC0 && ( status & 0xF0 ) != 0xD0 )
+        putByte( md, data1 );
+}
+
+/* append a blob of SysEx or meta event */
+static void putBlob( PMIDIDATA md, uint32_t delta, uint8_t status,
+                     uint8_t type, uint32_t len )
+{
+    putVarQ( md, delta );
+    putByte( md, status );
+    if( status == 0xFF )
+        putByte( md, type );
+    putVarQ( md, len );
+
+    for( uint32_t i = 0; i < len; i++ )
+        putByte( md, status == 0xF0 && i == len - 1 ? 0xF7 : i & 0x7F );
+}
+
+/* append a tempo change */
+static void putTempo( PMIDIDATA md, uint32_t delta, uint32_t tempo )
+{
+    putVarQ( md, delta );
+    putBytes( md, "\xFF\x51\x03", 3 );
+    putByte( md, tempo >> 16 );
+    putByte( md, ( tempo >> 8 ) & 0xFF );
+    putByte( md, tempo & 0xFF );
+}
+
+/* many tracks playing at once */
+static void genTracks( PMIDIDATA md )
+{
+    int tracks = 128 * scale;
+
+    putHeader( md, 1, tracks );
+
+    for( int t = 0; t < tracks; t++ )
+    {
+        int ch = t % 16;
+
+        beginTrack( md );
+
+        putEvent( md, 0, 0xC0 | ch, t % 128, 0 );
+
+        for( int i = 0; i < 500; i++ )
+        {
+            uint8_t key = 36 + ( t + i ) % 60;
+
+            putEvent( md, 0, 0x90 | ch, key, 100 );
+            putEvent( md, DIVISION / 4, 0x80 | ch, key, 0 );
+        }
+
+        endTrack( md );
+    }
+}
+
+/* very high note density */
+static void genDense( PMIDIDATA md )
+{
+    int chords = 2000 * scale;
+
+    putHeader( md, 0, 1 );
+    beginTrack( md );
+
+    for( int i = 0; i < chords; i++ )
+    {
+        /* a chord of 64 notes per 1/32 note */
+        for( int k = 0; k < 64; k++ )
+            putEvent( md, 0, 0x90 | ( k % 16 ), 32 + k, 64 + k % 64 );
+
+        for( int k = 0; k < 64; k++ )
+            putEvent( md, k == 0 ? DIVISION / 8 : 0, 0x80 | ( k % 16 ),
+                      32 + k, 0 );
+
+        /* controllers and pitch bends */
+        putEvent( md, 0, 0xB0 | ( i % 16 ), 1, i & 0x7F );
+        putEvent( md, 0, 0xE0 | ( i % 16 ), i & 0x7F, 64 );
+    }
+
+    endTrack( md );
+}
+
+/* huge SysEx and meta blobs */
+static void genBlobs( PMIDIDATA md )
+{
+    int blobs = 100 * scale;
+
+    putHeader( md, 0, 1 );
+    beginTrack( md );
+
+    for( int i = 0; i < blobs; i++ )
+    {
+        putBlob( md, 0, 0xF0, 0, 64 * 1024 );
+        putBlob( md, 0, 0xFF, 0x01, 64 * 1024 );  /* text */
+        putBlob( md, 0, 0xFF, 0x05, 1024 );       /* lyric */
+
+        putEvent( md, 0, 0x90, 60, 100 );
+        putEvent( md, DIVISION, 0x80, 60, 0 );
+    }
+
+    endTrack( md );
+}
+
+/* extreme tempo changes */
+static void genTempo( PMIDIDATA md )
+{
+    int changes = 20000 * scale;
+
+    putHeader( md, 0, 1 );
+    beginTrack( md );
+
+    for( int i = 0; i < changes; i++ )
+    {
+        /* swing between 3.75 bpm and 60000 bpm every tick */
+        putTempo( md, 1, i & 1 ? 1000 : 16000000 );
+
+        if( i % 16 == 0 )
+            putEvent( md, 0, 0x90, 36 + i % 60, 100 );
+        else if( i % 16 == 8 )
+            putEvent( md, 0, 0x80, 36 + ( i - 8 ) % 60, 0 );
+    }
+
+    endTrack( md );
+}
+
+/* long stream of OS/2 real-time MIDI data */
+static void genOS2( PMIDIDATA md )
+{
+    int notes = 50000 * scale;
+
+    /* Timing Generation Control, 24 * ( 3 + 1 ) PPQN */
+    putBytes( md, "\xF0\x00\x00\x3A\x03\x01\x18\x03\x00\xF7", 10 );
+
+    for( int i = 0; i < notes; i++ )
+    {
+        uint8_t key = 36 + i % 60;
+
+        putByte( md, 0x90 | ( i % 16 ));
+        putByte( md, key );
+        putByte( md, 100 );
+
+        /* Timing Compression(Short), and running status */
+        putBytes( md, "\xF0\x00\x00\x3A\x07\xF7", 6 );
+        putByte( md, key );
+        putByte( md, 0 );
+
+        /* timing clocks */
+        putByte( md, 0xF8 );
+        putByte( md, 0xF8 );
+
+        /* Timing Compression(Long) */
+        if( i % 100 == 0 )
+            putBytes( md, "\xF0\x00\x00\x3A\x01\x10\x00\xF7", 8 );
+    }
+}
+
+/**
+ * Scenario of a benchmark
+ */
+typedef struct scenario
+{
+    const char *name;                   /**< name */
+    void ( *generate )( PMIDIDATA md ); /**< generator */
+} SCENARIO, *PSCENARIO;
+
+static SCENARIO scenarios[] = {
+    { "tracks", genTracks },
+    { "dense",  genDense },
+    { "blobs",  genBlobs },
+    { "tempo",  genTempo },
+    { "os2",    genOS2 },
+};
+
+#define SCENARIO_COUNT  ( sizeof( scenarios ) / sizeof( scenarios[ 0 ]))
+
+/* MIDI data read by IO functions */
+static PMIDIDATA ioData;
+static size_t ioPos;
+
+static int memRead( int fd, void *buf, size_t n )
+{
+    if( n > ioData->len - ioPos )
+        n = ioData->len - ioPos;
+
+    memcpy( buf, ioData->data + ioPos, n );
+    ioPos += n;
+
+    return n;
+}
+
+static int memSeek( int fd, long offset, int origin )
+{
+    long base = origin == SEEK_SET ? 0 :
+                origin == SEEK_CUR ? ( long )ioPos : ( long )ioData->len;
+
+    if( base + offset < 0 || base + offset > ( long )ioData->len )
+        return -1;
+
+    ioPos = base + offset;
+
+    return ioPos;
+}
+
+static int memTell( int fd )
+{
+    return ioPos;
+}
+
+static int memClose( int fd )
+{
+    return 0;
+}
+
+static KMDECIOFUNCS memIO = {
+    .open = NULL,
+    .read = memRead,
+    .seek = memSeek,
+    .tell = memTell,
+    .close = memClose,
+};
+
+/* get current time in seconds */
+static double now( void )
+{
+    struct timeval tv;
+
+    gettimeofday( &tv, NULL );
+
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* run a scenario */
+static int bench( PSCENARIO sc )
+{
+    KMDECAUDIOINFO audioInfo =
+    {
+        .bps = KMDEC_BPS_S16,
+        .channels = CHANNELS,
+        .sampleRate = sampleRate
+    };
+
+    KMDECOPTIONS opts =
+    {
+        .seekInterval = SEEK_INTERVAL,
+        .preset = preset,
+    };
+
+    MIDIDATA md = { NULL, };
+    KMDECMIDIINFO info;
+    KMDECSTATS stats;
+    PKMDEC dec;
+    char *buf;
+    double start;
+    double probeTime, openTime, decodeTime, seekTime;
+    uint64_t events = 0;
+    uint64_t bytes = 0;
+    int len;
+    int rc = -1;
+
+    sc->generate( &md );
+
+    buf = malloc( BUF_SIZE );
+    if( md.failed || !buf )
+        goto exit_free;
+
+    /* probe-only parsing */
+    ioData = &md;
+    ioPos = 0;
+
+    start = now();
+    if( kmdecProbeFd( 0, &memIO, &info ) == -1 )
+        goto exit_free;
+    probeTime = now() - start;
+
+    /* open including a duration pass */
+    start = now();
+    dec = kmdecOpenMem( md.data, md.len, sf2name, &audioInfo, &opts );
+    if( !dec )
+        goto exit_free;
+    openTime = now() - start;
+
+    kmdecGetStats( dec, &stats );
+    for( int i = 0; i < KMDEC_EVENT_TYPES; i++ )
+        events += stats.events[ i ];
+
+    /* sequential decoding */
+    start = now();
+    while(( len = kmdecDecode( dec, buf, BUF_SIZE )) > 0 )
+        bytes += len;
+    decodeTime = now() - start;
+
+    /* random seeking */
+    srand( 1 );
+
+    start = now();
+    for( int i = 0; i < seekCount; i++ )
+    {
+        kmdecSeek( dec, info.duration > 0 ? rand() % info.duration : 0,
+                   KMDEC_SEEK_SET );
+        kmdecDecode( dec, buf, BUF_SIZE );
+    }
+    seekTime = now() - start;
+
+    kmdecClose( dec );
+
+    double audio = ( double )bytes / ( sampleRate * CHANNELS * 2 );
+
+    printf("%-8s %9zu %8llu %8.1f %9.0f %8.1f %8.1f %7.1fx %8.2f\n",
+           sc->name, md.len, ( unsigned long long )events,
+           probeTime * 1000, probeTime > 0 ? events / probeTime : 0,
+           openTime * 1000, decodeTime * 1000,
+           decodeTime > 0 ? audio / decodeTime : 0,
+           seekCount > 0 ? seekTime * 1000 / seekCount : 0 );
+
+    rc = 0;
+
+exit_free:
+    if( rc == -1 )
+        fprintf( stderr, "Failed to run %s\n", sc->name );
+
+    free( buf );
+    free( md.data );
+
+    return rc;
+}
+
+static void usage( void )
+{
+    fprintf( stderr,
+        "Usage : kmidibench [options] sound-font-file [scenario...]\n"
+        "Options :\n"
+        "    -r rate    Sample rate, default is %d\n"
+        "    -s scale   Scale of generated MIDI data, default is 1\n"
+        "    -n count   Random seeks, default is %d\n"
+        "    -q quality Quality, one of preview, realtime and hq\n"
+        "Scenarios : tracks, dense, blobs, tempo and os2, default is all\n",
+        SAMPLE_RATE, SEEK_COUNT );
+}
+
+int main( int argc, char *argv[])
+{
+    int failed = 0;
+    int opt;
+    int rc = 1;
+
+    while(( opt = getopt( argc, argv, "r:s:n:q:")) != -1 )
+    {
+        switch( opt )
+        {
+            case 'r':
+                sampleRate = atoi( optarg );
+                break;
+
+            case 's':
+                scale = atoi( optarg );
+                break;
+
+            case 'n':
+                seekCount = atoi( optarg );
+                break;
+
+            case 'q':
+                if( !strcmp( optarg, "preview"))
+                    preset = KMDEC_PRESET_PREVIEW;
+                else if( !strcmp( optarg, "realtime"))
+                    preset = KMDEC_PRESET_REALTIME;
+                else if( !strcmp( optarg, "hq"))
+                    preset = KMDEC_PRESET_OFFLINE_HQ;
+                else
+                {
+                    usage();
+
+                    return rc;
+                }
+                break;
+
+            default:
+                usage();
+
+                return rc;
+        }
+    }
+
+    if( argc - optind < 1 || sampleRate <= 0 || scale <= 0
+        || seekCount < 0 )
+    {
+        usage();
+
+        return rc;
+    }
+
+    sf2name = argv[ optind++ ];
+
+    /* check names of scenarios */
+    for( int i = optind; i < argc; i++ )
+    {
+        int j;
+
+        for( j = 0; j < SCENARIO_COUNT; j++ )
+        {
+            if( !strcmp( argv[ i ], scenarios[ j ].name ))
+                break;
+        }
+
+        if( j == SCENARIO_COUNT )
+        {
+            usage();
+
+            return rc;
+        }
+    }
+
+    /* load a sound font once for all the scenarios */
+    if( kmdecPreloadSoundFont( sf2name ) == -1 )
+    {
+        fprintf( stderr, "Failed to load %s\n", sf2name );
+
+        return rc;
+    }
+
+    printf("%-8s %9s %8s %8s %9s %8s %8s %8s %8s\n",
+           "scenario", "bytes", "events", "probe ms", "events/s",
+           "open ms", "play ms", "realtime", "seek ms");
+
+    for( int i = 0; i < SCENARIO_COUNT; i++ )
+    {
+        bool run = optind == argc;
+
+        for( int j = optind; j < argc && !run; j++ )
+            run = !strcmp( argv[ j ], scenarios[ i ].name );
+
+        if( run && bench( scenarios + i ) == -1 )
+            failed++;
+    }
+
+    kmdecReleaseSoundFont( sf2name );
+
+    if( failed == 0 )
+        rc = 0;
+
+    return rc;
+}
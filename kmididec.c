@@ -24,14 +24,39 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <limits.h>
 #include <string.h>
+#include <strings.h>
 #include <stdbool.h>
+#include <math.h>
 #include <sys/param.h>
 #include <io.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+#include <pthread.h>
+
+/* SSE2 intrinsics with target attribute */
+#if defined( __GNUC__ ) \
+    && ( __GNUC__ > 4 || ( __GNUC__ == 4 && __GNUC_MINOR__ >= 9 )) \
+    && ( defined( __i386__ ) || defined( __x86_64__ ))
+#define HAVE_SSE2 1
+#include <emmintrin.h>
+#endif
+
+/* define HAVE_MMAP if mmap() is available, for example, with libcx */
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 #include <fluidsynth.h>
+/*
+ * HAVE_FLUID_SYNTH_SYSEX is defined by FLUIDSYNTH_SYSEX of Makefile if
+ * fluid_synth_sysex() is available, since 1.1.0
+ */
+
 /* missed API declaration in 1.0.9 */
 FLUIDSYNTH_API
 int fluid_synth_channel_pressure( fluid_synth_t *synth, int chan, int val );
@@ -39,7 +64,7 @@ int fluid_synth_channel_pressure( fluid_synth_t *synth, int chan, int val );
 #include "kmididec.h"
 
 /* OS/2 real-time midi format */
-#define OS2MIDI 0xFFFF
+#define OS2MIDI KMDEC_FORMAT_OS2MIDI
 
 /**
  * Header information
@@ -67,6 +92,28 @@ typedef struct kmtrk
     uint8_t status;     /**< status byte */
 } KMTRK, *PKMTRK;
 
+/**
+ * Compiled MIDI event
+ */
+typedef struct kmevent
+{
+    uint32_t tick;      /**< absolute tick */
+    uint8_t status;     /**< status byte, 0 for a decoding error */
+    uint8_t data[ 2 ];  /**< data bytes, or meta type in data[ 0 ] */
+    uint32_t offset;    /**< offset of SysEx/meta data in a memory FD */
+    uint32_t length;    /**< length of SysEx/meta data */
+} KMEVENT, *PKMEVENT;
+
+/**
+ * Range of a stream read on demand
+ */
+typedef struct kmrange
+{
+    uint32_t start;     /**< start offset */
+    uint32_t end;       /**< end offset */
+    uint32_t length;    /**< offset filled up to */
+} KMRANGE, *PKMRANGE;
+
 /**
  * Memory FD
  */
@@ -76,13 +123,252 @@ typedef struct kmemfd
     uint32_t size;      /**< size of a buffer @a buffer in bytes */
     uint32_t length;    /**< bytes filled in a buffer @a buffer */
     uint32_t offset;    /**< current position */
+    int store;          /**< backing store of a buffer @a buffer */
+    bool stream;        /**< flag to read a file on demand */
+    bool eof;           /**< flag to indicate the end of a stream */
+    int fd;             /**< file descriptor of a stream */
+    PKMDECIOFUNCS io;   /**< IO functions of a stream */
+    uint32_t pos;       /**< position of @a fd if @a ranges are used */
+    PKMRANGE ranges;    /**< ranges read by seeking, NULL to read in order */
+    int rangeCount;     /**< a number of @a ranges */
+    PKMRANGE range;     /**< range of current position, which @a length is
+                             filled up to */
 } KMEMFD, *PKMEMFD;
 
+/* backing store of memory FD */
+#define MEMFD_ALLOC 0   /* allocated by memory FD */
+#define MEMFD_USER  1   /* owned by a caller */
+#define MEMFD_MAP   2   /* memory-mapped file */
+
+/**
+ * Buffers of MIDI data kept to reuse by a next load
+ */
+typedef struct kmspare
+{
+    uint8_t *buffer;        /**< buffer of a memory FD */
+    uint32_t bufferSize;    /**< size of @a buffer in bytes */
+    PKMEVENT events;        /**< array of compiled events */
+    uint32_t eventSize;     /**< allocated entries of @a events */
+} KMSPARE, *PKMSPARE;
+
+/* spare buffers of a decoder, NULL if not recycled */
+#define SPARE( dec )    (( dec )->recycle ? &( dec )->spare : NULL )
+
+/* filter of options */
+#define FILTER( opts )  (( opts ) ? ( opts )->filter : NULL )
+
+/* stream mode of options */
+#define STREAM( opts )  (( opts ) ? ( opts )->stream != 0 : false )
+
+/* render cache or loop is used */
+#define USE_CACHE( dec )    (( dec )->loop || ( dec )->cacheBudget > 0 )
+
+/* marker of a value not set */
+#define NOT_SET     0xFF
+
+/**
+ * Channel state
+ */
+typedef struct kmchstate
+{
+    uint8_t cc[ 128 ];      /**< values of controllers */
+    uint8_t program;        /**< program */
+    uint8_t pressure;       /**< channel pressure */
+    uint8_t bendRange[ 2 ]; /**< pitch bend sensitivity of RPN 0 */
+    uint8_t bend[ 2 ];      /**< pitch bend, LSB and MSB */
+} KMCHSTATE, *PKMCHSTATE;
+
+/**
+ * Snapshot of decoder state for seek index
+ */
+typedef struct kmsnapshot
+{
+    uint32_t eventPos;          /**< index of a next event to play */
+    uint32_t tick;              /**< tick */
+    uint64_t clock;             /**< clock in us */
+    uint64_t timeNum;           /**< time of tick in us/division */
+    uint64_t samplePos;         /**< samples elapsed */
+    uint32_t tempo;             /**< tempo in us/qn */
+    uint8_t numerator;          /**< numerator */
+    uint8_t denominator;        /**< denominator */
+    KMCHSTATE channels[ 16 ];   /**< states of channels */
+    uint8_t notes[ 16 ][ 128 ]; /**< velocities of sounding notes */
+} KMSNAPSHOT, *PKMSNAPSHOT;
+
+/**
+ * Entry of tempo map, where tempo or time signature changes
+ */
+typedef struct kmtempo
+{
+    uint32_t tick;          /**< tick of a change */
+    uint64_t timeNum;       /**< time of @a tick in us/division */
+    uint32_t tempo;         /**< tempo in us/qn */
+    uint8_t numerator;      /**< numerator */
+    uint8_t denominator;    /**< denominator */
+    uint32_t sigTick;       /**< tick where time signature is set */
+    uint32_t sigBar;        /**< bar at @a sigTick */
+} KMTEMPO, *PKMTEMPO;
+
+/**
+ * Sound font shared by decoders
+ */
+typedef struct kmsf2
+{
+    struct kmsf2 *next;         /**< next sound font */
+    char *name;                 /**< file name of a sound font */
+    int refCount;               /**< reference count */
+    int preloadCount;           /**< count of kmdecPreloadSoundFont() */
+    bool loading;               /**< being loaded without a lock */
+    fluid_settings_t *settings; /**< settings of @a synth */
+    fluid_synth_t *synth;       /**< synthesizer owning @a sfont */
+    fluid_sfont_t *sfont;       /**< loaded sound font */
+} KMSF2, *PKMSF2;
+
+/**
+ * Stem rendered by its own synthesizer
+ */
+typedef struct kmstem
+{
+    struct kmdec *dec;          /**< decoder owning this stem */
+    fluid_synth_t *synth;       /**< synthesizer of this stem */
+    int sf;                     /**< sound font file */
+    char *buffer;               /**< buffer for samples */
+    int bufSize;                /**< allocated size of buffer */
+    pthread_t thread;           /**< rendering thread */
+    bool threadStarted;         /**< @a thread is started */
+    bool silent;                /**< @a synth is silent */
+    fluid_voice_t **voices;     /**< buffer to count voices of @a synth */
+} KMSTEM, *PKMSTEM;
+
+/**
+ * Performance preset
+ */
+typedef struct kmpreset
+{
+    int polyphony;      /**< maximum voices */
+    int reverb;         /**< reverb, KMDEC_EFFECT_* */
+    int chorus;         /**< chorus, KMDEC_EFFECT_* */
+    int interpolation;  /**< interpolation, KMDEC_INTERP_* */
+} KMPRESET, *PKMPRESET;
+
+/**
+ * Where to render samples
+ */
+typedef struct kmout
+{
+    void *left;     /**< samples of a left channel */
+    void *right;    /**< samples of a right channel */
+    int incr;       /**< distance between samples of a channel */
+} KMOUT, *PKMOUT;
+
+/**
+ * Block of render cache
+ */
+typedef struct kmcacheblock
+{
+    char *data;     /**< rendered samples */
+    int fill;       /**< bytes filled from the start of a block */
+} KMCACHEBLOCK, *PKMCACHEBLOCK;
+
+/**
+ * Segment of parallel rendering
+ */
+typedef struct kmsegment
+{
+    char *buffer;   /**< rendered samples */
+    int len;        /**< length of @a buffer in bytes */
+    bool done;      /**< rendering finished */
+    int rc;         /**< result, 0 on success, -1 on error */
+} KMSEGMENT, *PKMSEGMENT;
+
+/**
+ * Parallel rendering in segments
+ */
+typedef struct kmparallel
+{
+    uint64_t segSamples;    /**< samples per segment */
+    uint64_t overlap;       /**< samples to warm up before a segment */
+    int frameSize;          /**< bytes per sample of output */
+    int segCount;           /**< a number of segments */
+    PKMSEGMENT segments;    /**< segments */
+    int next;               /**< next segment to render */
+    int written;            /**< segments written */
+    int window;             /**< segments rendered ahead of written ones */
+    bool failed;            /**< rendering failed */
+    pthread_mutex_t mutex;  /**< mutex for segments */
+    pthread_cond_t cond;    /**< cond for segments */
+} KMPARALLEL, *PKMPARALLEL;
+
+/**
+ * Worker of parallel rendering
+ */
+typedef struct kmworker
+{
+    PKMPARALLEL par;        /**< parallel rendering */
+    struct kmdec *seg;      /**< decoder of segments */
+    pthread_t thread;       /**< rendering thread */
+} KMWORKER, *PKMWORKER;
+
+/**
+ * Polyphase resampler
+ */
+typedef struct kmresampler
+{
+    int up;             /**< interpolation factor */
+    int down;           /**< decimation factor */
+    int channels;       /**< a number of channels */
+    float *coefs;       /**< taps of each of @a up phases */
+    float *in;          /**< input frames, interleaved */
+    int inSize;         /**< allocated frames of @a in */
+    int inCount;        /**< frames in @a in */
+    int inPos;          /**< frame in @a in at the next output */
+    int phase;          /**< phase of the next output, 0 to @a up - 1 */
+    bool eof;           /**< input reached the end */
+    int eofCount;       /**< frames in @a in at the end */
+} KMRESAMPLER, *PKMRESAMPLER;
+
+/**
+ * Live event
+ */
+typedef struct kmliveevent
+{
+    uint64_t pos;       /**< sample position to play at */
+    int offset;         /**< samples from the start of a next block */
+    uint8_t status;     /**< status byte */
+    uint8_t data[ 2 ];  /**< data bytes */
+} KMLIVEEVENT, *PKMLIVEEVENT;
+
+/* maximum number of live events not played yet */
+#define MAX_LIVE_EVENTS 256
+
+/**
+ * Queue of live events
+ */
+typedef struct kmlive
+{
+    pthread_mutex_t mutex;  /**< mutex for @a queue */
+    int queueCount;         /**< a number of events in @a queue */
+    KMLIVEEVENT queue[ MAX_LIVE_EVENTS ];   /**< events sent */
+    int pendingCount;       /**< a number of events in @a pending */
+    KMLIVEEVENT pending[ MAX_LIVE_EVENTS ]; /**< events to play, ordered by
+                                                 position, used only by a
+                                                 rendering thread */
+} KMLIVE, *PKMLIVE;
+
+/* maximum number of stems */
+#define MAX_STEMS   16
+
 /* defaul values */
 #define DEFAULT_TEMPO       500000 /* us/qn */
 #define DEFAULT_NUMERATOR   4
 #define DEFAULT_DENOMINATOR 4
 
+/* default of synth.polyphony */
+#define DEFAULT_POLYPHONY   256
+
+/* default MIDI clock in ms, the default of synth.min-note-length */
+#define DEFAULT_CLOCK_UNIT  10
+
 /* clocks per sec */
 #define CLOCK_BASE  INT64_C( 1000000 ) /* us */
 
@@ -99,18 +385,79 @@ typedef struct kmdec
     KMTHD header;   /**< header */
     PKMTRK tracks;  /**< array of a track */
 
+    KMDECFILTER filter;     /**< filter of events */
+
+    KMDECDATAFUNC dataFunc; /**< function to receive meta and SysEx events */
+    void *dataArg;          /**< argument to @a dataFunc */
+
+    PKMEVENT events;        /**< array of compiled events of all tracks */
+    uint32_t eventSize;     /**< allocated entries of @a events */
+    uint32_t eventCount;    /**< a number of compiled events */
+    uint32_t eventPos;      /**< index of a next event to play */
+
+    bool recycle;           /**< keep buffers of MIDI data across loads */
+    KMSPARE spare;          /**< buffers kept by the last load */
+
+    PKMTEMPO tempoMap;      /**< tempo map ordered by tick */
+    int tempoSize;          /**< allocated entries of @a tempoMap */
+    int tempoCount;         /**< a number of entries in @a tempoMap */
+    uint32_t tempoPos;      /**< index of a next event to map */
+    pthread_mutex_t tempoMutex; /**< mutex for a tempo map of a stream */
+    bool tempoInited;           /**< @a tempoMutex is initialized */
+
+    PKMTRK *heap;           /**< heap of tracks being compiled */
+    int heapCount;          /**< a number of tracks in @a heap */
+    bool compiling;         /**< flag to compile events on demand */
+    bool stream;            /**< flag to read MIDI files as streams */
+    bool streaming;         /**< flag to indicate duration is unknown */
+
     fluid_settings_t *settings; /**< setting of fluidsynth */
     fluid_synth_t *synth;       /**< synthesizer of fluidsynth */
     int sf;                     /**< sound font file */
+    char *sf2name;              /**< file name of a sound font */
+
+    fluid_synth_t *chSynth[ 16 ];   /**< synthesizer of each channel */
+
+    int stemCount;                  /**< a number of stems, 0 if no stems */
+    PKMSTEM stems;                  /**< stems, the first uses @a synth */
+    pthread_mutex_t stemMutex;      /**< mutex for rendering stems */
+    pthread_cond_t stemCond;        /**< cond to start rendering */
+    pthread_cond_t stemDoneCond;    /**< cond to finish rendering */
+    bool stemInited;                /**< mutex and conds are initialized */
+    uint32_t stemJob;               /**< serial of a rendering job */
+    int stemSamples;                /**< samples to render */
+    int stemPending;                /**< stems being rendered */
+    bool stemQuit;                  /**< request threads to quit */
 
     /** synthesize in float or in s16 */
     FLUIDSYNTH_API int ( *synth_write )( fluid_synth_t *, int,
                                          void *, int, int, void *, int, int );
 
     int clockUnit;  /**< us/MIDI clock */
+    int interp;     /**< interpolation method, -1 for default */
+    bool silent;    /**< synth is silent */
+    int timing;     /**< timing mode */
+    int polyphony;  /**< maximum voices of a synthesizer */
+
+    bool stats;         /**< collect statistics of rendering */
+    fluid_voice_t **voices; /**< buffer to count voices, NULL if no stats */
+    KMDECSTATS stat;    /**< statistics */
 
     int sampleRate; /**< sample rate */
     int sampleSize; /**< bytes per sample */
+    int bps;        /**< bits per sample */
+
+    bool convert;           /**< render in float, and convert to @a format */
+    int format;             /**< output format, KMDEC_BPS_* */
+    int dither;             /**< dither, KMDEC_DITHER_* */
+    bool sse2;              /**< SSE2 is available */
+    uint32_t ditherA[ 4 ];  /**< random states for dither */
+    uint32_t ditherB[ 4 ];  /**< random states for dither */
+    float *convBuf;         /**< buffer for samples to convert */
+    int convSize;           /**< allocated size of @a convBuf in bytes */
+
+    char *planarBuf;        /**< buffer for samples to deinterleave */
+    int planarSize;         /**< allocated size of @a planarBuf in bytes */
 
     uint32_t tempo;         /**< tempo in us/qn */
     uint8_t numerator;      /**< numerator */
@@ -120,17 +467,85 @@ typedef struct kmdec
     uint64_t clock;     /**< current clock in us */
     uint64_t duration;  /**< duration of MIDI file in us */
 
+    bool deferDuration;     /**< scan duration in background */
+    bool scanning;          /**< background scan is not adopted yet */
+    bool scanDone;          /**< background scan finished */
+    bool scanStop;          /**< request background scan to stop */
+    struct kmdec *scanDec;  /**< decoder state for background scan */
+    pthread_t scanThread;   /**< thread of background scan */
+    pthread_mutex_t scanMutex;  /**< mutex for adopting a scan */
+    bool scanInited;            /**< @a scanMutex is initialized */
+
+    uint64_t timeNum;   /**< time of current tick in us/division */
+    uint64_t samplePos; /**< samples elapsed in sample timing */
+
+    KMCHSTATE channels[ 16 ];   /**< states of channels */
+    uint8_t notes[ 16 ][ 128 ]; /**< velocities of sounding notes */
+
+    uint64_t loopStart;     /**< loop start in samples, 0 if no marks */
+    uint64_t loopEnd;       /**< loop end in samples, NO_LOOP if no marks */
+    bool loop;              /**< loop between loop points */
+
+    PKMCACHEBLOCK cache;    /**< blocks of render cache */
+    int cacheCount;         /**< allocated entries of @a cache */
+    size_t cacheBudget;     /**< memory budget of render cache in bytes */
+    size_t cacheUsed;       /**< memory used by render cache in bytes */
+    uint64_t outPos;        /**< samples output through render cache */
+    uint64_t renderPos;     /**< samples rendered through render cache */
+    uint64_t endPos;        /**< samples up to the end, NO_LOOP if unknown */
+
+    uint64_t seekInterval;      /**< interval of seek index in us */
+    PKMSNAPSHOT snapshots;      /**< seek index */
+    int snapshotSize;           /**< allocated entries of @a snapshots */
+    int snapshotCount;          /**< a number of snapshots */
+
     char *buffer;   /**< buffer for samples */
+    int bufSize;    /**< allocated size of buffer */
     int bufLen;     /**< legnth of buffer */
     int bufPos;     /**< position in buffer */
+
+    char *ring;             /**< ring buffer for asynchronous rendering */
+    uint32_t ringSize;      /**< size of ring, power of 2 */
+    uint32_t ringHead;      /**< write position, written by producer */
+    uint32_t ringTail;      /**< read position, written by consumer */
+    bool ringEof;           /**< producer finished */
+    uint64_t asyncClock;    /**< clock of producer at ringHead */
+    uint32_t asyncSeq;      /**< odd while updating asyncClock and ringHead */
+    bool asyncSleeping;     /**< producer is waiting for room */
+    bool asyncStop;         /**< request producer to stop */
+    bool asyncRunning;      /**< producer is running */
+    bool asyncInited;       /**< mutex and cond are initialized */
+    pthread_t asyncThread;          /**< producer thread */
+    pthread_mutex_t asyncMutex;     /**< mutex for waiting */
+    pthread_cond_t asyncCond;       /**< cond for waiting */
+
+    PKMLIVE live;   /**< queue of live events, NULL for none */
+
+    PKMRESAMPLER resampler; /**< resampler to an output rate, NULL if a
+                                 synthesizer renders at it */
 } KMDEC, *PKMDEC;
 
+/* marker of a loop point not set */
+#define NO_LOOP UINT64_MAX
+
 /* a mode for decode() */
-#define DECODE_SEEK    0    /* seek mode */
+#define DECODE_SEEK    0    /* seek mode, notes are not played */
 #define DECODE_PLAY    1    /* play mode */
+#define DECODE_SCAN    2    /* scan mode, only tempo is applied */
+
+/* GM percussion channel */
+#define PERCUSSION_CHANNEL  9
 
-static PKMEMFD memOpen( int fd, PKMDECIOFUNCS io );
+static PKMEMFD memOpen( int fd, PKMDECIOFUNCS io, PKMSPARE spare );
+static PKMEMFD memOpenStream( int fd, PKMDECIOFUNCS io );
+static PKMEMFD memOpenBuffer( const void *buf, size_t len );
+static PKMEMFD memOpenMap( const char *name );
 static int memClose( PKMEMFD mfd );
+static int memFill( PKMEMFD mfd, size_t need );
+static int memPeek( PKMEMFD mfd, uint32_t pos, void *buf, size_t n );
+static int memOpenRanges( PKMEMFD mfd, PKMTRK tracks, int count );
+static PKMRANGE memRange( PKMEMFD mfd, uint32_t pos );
+static size_t memView( PKMEMFD mfd, size_t n, const uint8_t **view );
 static int memRead( PKMEMFD mfd, void *buf, size_t n );
 static int memSeek( PKMEMFD mfd, long offset, int origin );
 static int memTell( PKMEMFD mfd );
@@ -138,30 +553,180 @@ static int memTell( PKMEMFD mfd );
 static int initMidiInfo( PKMDEC dec );
 static int reset( PKMDEC dec );
 
+static int addEvent( PKMDEC dec, uint32_t tick, uint8_t status,
+                     uint8_t data0, uint8_t data1,
+                     uint32_t offset, uint32_t length );
 static int readVarQ( PKMTRK track, int *val );
 static int decodeDelta( PKMTRK track);
+static int addChannelEvent( PKMTRK track, uint8_t status,
+                            uint8_t data0, uint8_t data1 );
 static int decodeMetaEvent( PKMTRK track);
 static int decodeEvent( PKMTRK track);
 static int decodeOS2SysExEvent( PKMTRK track );
 static int decodeOS2Event( PKMTRK track );
-static int decode( PKMDEC dec, int mode );
+static bool trackBefore( PKMTRK a, PKMTRK b );
+static void siftDown( PKMTRK *heap, int n, int i );
+static int startCompile( PKMDEC dec );
+static int compileEvents( PKMDEC dec, uint32_t count );
+static int compile( PKMDEC dec );
+static bool nextEvent( PKMDEC dec );
+static bool eventTempo( PKMDEC dec, PKMEVENT ev, uint32_t *tempo );
+static PKMTEMPO addTempo( PKMDEC dec, uint32_t tick );
+static int updateTempoMap( PKMDEC dec );
+static PKMTEMPO findTempo( PKMDEC dec, uint64_t key, bool time );
+static uint64_t mapTime( PKMTEMPO entry, uint32_t tick );
+static uint64_t mapSample( PKMDEC dec, uint32_t tick );
+static void lockTempo( PKMDEC dec );
+static void unlockTempo( PKMDEC dec );
+static PKMTEMPO findTick( PKMDEC dec, int ms, uint32_t *tick );
+static int playMetaEvent( PKMDEC dec, PKMEVENT ev );
+static int playOS2SysExEvent( PKMDEC dec, PKMEVENT ev );
+static int playEvent( PKMDEC dec, PKMEVENT ev, int mode );
+static int playEvents( PKMDEC dec, int mode );
+static bool hasVoices( fluid_synth_t *synth );
+static bool isQuiet( PKMDEC dec, const void *buf, int n );
+static void outInterleaved( PKMDEC dec, PKMOUT out, void *buf );
+static void synthWrite( PKMDEC dec, fluid_synth_t *synth, bool *silent,
+                        fluid_voice_t **voices, PKMOUT out, int samples );
+static int decode( PKMDEC dec, int mode, PKMOUT out, int samples );
+static uint64_t tickToSample( PKMDEC dec, uint32_t tick );
+static int decodeSample( PKMDEC dec, int mode, PKMOUT out, int wanted,
+                         uint64_t until );
+static void freeMidi( PKMDEC dec );
+static void releaseNotes( PKMDEC dec );
+static void restoreNotes( PKMDEC dec );
+static void controlChange( PKMCHSTATE state, uint8_t ctrl, uint8_t val );
+static uint64_t nowNs( void );
+static uint64_t statStart( PKMDEC dec );
+static void statEnd( PKMDEC dec, uint64_t *counter, uint64_t start );
+static void statAdd( PKMDEC dec, uint64_t *counter, uint64_t n );
+static void statVoices( PKMDEC dec, fluid_synth_t *synth,
+                        fluid_voice_t **voices );
+static void restoreChannel( PKMDEC dec, int ch );
+static uint64_t samplePosition( PKMDEC dec );
+static void scanLoopPoint( PKMDEC dec, PKMEVENT ev, uint64_t pos );
+static void mapDuration( PKMDEC dec );
+static int addSnapshot( PKMDEC dec );
+static int scanMidi( PKMDEC dec, bool *stop );
+static int scanDuration( PKMDEC dec );
+static void *scanProc( void *arg );
+static int startScan( PKMDEC dec );
+static void finishScan( PKMDEC dec, bool wait );
+static void stopScan( PKMDEC dec );
+static int prepareDuration( PKMDEC dec );
+static int setActive( fluid_settings_t *settings, const char *name,
+                      bool active );
+static void seedDither( PKMDEC dec, uint32_t seed );
+static int configure( PKMDEC dec, PKMDECAUDIOINFO pkai, PKMDECOPTIONS opts );
+static void setInterp( PKMDEC dec, fluid_synth_t *synth );
+static int openStems( PKMDEC dec, const char *sf2name, PKMDECOPTIONS opts );
+static void closeStems( PKMDEC dec );
+static void *stemProc( void *arg );
+static int renderStems( PKMDEC dec, int samples );
+static void mixStems( PKMDEC dec, void *buffer, int len );
+static int decodeStems( PKMDEC dec, void *buffers[], void *mix, int size );
+static int renderSync( PKMDEC dec, void *buffer, int size );
+static void deinterleave( PKMDEC dec, void *buffers[], int offset,
+                          const void *in, int samples );
+static int renderPlanar( PKMDEC dec, void *buffers[], int size );
+static int renderChannels( PKMDEC dec, void *buffers[], int size );
+static int growConv( PKMDEC dec, int size );
+static void floatToS16C( PKMDEC dec, int16_t *out, const float *in, int n );
+static void floatToS32C( int32_t *out, const float *in, int n );
+#ifdef HAVE_SSE2
+static void floatToS16SSE2( PKMDEC dec, int16_t *out, const float *in,
+                            int n );
+static void floatToS32SSE2( int32_t *out, const float *in, int n );
+#endif
+static void convert( PKMDEC dec, void *out, const float *in, int n );
+static int decodeConvert( PKMDEC dec, void *buffer, int size );
+static int decodeConvertPlanar( PKMDEC dec, void *buffers[], int size );
+static int decodeStemsConvert( PKMDEC dec, void *buffers[], int size );
+static void publishAsync( PKMDEC dec, uint32_t head );
+static void fillAsync( PKMDEC dec, uint32_t head, uint32_t tail,
+                       uint32_t chunk );
+static void *asyncProc( void *arg );
+static int startAsync( PKMDEC dec );
+static void stopAsync( PKMDEC dec );
+static int renderAsync( PKMDEC dec, void *buffer, int size );
+static int outSampleSize( PKMDEC dec );
+static int renderOut( PKMDEC dec, void *buffer, int size );
+static int seekRender( PKMDEC dec, uint64_t pos );
+static void storeCache( PKMDEC dec, uint64_t block, int offset,
+                        const void *buf, int len );
+static void clearCache( PKMDEC dec );
+static int decodeCached( PKMDEC dec, void *buffer, int size );
+static int decodeRendered( PKMDEC dec, void *buffer, int size );
+static double besselI0( double x );
+static int openResampler( PKMDEC dec, int inRate, int outRate,
+                          int channels );
+static void closeResampler( PKMDEC dec );
+static void resetResampler( PKMDEC dec );
+static int fillResampler( PKMDEC dec, int frames );
+static int resample( PKMDEC dec, float *out, int frames );
+static int decodeResampled( PKMDEC dec, void *buffer, int size );
+static int decodeResampledPlanar( PKMDEC dec, void *buffers[], int size );
+static uint64_t currentClock( PKMDEC dec );
+static int seekClock( PKMDEC dec, uint64_t clock );
+static int restoreSnapshot( PKMDEC dec, PKMSNAPSHOT snap );
+static PKMSNAPSHOT findSnapshot( PKMDEC dec, uint64_t clock );
+static void takeLiveEvents( PKMDEC dec );
+static uint64_t playLiveEvents( PKMDEC dec );
+static PKMDEC openSegment( PKMDEC dec );
+static void closeSegment( PKMDEC seg );
+static int renderSegment( PKMPARALLEL par, PKMDEC seg, int i );
+static void *segmentProc( void *arg );
+
+static int defaultOpen( const char *name );
+static KMDECIOFUNCS defaultIO;
 
 #define MEMFD_BUF_DELTA ( 64 * 1024 )
 
-static PKMEMFD memOpen( int fd, PKMDECIOFUNCS io )
+/* bytes to read a range of a stream at once at least */
+#define MEMFD_RANGE_DELTA   ( 4 * 1024 )
+
+static PKMEMFD memOpen( int fd, PKMDECIOFUNCS io, PKMSPARE spare )
 {
     PKMEMFD mfd;
     uint8_t *buffer;
+    long pos, end;
 
     mfd = calloc( 1, sizeof( *mfd ));
     if( !mfd )
         return NULL;
 
+    mfd->store = MEMFD_ALLOC;
+
+    /* read at once if a size is known */
+    pos = io->tell( fd );
+    if( pos != -1 && io->seek( fd, 0, KMDEC_SEEK_END ) != -1 )
+    {
+        end = io->tell( fd );
+
+        if( io->seek( fd, pos, KMDEC_SEEK_SET ) == -1 )
+            goto fail;
+
+        /* one more byte to see EOF without growing a buffer */
+        if( end > pos )
+            mfd->size = end - pos + 1;
+    }
+
+    /* reuse a spare buffer if large enough */
+    if( spare && spare->buffer && spare->bufferSize >= mfd->size )
+    {
+        mfd->buffer = spare->buffer;
+        mfd->size = spare->bufferSize;
+
+        spare->buffer = NULL;
+        spare->bufferSize = 0;
+    }
+
     while( 1 )
     {
-        if( mfd->length == mfd->size )
+        if( !mfd->buffer || mfd->length == mfd->size )
         {
-            mfd->size += MEMFD_BUF_DELTA;
+            if( mfd->buffer || mfd->size == 0 )
+                mfd->size = mfd->size ? mfd->size * 2 : MEMFD_BUF_DELTA;
 
             buffer = realloc( mfd->buffer, mfd->size );
             if( !buffer )
@@ -176,8 +741,8 @@ fail:
             mfd->buffer = buffer;
         }
 
-        int size = MEMFD_BUF_DELTA - ( mfd->length % MEMFD_BUF_DELTA );
-        int len = io->read( fd, mfd->buffer + mfd->length, size );
+        int len = io->read( fd, mfd->buffer + mfd->length,
+                            mfd->size - mfd->length );
 
         if( len == -1 )
             goto fail;
@@ -188,1133 +753,7023 @@ fail:
         mfd->length += len;
     }
 
-    /* shrink to fit */
-    buffer = realloc( mfd->buffer, mfd->length );
-    if( !buffer )
-        goto fail;
+    /* shrink to fit, unless kept to reuse */
+    if( !spare && mfd->length < mfd->size )
+    {
+        buffer = realloc( mfd->buffer, mfd->length );
+        if( !buffer )
+            goto fail;
 
-    mfd->buffer = buffer;
+        mfd->buffer = buffer;
+        mfd->size = mfd->length;
+    }
 
     return mfd;
 }
 
-static int memClose( PKMEMFD mfd )
+static PKMEMFD memOpenStream( int fd, PKMDECIOFUNCS io )
 {
+    PKMEMFD mfd;
+
+    mfd = calloc( 1, sizeof( *mfd ));
     if( !mfd )
-        return -1;
+        return NULL;
 
-    free( mfd->buffer );
-    free( mfd );
+    /* a buffer grows as MIDI data is read on demand */
+    mfd->store = MEMFD_ALLOC;
+    mfd->stream = true;
+    mfd->fd = fd;
+    mfd->io = io;
 
-    return 0;
+    return mfd;
 }
 
-static int memRead( PKMEMFD mfd, void *buf, size_t n )
+static PKMEMFD memOpenBuffer( const void *buf, size_t len )
 {
-    if( !mfd )
-        return -1;
+    PKMEMFD mfd;
 
-    if( n == 0 || mfd->length == mfd->offset )
-        return 0;
+    if( !buf || len > UINT32_MAX )
+        return NULL;
 
-    int len = MIN( n, mfd->length - mfd->offset );
+    mfd = calloc( 1, sizeof( *mfd ));
+    if( !mfd )
+        return NULL;
 
-    memcpy( buf, mfd->buffer + mfd->offset, len );
-    mfd->offset += len;
+    /* use a buffer of a caller in place */
+    mfd->buffer = ( uint8_t * )buf;
+    mfd->size = len;
+    mfd->length = len;
+    mfd->store = MEMFD_USER;
 
-    return len;
+    return mfd;
 }
 
-static int memSeek( PKMEMFD mfd, long offset, int origin )
+static PKMEMFD memOpenMap( const char *name )
 {
-    long pos;
+    PKMEMFD mfd;
+    int fd;
 
-    if( !mfd )
-        return -1;
+    fd = defaultOpen( name );
+    if( fd == -1 )
+        return NULL;
 
-    switch( origin )
-    {
-        case SEEK_SET:
-            pos = offset;
-            break;
+#ifdef HAVE_MMAP
+    struct stat st;
+    void *buffer;
 
-        case SEEK_CUR:
-            pos = mfd->offset + offset;
-            break;
+    if( fstat( fd, &st ) == -1 || st.st_size == 0 || st.st_size > UINT32_MAX
+        || ( buffer = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+                            fd, 0 )) == MAP_FAILED )
+    {
+        close( fd );
 
-        case SEEK_END:
-            pos = mfd->length + offset;
-            break;
+        return NULL;
     }
 
-    if( pos < 0 || pos > mfd->length )
-        return -1;
+    /* a mapping is kept after closing fd */
+    close( fd );
 
-    mfd->offset = pos;
+    mfd = calloc( 1, sizeof( *mfd ));
+    if( !mfd )
+    {
+        munmap( buffer, st.st_size );
 
-    return pos;
+        return NULL;
+    }
+
+    mfd->buffer = buffer;
+    mfd->size = st.st_size;
+    mfd->length = st.st_size;
+    mfd->store = MEMFD_MAP;
+#else
+    /* read at once instead */
+    mfd = memOpen( fd, &defaultIO, NULL );
+
+    close( fd );
+#endif
+
+    return mfd;
 }
 
-static int memTell( PKMEMFD mfd )
+static int memClose( PKMEMFD mfd )
 {
     if( !mfd )
         return -1;
 
-    return mfd->offset;
+    switch( mfd->store )
+    {
+        case MEMFD_ALLOC:
+            free( mfd->buffer );
+            break;
+
+#ifdef HAVE_MMAP
+        case MEMFD_MAP:
+            munmap( mfd->buffer, mfd->size );
+            break;
+#endif
+    }
+
+    free( mfd->ranges );
+    free( mfd );
+
+    return 0;
 }
 
 /**
- * Initialize header and track information
+ * Read a stream until a buffer has the given bytes or the end is reached
  *
- * @param[in] dec Pointer to decoder
+ * @param[in] mfd Memory FD of a stream
+ * @param[in] need Bytes wanted in a buffer
  * @return 0 on success, -1 on error
  */
-static int initMidiInfo( PKMDEC dec )
+static int memFill( PKMEMFD mfd, size_t need )
 {
-    PKMEMFD mfd = dec->mfd;
-    PKMTHD header = &dec->header;
-    PKMTRK *tracks = &dec->tracks;
-    uint8_t data[ 14 ];
-
-    if( memRead( mfd, data, 10 ) == -1 )
-        return -1;
-
-    /* Timing Generation Control of OS/2 real-time midi data ? */
-    if( memcmp( data, "\xF0\x00\x00\x3A\x03\x01\x18", 7 ) == 0
-        && data[ 9 ] == 0xF7 )
+    /* read a range at its position, but not beyond it */
+    if( mfd->ranges )
     {
-        header->format = OS2MIDI;
-        header->tracks = 1;
+        PKMRANGE r = mfd->range;
 
-        uint8_t pp = data[ 7 ] & 0x7F;
-        if( pp & 0x40 )
-            header->division = 24 / ((( pp & 0x3F ) + 1 ) * 3 );
-        else
-            header->division = 24 * ( pp + 1 );
+        if( !r )
+            return -1;
 
-        /*
-         * PPQN below 1 is not supported. If there are real cases, consider
-         * then.
-         */
-        if( header->division == 0 )
+        need = MIN( need, r->end );
+
+        while( r->length < need )
         {
-            fprintf( stderr, "Not supported time format\n");
-            return -1;
-        }
+            int len = -1;
 
-        PKMTRK track = calloc( 1, sizeof( *track ));
-        if( !track )
-            return -1;
+            if( mfd->pos == r->length
+                || mfd->io->seek( mfd->fd, r->length, KMDEC_SEEK_SET ) != -1 )
+                len = mfd->io->read( mfd->fd, mfd->buffer + r->length,
+                                     MIN( r->end - r->length,
+                                          MAX( need - r->length,
+                                               MEMFD_RANGE_DELTA )));
 
-        track->dec = dec;
-        track->start = memTell( mfd );
+            if( len <= 0 )
+            {
+                /* a range is ended at an error */
+                mfd->pos = UINT32_MAX;
+                r->end = r->length;
+                mfd->length = r->length;
 
-        if( memSeek( mfd, 0, SEEK_END ) == -1
-            || ( track->length = memTell( mfd ) - track->start,
-                memSeek( mfd, track->start, SEEK_SET ) == -1 ))
-        {
-            free( track );
+                return len;
+            }
 
-            return -1;
+            r->length += len;
+            mfd->pos = r->length;
         }
 
-        *tracks = track;
+        mfd->length = r->length;
 
         return 0;
     }
 
-    if( memRead( mfd, data + 10, 4 ) == -1 )
-        return -1;
-
-    if( memcmp( data, "MThd\x00\x00\x00\x06", 8 ) != 0 )
+    while( mfd->stream && !mfd->eof && mfd->length < need )
     {
-        fprintf( stderr, "Not supported MIDI file\n");
+        if( mfd->length == mfd->size )
+        {
+            uint32_t size = mfd->size ? mfd->size * 2 : MEMFD_BUF_DELTA;
+            uint8_t *buffer;
 
-        return -1;
-    }
+            if( size < mfd->size )
+                goto fail;
 
-    header->format = ntohs( *( uint16_t * )( data + 8 ));
-    header->tracks = ntohs( *( uint16_t * )( data + 10 ));
-    header->division = ntohs( *( uint16_t * )( data + 12 ));
+            buffer = realloc( mfd->buffer, size );
+            if( !buffer )
+                goto fail;
 
-    if( header->format >= 2 )
-    {
-        fprintf( stderr, "Not supported MIDI format\n");
+            mfd->buffer = buffer;
+            mfd->size = size;
+        }
 
-        return -1;
-    }
+        /* read a chunk at most not to wait for data not needed yet */
+        int len = mfd->io->read( mfd->fd, mfd->buffer + mfd->length,
+                                 MIN( mfd->size - mfd->length,
+                                      MEMFD_BUF_DELTA ));
 
-    if(( header->division >> 15 ) & 1)
-    {
-        fprintf( stderr, "Not supported time format\n");
+        if( len == -1 )
+            goto fail;
 
-        return -1;
+        if( len == 0 )
+            mfd->eof = true;
+
+        mfd->length += len;
     }
 
-    *tracks = calloc( header->tracks, sizeof( **tracks ));
-    if( !*tracks )
-        return -1;
+    return 0;
 
-    for( int i = 0; i < header->tracks; i++ )
-    {
-        PKMTRK track = ( *tracks ) + i;
-        if( memRead( mfd, data, 8 ) == -1
-            || memcmp( data, "MTrk", 4 ) != 0 )
-        {
 fail:
-            free( *tracks );
-            *tracks = NULL;
-
-            return -1;
-        }
-
-        track->dec = dec;
-        track->start = memTell( mfd );
-        track->length = ntohl( *( long * )( data + 4 ));
-        if( decodeDelta( track ) == -1 )
-            goto fail;
+    /* a stream is ended at an error */
+    mfd->eof = true;
 
-        if( memSeek( mfd, track->start + track->length, SEEK_SET ) == -1 )
-            goto fail;
-    }
-
-    return 0;
+    return -1;
 }
 
 /**
- * Reset decoder
+ * Get bytes at the current position without a copy
  *
- * @param[in] dec Pointer to a decoder
- * @return 0 on success, -1 on error
+ * @a view is valid until a memory FD is read again.
+ *
+ * @param[in] mfd Memory FD
+ * @param[in] n Bytes wanted
+ * @param[out] view Pointer to bytes at the current position
+ * @return Bytes available at @a view up to @a n
  */
-static int reset( PKMDEC dec )
+/**
+ * Read a stream at the given position without filling a buffer up to it
+ *
+ * @param[in] mfd Memory FD of a seekable stream
+ * @param[in] pos Position to read at
+ * @param[out] buf Where to store data
+ * @param[in] n Bytes to read
+ * @return Bytes read on success, -1 on error
+ */
+static int memPeek( PKMEMFD mfd, uint32_t pos, void *buf, size_t n )
 {
-    /* reset tracks */
-    for( int i = 0; i < dec->header.tracks; i++ )
+    /* in a buffer already ? */
+    if( pos <= mfd->length && n <= mfd->length - pos )
     {
-        PKMTRK track = dec->tracks + i;
+        memcpy( buf, mfd->buffer + pos, n );
 
-        track->offset = 0;
-        track->nextTick = 0;
+        return n;
+    }
 
-        if( memSeek( dec->mfd, track->start, SEEK_SET ) == -1 )
-            return -1;
+    if( mfd->pos != pos
+        && mfd->io->seek( mfd->fd, pos, KMDEC_SEEK_SET ) == -1 )
+        return -1;
 
-        if( dec->header.format != OS2MIDI && decodeDelta( track ) == -1 )
-            return -1;
+    mfd->pos = pos;
 
-        track->status = 0;
-    }
+    int total = 0;
 
-    /* reset fluidsynth */
-    fluid_synth_system_reset( dec->synth );
+    while( total < n )
+    {
+        int len = mfd->io->read( mfd->fd, ( uint8_t * )buf + total,
+                                 n - total );
 
-    /* reset to default values */
-    dec->tempo = DEFAULT_TEMPO;
-    dec->numerator = DEFAULT_NUMERATOR;
-    dec->denominator = DEFAULT_DENOMINATOR;
+        if( len == -1 )
+            return -1;
 
-    dec->tick = 0;
-    dec->clock = 0;
+        if( len == 0 )
+            break;
 
-    dec->bufLen = 0;
-    dec->bufPos = 0;
+        total += len;
+        mfd->pos += len;
+    }
 
-    return 0;
+    return total;
 }
 
 /**
- * Read varialbe qunatity
+ * Read tracks of a stream on demand at their positions
  *
- * @param[in] track Pointer to a track
- * @param[out] val Decoded integer
+ * A buffer is grown to hold all the tracks at their offsets, and data
+ * already read is kept.
+ *
+ * @param[in] mfd Memory FD of a seekable stream
+ * @param[in] tracks Tracks in order of offsets
+ * @param[in] count A number of @a tracks
  * @return 0 on success, -1 on error
  */
-static int readVarQ( PKMTRK track, int *val )
+static int memOpenRanges( PKMEMFD mfd, PKMTRK tracks, int count )
 {
-    PKMEMFD mfd = track->dec->mfd;
-    uint8_t b;
-    int count = 0;
-
-    int vq = 0;
+    uint32_t end = tracks[ count - 1 ].start + tracks[ count - 1 ].length;
 
-    do
+    if( end > mfd->size )
     {
-        if( count >= 4 || memRead( mfd, &b, 1 ) == -1 )
+        uint8_t *buffer = realloc( mfd->buffer, end );
+        if( !buffer )
             return -1;
-        count++;
-        track->offset++;
 
-        vq = ( vq << 7 ) | ( b & 0x7F );
-    } while( b & 0x80 );
+        mfd->buffer = buffer;
+        mfd->size = end;
+    }
 
-    *val = vq;
+    mfd->ranges = calloc( count, sizeof( *mfd->ranges ));
+    if( !mfd->ranges )
+        return -1;
+
+    for( int i = 0; i < count; i++ )
+    {
+        PKMRANGE r = mfd->ranges + i;
+
+        r->start = tracks[ i ].start;
+        r->end = tracks[ i ].start + tracks[ i ].length;
+        r->length = MAX( r->start, MIN( mfd->length, r->end ));
+    }
+
+    mfd->rangeCount = count;
+
+    /* not read in order any more */
+    mfd->range = memRange( mfd, mfd->offset );
+    if( mfd->range )
+        mfd->length = mfd->range->length;
 
     return 0;
 }
 
 /**
- * Decode delta time
+ * Find a range of a position
  *
- * @param[in] track Pointer to a track
- * @return 0 on success, -1 on error
+ * @param[in] mfd Memory FD reading ranges
+ * @param[in] pos Position
+ * @return Range including @a pos or ending at it, NULL if none
  */
-static int decodeDelta( PKMTRK track )
+static PKMRANGE memRange( PKMEMFD mfd, uint32_t pos )
 {
-    if( track->offset >= track->length )
+    PKMRANGE r = mfd->range;
+
+    /* mostly in the current range */
+    if( r && r->start <= pos && pos <= r->end )
+        return r;
+
+    for( int i = 0; i < mfd->rangeCount; i++ )
     {
-        track->nextTick = END_OF_TRACK;
+        r = mfd->ranges + i;
 
-        return 0;
+        if( r->start <= pos && pos <= r->end )
+            return r;
     }
 
-    int delta;
-    if( readVarQ( track, &delta ) == -1 )
-        return -1;
+    return NULL;
+}
 
-    /* accumulate delta time */
-    track->nextTick += delta;
+static size_t memView( PKMEMFD mfd, size_t n, const uint8_t **view )
+{
+    memFill( mfd, ( size_t )mfd->offset + n );
 
-    return 0;
+    *view = mfd->buffer + mfd->offset;
+
+    return MIN( n, mfd->length - mfd->offset );
 }
 
-/**
- * Decode meta event
- *
- * @param[in] track Pointer to a track
- * @return 0 on success, -1 on error
- */
-static int decodeMetaEvent( PKMTRK track )
+static int memRead( PKMEMFD mfd, void *buf, size_t n )
 {
-    PKMEMFD mfd = track->dec->mfd;
-    uint8_t type;
-    int len;
+    if( !mfd )
+        return -1;
 
-    if( track->offset >= track->length )
+    memFill( mfd, ( size_t )mfd->offset + n );
+
+    if( n == 0 || mfd->length == mfd->offset )
         return 0;
 
-    /* type */
-    if( memRead( mfd, &type, 1 ) == -1 )
-        return -1;
-    track->offset++;
+    int len = MIN( n, mfd->length - mfd->offset );
 
-    /* length */
-    if( readVarQ( track, &len ) == -1 )
-        return -1;
+    memcpy( buf, mfd->buffer + mfd->offset, len );
+    mfd->offset += len;
+
+    return len;
+}
 
-    uint8_t data[ len + 1 ];
-    data[ len ] = '\0';
+static int memSeek( PKMEMFD mfd, long offset, int origin )
+{
+    long pos;
 
-    if( memRead( mfd, data, len ) == -1 )
+    if( !mfd )
         return -1;
-    track->offset += len;
 
-    switch( type )
+    switch( origin )
     {
-        case 0x00: /* sequence number */
-            if( len != 2 )
-                return -1;
+        case SEEK_SET:
+            pos = offset;
             break;
 
-        case 0x01: /* text event */
-        case 0x02: /* copyright notice */
-        case 0x03: /* sequence/track name */
-        case 0x04: /* instrument name */
-        case 0x05: /* lyric */
-        case 0x06: /* marker */
-        case 0x07: /* cue point */
-            /* text */
+        case SEEK_CUR:
+            pos = mfd->offset + offset;
             break;
 
-        case 0x20: /* MIDI channel prefix */
-            if( len != 1 )
-                return -1;
+        case SEEK_END:
+            memFill( mfd, SIZE_MAX );
+            pos = mfd->length + offset;
             break;
 
-        case 0x2F: /* end of track */
-            if( len != 0 || track->offset != track->length )
-                return -1;
-            break;
+        default:
+            return -1;
+    }
 
-        case 0x51: /* set tempo */
-        {
-            if( len != 3 )
-                return -1;
+    /* a buffer is filled up to a range of a position */
+    if( mfd->ranges )
+    {
+        PKMRANGE r = pos >= 0 ? memRange( mfd, pos ) : NULL;
 
-            track->dec->tempo = data[ 0 ] << 16 | data[ 1 ] << 8 | data[ 2 ];
-            break;
-        }
+        if( !r )
+            return -1;
 
-        case 0x54: /* SMPTE offset */
-            if( len != 5 )
-                return -1;
-            break;
+        mfd->range = r;
+        mfd->length = r->length;
+    }
 
-        case 0x58: /* time signature */
-        {
-            if( len != 4 )
-                return -1;
+    if( pos >= 0 && pos > mfd->length )
+        memFill( mfd, pos );
 
-            PKMDEC dec = track->dec;
+    if( pos < 0 || pos > mfd->length )
+        return -1;
 
-            dec->numerator = data[ 0 ];
-            dec->denominator = 1 << data[ 1 ]; /* power of 2 */
-            break;
-        }
+    mfd->offset = pos;
 
-        case 0x59: /* key signature */
-            if( len != 2 )
-                return -1;
-            break;
+    return pos;
+}
 
-        case 0x7F: /* sequencer-specific meta-event */
-        /*
-         * Some MIDI files such as JSBLUES.MID in \MMOS2\SOUND, does not
-         * respect the format of type 0x7F. Disable the length check
-         */
-#if 0
-            if( len >= 5 );
-                return -1;
-#endif
-            break;
-    }
+static int memTell( PKMEMFD mfd )
+{
+    if( !mfd )
+        return -1;
 
-    return 0;
+    return mfd->offset;
 }
 
 /**
- * Decode event
+ * Initialize header and track information
  *
- * @param[in] track Pointer to a track
+ * @param[in] dec Pointer to decoder
  * @return 0 on success, -1 on error
  */
-static int decodeEvent( PKMTRK track )
+static int initMidiInfo( PKMDEC dec )
 {
-    PKMEMFD mfd = track->dec->mfd;
-    fluid_synth_t *synth = track->dec->synth;
-
-    uint8_t status;
-    uint8_t event;
-    uint8_t channel;
-    int len;
-
-    if( track->offset >= track->length )
-        return 0;
-
-    if( memSeek( mfd, track->start + track->offset, SEEK_SET ) == -1 )
-        return -1;
+    PKMEMFD mfd = dec->mfd;
+    PKMTHD header = &dec->header;
+    PKMTRK *tracks = &dec->tracks;
+    uint8_t data[ 14 ];
 
-    if( memRead( mfd, &status, 1 ) == -1 )
+    if( memRead( mfd, data, 10 ) == -1 )
         return -1;
-    track->offset++;
 
-    /* implicit status ? */
-    if( status < 0x80 )
+    /* Timing Generation Control of OS/2 real-time midi data ? */
+    if( memcmp( data, "\xF0\x00\x00\x3A\x03\x01\x18", 7 ) == 0
+        && data[ 9 ] == 0xF7 )
     {
-        status = track->status;
-        if( memSeek( mfd, -1, KMDEC_SEEK_CUR ) == -1 )
-            return -1;
-        track->offset--;
-    }
+        header->format = OS2MIDI;
+        header->tracks = 1;
 
-    if( status < 0x80 )
+        uint8_t pp = data[ 7 ] & 0x7F;
+        if( pp & 0x40 )
+            header->division = 24 / ((( pp & 0x3F ) + 1 ) * 3 );
+        else
+            header->division = 24 * ( pp + 1 );
+
+        /*
+         * PPQN below 1 is not supported. If there are real cases, consider
+         * then.
+         */
+        if( header->division == 0 )
+        {
+            fprintf( stderr, "Not supported time format\n");
+            return -1;
+        }
+
+        PKMTRK track = calloc( 1, sizeof( *track ));
+        if( !track )
+            return -1;
+
+        track->dec = dec;
+        track->start = memTell( mfd );
+
+        /* a stream ends where it is read to the end */
+        if( mfd->stream )
+            track->length = UINT32_MAX;
+        else if( memSeek( mfd, 0, SEEK_END ) == -1
+            || ( track->length = memTell( mfd ) - track->start,
+                memSeek( mfd, track->start, SEEK_SET ) == -1 ))
+        {
+            free( track );
+
+            return -1;
+        }
+
+        *tracks = track;
+
+        return 0;
+    }
+
+    if( memRead( mfd, data + 10, 4 ) == -1 )
         return -1;
 
-    if( status < 0xF0 )
-        track->status = status;
+    if( memcmp( data, "MThd\x00\x00\x00\x06", 8 ) != 0 )
+    {
+        fprintf( stderr, "Not supported MIDI file\n");
 
-    event   = status & 0xF0;
-    channel = status & 0x0F;
+        return -1;
+    }
 
-    /* calculate length of event data */
-    if( status == 0xF0 || status == 0xF7 )
+    header->format = ntohs( *( uint16_t * )( data + 8 ));
+    header->tracks = ntohs( *( uint16_t * )( data + 10 ));
+    header->division = ntohs( *( uint16_t * )( data + 12 ));
+
+    if( header->format >= 2 )
     {
-        if( readVarQ( track, &len ) == -1 )
+        fprintf( stderr, "Not supported MIDI format\n");
+
+        return -1;
+    }
+
+    if(( header->division >> 15 ) & 1)
+    {
+        fprintf( stderr, "Not supported time format\n");
+
+        return -1;
+    }
+
+    *tracks = calloc( header->tracks, sizeof( **tracks ));
+    if( !*tracks )
+        return -1;
+
+    /*
+     * headers of tracks of a seekable stream are read by seeking over
+     * tracks, which are read on demand later
+     */
+    bool seekable = mfd->stream && header->tracks > 1
+                    && mfd->io->seek( mfd->fd, mfd->length,
+                                      KMDEC_SEEK_SET ) != -1;
+    uint32_t pos = memTell( mfd );
+
+    mfd->pos = mfd->length;
+
+    for( int i = 0; i < header->tracks; i++ )
+    {
+        PKMTRK track = ( *tracks ) + i;
+        if(( seekable ? memPeek( mfd, pos, data, 8 ) != 8
+                      : memRead( mfd, data, 8 ) == -1 )
+            || memcmp( data, "MTrk", 4 ) != 0 )
+        {
+fail:
+            free( *tracks );
+            *tracks = NULL;
+
             return -1;
+        }
+
+        track->dec = dec;
+        track->start = pos + 8;
+        track->length = ntohl( *( long * )( data + 4 ));
+
+        if( track->length > UINT32_MAX - track->start )
+            goto fail;
+
+        pos = track->start + track->length;
+
+        if( seekable )
+            continue;
+
+        /* the last track of a stream is read while it is decoded */
+        if( mfd->stream && i == header->tracks - 1 )
+            break;
+
+        if( memSeek( mfd, pos, SEEK_SET ) == -1 )
+            goto fail;
     }
-    else if( status == 0xFF )
+
+    if( seekable && memOpenRanges( mfd, *tracks, header->tracks ) == -1 )
+        goto fail;
+
+    return 0;
+}
+
+/**
+ * Reset decoder
+ *
+ * @param[in] dec Pointer to a decoder
+ * @return 0 on success, -1 on error
+ */
+static int reset( PKMDEC dec )
+{
+    /* rewind events */
+    dec->eventPos = 0;
+
+    /* reset fluidsynth if any, which also resets interpolation method */
+    if( dec->synth )
     {
-        if( decodeMetaEvent( track ) == -1 )
+        fluid_synth_system_reset( dec->synth );
+        setInterp( dec, dec->synth );
+    }
+
+    for( int i = 1; i < dec->stemCount; i++ )
+    {
+        fluid_synth_system_reset( dec->stems[ i ].synth );
+        setInterp( dec, dec->stems[ i ].synth );
+    }
+
+    /* see if silent again */
+    dec->silent = false;
+
+    for( int i = 0; i < dec->stemCount; i++ )
+        dec->stems[ i ].silent = false;
+
+    /* reset to default values */
+    dec->tempo = DEFAULT_TEMPO;
+    dec->numerator = DEFAULT_NUMERATOR;
+    dec->denominator = DEFAULT_DENOMINATOR;
+
+    dec->tick = 0;
+    dec->clock = 0;
+
+    dec->timeNum = 0;
+    dec->samplePos = 0;
+
+    memset( dec->channels, NOT_SET, sizeof( dec->channels ));
+    memset( dec->notes, 0, sizeof( dec->notes ));
+
+    dec->bufLen = 0;
+    dec->bufPos = 0;
+
+    /* positions of live events are not valid any more */
+    if( dec->live )
+        dec->live->pendingCount = 0;
+
+    return 0;
+}
+
+/**
+ * Append a compiled event
+ *
+ * @param[in] dec Pointer to a decoder
+ * @param[in] tick Absolute tick of an event
+ * @param[in] status Status byte
+ * @param[in] data0 First data byte
+ * @param[in] data1 Second data byte
+ * @param[in] offset Offset of SysEx/meta data in a memory FD
+ * @param[in] length Length of SysEx/meta data
+ * @return 0 on success, -1 on error
+ */
+static int addEvent( PKMDEC dec, uint32_t tick, uint8_t status,
+                     uint8_t data0, uint8_t data1,
+                     uint32_t offset, uint32_t length )
+{
+    if( dec->eventCount == dec->eventSize )
+    {
+        uint32_t size = dec->eventSize ? dec->eventSize * 2 : 1024;
+        PKMEVENT events = realloc( dec->events, size * sizeof( *events ));
+
+        if( !events )
             return -1;
 
-        len = 0;
+        dec->events = events;
+        dec->eventSize = size;
     }
-    else
+
+    PKMEVENT ev = dec->events + dec->eventCount++;
+
+    /* count events, not including an end of events for a broken one */
+    if( status >= 0xF0 )
+        dec->stat.events[ status == 0xFF ? KMDEC_EVENT_META
+                                         : KMDEC_EVENT_SYSEX ]++;
+    else if( status >= 0x80 )
+        dec->stat.events[( status >> 4 ) - 8 ]++;
+
+    ev->tick = tick;
+    ev->status = status;
+    ev->data[ 0 ] = data0;
+    ev->data[ 1 ] = data1;
+    ev->offset = offset;
+    ev->length = length;
+
+    return 0;
+}
+
+/**
+ * Read varialbe qunatity
+ *
+ * @param[in] track Pointer to a track
+ * @param[out] val Decoded integer
+ * @return 0 on success, -1 on error
+ */
+static int readVarQ( PKMTRK track, int *val )
+{
+    PKMEMFD mfd = track->dec->mfd;
+    uint8_t b;
+    int count = 0;
+
+    int vq = 0;
+
+    do
     {
-        len = 2;
-        /*
-         * status 0xF2, event 0x80, 0x90, 0xA0, 0xB0, 0xE0: len = 2
-         * status 0xF3, event 0xC0, 0xD0: len = 1
-         * status 0xF1, 0xF4, 0xF5, 0xF6, 0xF8 - 0xFE: len = 0
-         */
-        if( status == 0xF3 || event == 0xC0 || event == 0xD0 )
-            len = 1;
-        else if( status == 0xF1 || ( status >= 0xF4 && status <= 0xF6 )
-                 || ( status >= 0xF8 && status <= 0xFE ))
-            len = 0;
+        if( count >= 4 || memRead( mfd, &b, 1 ) != 1 )
+            return -1;
+        count++;
+        track->offset++;
+
+        vq = ( vq << 7 ) | ( b & 0x7F );
+    } while( b & 0x80 );
+
+    *val = vq;
+
+    return 0;
+}
+
+/**
+ * Decode delta time
+ *
+ * @param[in] track Pointer to a track
+ * @return 0 on success, -1 on error
+ */
+static int decodeDelta( PKMTRK track )
+{
+    if( track->offset >= track->length )
+    {
+        track->nextTick = END_OF_TRACK;
+
+        return 0;
     }
 
-    uint8_t data[ len ];
+    int delta;
+    if( readVarQ( track, &delta ) == -1 )
+        return -1;
+
+    /* accumulate delta time */
+    track->nextTick += delta;
+
+    return 0;
+}
+
+/**
+ * Append a channel event unless it is filtered out
+ *
+ * @param[in] track Pointer to a track
+ * @param[in] status Status byte
+ * @param[in] data0 First data byte
+ * @param[in] data1 Second data byte
+ * @return 0 on success, -1 on error
+ */
+static int addChannelEvent( PKMTRK track, uint8_t status,
+                            uint8_t data0, uint8_t data1 )
+{
+    PKMDEC dec = track->dec;
+    PKMDECFILTER filter = &dec->filter;
+    int index = track - dec->tracks;
+
+    if(( filter->muteChannels >> ( status & 0x0F )) & 1 )
+        return 0;
+
+    if( index < 64 && (( filter->muteTracks >> index ) & 1 ))
+        return 0;
+
+    if( filter->func
+        && !filter->func( filter->arg, index, status, data0, data1 ))
+        return 0;
+
+    return addEvent( dec, track->nextTick, status, data0, data1, 0, 0 );
+}
+
+/**
+ * Decode meta event
+ *
+ * @param[in] track Pointer to a track
+ * @return 0 on success, -1 on error
+ */
+static int decodeMetaEvent( PKMTRK track )
+{
+    PKMEMFD mfd = track->dec->mfd;
+    uint8_t type;
+    int len;
+
+    if( track->offset >= track->length )
+        return 0;
+
+    /* type */
+    if( memRead( mfd, &type, 1 ) != 1 )
+        return -1;
+    track->offset++;
+
+    /* length */
+    if( readVarQ( track, &len ) == -1 )
+        return -1;
+
+    if( len > track->length - track->offset )
+        return -1;
+
+    uint32_t offset = track->start + track->offset;
+
+    if( memSeek( mfd, len, SEEK_CUR ) == -1 )
+        return -1;
+    track->offset += len;
+
+    switch( type )
+    {
+        case 0x00: /* sequence number */
+            if( len != 2 )
+                return -1;
+            break;
+
+        case 0x01: /* text event */
+        case 0x02: /* copyright notice */
+        case 0x03: /* sequence/track name */
+        case 0x04: /* instrument name */
+        case 0x05: /* lyric */
+        case 0x06: /* marker */
+        case 0x07: /* cue point */
+            /* text */
+            break;
+
+        case 0x20: /* MIDI channel prefix */
+            if( len != 1 )
+                return -1;
+            break;
+
+        case 0x2F: /* end of track */
+            if( len != 0 || track->offset != track->length )
+                return -1;
+            break;
+
+        case 0x51: /* set tempo */
+            if( len != 3 )
+                return -1;
+            break;
+
+        case 0x54: /* SMPTE offset */
+            if( len != 5 )
+                return -1;
+            break;
+
+        case 0x58: /* time signature */
+            if( len != 4 )
+                return -1;
+            break;
+
+        case 0x59: /* key signature */
+            if( len != 2 )
+                return -1;
+            break;
+
+        case 0x7F: /* sequencer-specific meta-event */
+        /*
+         * Some MIDI files such as JSBLUES.MID in \MMOS2\SOUND, does not
+         * respect the format of type 0x7F. Disable the length check
+         */
+#if 0
+            if( len >= 5 );
+                return -1;
+#endif
+            break;
+    }
+
+    return addEvent( track->dec, track->nextTick, 0xFF, type, 0,
+                     offset, len );
+}
+
+/**
+ * Decode event
+ *
+ * @param[in] track Pointer to a track
+ * @return 0 on success, -1 on error
+ */
+static int decodeEvent( PKMTRK track )
+{
+    PKMEMFD mfd = track->dec->mfd;
+
+    uint8_t status;
+    uint8_t event;
+    int len;
+
+    if( track->offset >= track->length )
+    {
+        track->nextTick = END_OF_TRACK;
+
+        return 0;
+    }
+
+    if( memSeek( mfd, track->start + track->offset, SEEK_SET ) == -1 )
+        return -1;
+
+    if( memRead( mfd, &status, 1 ) != 1 )
+        return -1;
+    track->offset++;
+
+    /* implicit status ? */
+    if( status < 0x80 )
+    {
+        status = track->status;
+        if( memSeek( mfd, -1, KMDEC_SEEK_CUR ) == -1 )
+            return -1;
+        track->offset--;
+    }
+
+    if( status < 0x80 )
+        return -1;
+
+    if( status < 0xF0 )
+        track->status = status;
+
+    event = status & 0xF0;
+
+    /* calculate length of event data */
+    if( status == 0xF0 || status == 0xF7 )
+    {
+        if( readVarQ( track, &len ) == -1 )
+            return -1;
+
+        if( len > track->length - track->offset )
+            return -1;
+
+        uint32_t offset = track->start + track->offset;
+
+        /* skip first, to read data of a stream */
+        if( memSeek( mfd, len, SEEK_CUR ) == -1 )
+            return -1;
+        track->offset += len;
+
+        /* check F0 SysEx syntax which should end with F7 EOX */
+        if( status == 0xF0
+            && ( len == 0 || mfd->buffer[ offset + len - 1 ] != 0xF7 ))
+            return -1;
+
+        if( addEvent( track->dec, track->nextTick, status, 0, 0,
+                      offset, len ) == -1 )
+            return -1;
+    }
+    else if( status == 0xFF )
+    {
+        if( decodeMetaEvent( track ) == -1 )
+            return -1;
+    }
+    else
+    {
+        uint8_t data[ 2 ] = { 0, 0 };
+
+        len = 2;
+        /*
+         * status 0xF2, event 0x80, 0x90, 0xA0, 0xB0, 0xE0: len = 2
+         * status 0xF3, event 0xC0, 0xD0: len = 1
+         * status 0xF1, 0xF4, 0xF5, 0xF6, 0xF8 - 0xFE: len = 0
+         */
+        if( status == 0xF3 || event == 0xC0 || event == 0xD0 )
+            len = 1;
+        else if( status == 0xF1 || ( status >= 0xF4 && status <= 0xF6 )
+                 || ( status >= 0xF8 && status <= 0xFE ))
+            len = 0;
+
+        if( memRead( mfd, data, len ) != len )
+            return -1;
+        track->offset += len;
+
+        /* system common and real-time messages are not passed */
+        if( event != 0xF0
+            && addChannelEvent( track, status,
+                                data[ 0 ] & 0x7F, data[ 1 ] & 0x7F ) == -1 )
+            return -1;
+    }
+
+    return decodeDelta( track );
+}
+
+/* bytes viewed at once while decoding OS/2 MIDI */
+#define OS2_VIEW_SIZE   256
+
+/**
+ * Skip bytes of a track
+ *
+ * @param[in] track Pointer to a track
+ * @param[in] n Bytes to skip
+ * @return 0 on success, -1 on error
+ */
+static int skipTrack( PKMTRK track, size_t n )
+{
+    if( memSeek( track->dec->mfd, n, SEEK_CUR ) == -1 )
+        return -1;
+
+    track->offset += n;
+
+    return 0;
+}
+
+/**
+ * Decode OS/2 SysEx event
+ *
+ * @param[in] track Pointer to a track at F0
+ * @return 0 on success, -1 on error
+ */
+static int decodeOS2SysExEvent( PKMTRK track )
+{
+    PKMEMFD mfd = track->dec->mfd;
+    const uint8_t *view;
+
+    /* F0, and known SysEx events end with 0xF7 in 9 bytes */
+    size_t len = memView( mfd, 10, &view );
+    const uint8_t *sysex = view + 1;
+    const uint8_t *eox = len > 1 ? memchr( sysex, 0xF7, len - 1 ) : NULL;
+
+    /* Ignore not supported SysEx event */
+    if( !eox )
+    {
+        if( len < 10 || skipTrack( track, len ) == -1 )
+            return -1;
+
+        while( 1 )
+        {
+            len = memView( mfd, OS2_VIEW_SIZE, &view );
+            if( len == 0 )
+                return -1;
+
+            eox = memchr( view, 0xF7, len );
+            if( eox )
+                return skipTrack( track, eox - view + 1 );
+
+            if( skipTrack( track, len ) == -1 )
+                return -1;
+        }
+    }
+
+    int i = eox - sysex;
+    uint32_t offset = track->start + track->offset + 1;
+
+    if( i > 3 && memcmp( sysex, "\x00\x00\x3A", 3 ) == 0 )
+    {
+        uint8_t type = sysex[ 3 ] & 0x7F;
+
+        if( type == 1 && i > 5 )    /* Timing Compression(Long) */
+        {
+            uint8_t ll = sysex[ 4 ] & 0x7F;
+            uint8_t mm = sysex[ 5 ] & 0x7F;
+
+            track->nextTick += mm << 7 | ll;
+        }
+        else if( type >= 7 )        /* Timing Compression(Short) */
+            track->nextTick += type;
+        else if( type == 3 )        /* Device Driver Control */
+        {
+            /* interpreted on playing */
+            if( addEvent( track->dec, track->nextTick, 0xF0, 0, 0,
+                          offset, i + 1 ) == -1 )
+                return -1;
+        }
+    }
+
+    return skipTrack( track, i + 2 );
+}
+
+/**
+ * Decode OS/2 event
+ *
+ * Timing clocks and SysEx events are consumed in a run up to a channel
+ * event, straight from a buffer.
+ *
+ * @param[in] track Pointer to a track
+ * @return 0 on success, -1 on error
+ */
+static int decodeOS2Event( PKMTRK track )
+{
+    PKMEMFD mfd = track->dec->mfd;
+    const uint8_t *view;
+    size_t len;
+
+    while( 1 )
+    {
+        len = track->offset < track->length ?
+              memView( mfd, MIN( OS2_VIEW_SIZE,
+                                 track->length - track->offset ), &view ) :
+              0;
+
+        if( len == 0 )
+        {
+            /* mark the end, timing clocks may follow the last event */
+            if( addEvent( track->dec, track->nextTick, 0xFF, 0x2F, 0,
+                          0, 0 ) == -1 )
+                return -1;
+
+            track->nextTick = END_OF_TRACK;
+
+            return 0;
+        }
+
+        if( view[ 0 ] < 0xF0 )
+            break;
+
+        if( view[ 0 ] == 0xF0 )
+        {
+            if( decodeOS2SysExEvent( track ) == -1 )
+                return -1;
+
+            continue;
+        }
+
+        /* a run of timing clocks, and other system messages */
+        size_t n = 0;
+        size_t clocks = 0;
+
+        for( ; n < len && view[ n ] > 0xF0; n++ )
+        {
+            if( view[ n ] == 0xF8 )
+                clocks++;
+            else
+            {
+                /* data of MTC quarter frame, song position and song select */
+                size_t size = view[ n ] == 0xF2 ? 2 :
+                              view[ n ] == 0xF1 || view[ n ] == 0xF3 ? 1 : 0;
+
+                /* continue on the next view, or drop a truncated one */
+                if( n + size >= len )
+                {
+                    if( n == 0 )
+                        n = len;
+
+                    break;
+                }
+
+                n += size;
+            }
+        }
+
+        track->nextTick += clocks;
+
+        if( skipTrack( track, n ) == -1 )
+            return -1;
+    }
+
+    uint8_t status = view[ 0 ];
+    size_t pos = 1;
+
+    /* implicit status ? */
+    if( status < 0x80 )
+    {
+        status = track->status;
+        pos = 0;
+    }
+
+    if( status < 0x80 )
+        return -1;
+
+    track->status = status;
+
+    /*
+     * status event 0x80, 0x90, 0xA0, 0xB0, 0xE0: len = 2
+     * status event 0xC0, 0xD0: len = 1
+     */
+    uint8_t event = status & 0xF0;
+    size_t size = ( event == 0xC0 || event == 0xD0 ) ? 1 : 2;
+    uint8_t data[ 2 ] = { 0, 0 };
+
+    if( len < pos + size )
+        return -1;
+
+    memcpy( data, view + pos, size );
+
+    if( skipTrack( track, pos + size ) == -1 )
+        return -1;
+
+    return addChannelEvent( track, status,
+                            data[ 0 ] & 0x7F, data[ 1 ] & 0x7F );
+}
+
+/**
+ * Check if a track should be played before other track
+ *
+ * @param[in] a Pointer to a track
+ * @param[in] b Pointer to other track
+ * @return true if @a a is before @a b, otherwise false
+ */
+static bool trackBefore( PKMTRK a, PKMTRK b )
+{
+    /* keep order of tracks on the same tick */
+    return a->nextTick < b->nextTick
+           || ( a->nextTick == b->nextTick && a < b );
+}
+
+/**
+ * Move down a track in a min-heap of next ticks
+ *
+ * @param[in] heap Min-heap of tracks
+ * @param[in] n A number of tracks in @a heap
+ * @param[in] i Index of a track to move down
+ */
+static void siftDown( PKMTRK *heap, int n, int i )
+{
+    PKMTRK track = heap[ i ];
+
+    while( 1 )
+    {
+        int child = 2 * i + 1;
+
+        if( child >= n )
+            break;
+
+        if( child + 1 < n && trackBefore( heap[ child + 1 ], heap[ child ]))
+            child++;
+
+        if( !trackBefore( heap[ child ], track ))
+            break;
+
+        heap[ i ] = heap[ child ];
+        i = child;
+    }
+
+    heap[ i ] = track;
+}
+
+/**
+ * Start to compile the tracks into one array of events ordered by tick
+ *
+ * @param[in] dec Pointer to a decoder
+ * @return 0 on success, -1 on error
+ */
+static int startCompile( PKMDEC dec )
+{
+    bool os2 = dec->header.format == OS2MIDI;
+    PKMTRK *heap;
+    int n = 0;
+
+    heap = malloc( dec->header.tracks * sizeof( *heap ));
+    if( !heap && dec->header.tracks > 0 )
+        return -1;
+
+    for( int i = 0; i < dec->header.tracks; i++ )
+    {
+        PKMTRK track = dec->tracks + i;
+
+        track->offset = 0;
+        track->nextTick = 0;
+        track->status = 0;
+
+        if( memSeek( dec->mfd, track->start, SEEK_SET ) == -1
+            || ( !os2 && decodeDelta( track ) == -1 ))
+        {
+            free( heap );
+
+            return -1;
+        }
+
+        if( track->nextTick != END_OF_TRACK )
+            heap[ n++ ] = track;
+    }
+
+    for( int i = n / 2 - 1; i >= 0; i-- )
+        siftDown( heap, n, i );
+
+    dec->heap = heap;
+    dec->heapCount = n;
+    dec->compiling = true;
+
+    return 0;
+}
+
+/**
+ * Compile events of the tracks being compiled
+ *
+ * @param[in] dec Pointer to a decoder
+ * @param[in] count A number of events to compile at least
+ * @return 0 on success, -1 on error
+ */
+static int compileEvents( PKMDEC dec, uint32_t count )
+{
+    bool os2 = dec->header.format == OS2MIDI;
+    PKMTRK *heap = dec->heap;
+    uint32_t until = dec->eventCount + MIN( count,
+                                            UINT32_MAX - dec->eventCount );
+    int rc = 0;
+
+    /* merge tracks until all the tracks are finished */
+    while( dec->heapCount > 0 && dec->eventCount < until )
+    {
+        PKMTRK next = heap[ 0 ];
+
+        if(( os2 ? decodeOS2Event( next ) : decodeEvent( next )) == -1 )
+        {
+            /* stop playing at a broken event */
+            if( addEvent( dec, next->nextTick, 0, 0, 0, 0, 0 ) == -1 )
+            {
+                rc = -1;
+                break;
+            }
+
+            next->nextTick = END_OF_TRACK;
+        }
+
+        /* drop a finished track */
+        if( next->nextTick == END_OF_TRACK )
+            heap[ 0 ] = heap[ --dec->heapCount ];
+
+        siftDown( heap, dec->heapCount, 0 );
+    }
+
+    if( rc == 0 && updateTempoMap( dec ) == -1 )
+        rc = -1;
+
+    if( rc == -1 || dec->heapCount == 0 )
+    {
+        free( dec->heap );
+
+        dec->heap = NULL;
+        dec->heapCount = 0;
+        dec->compiling = false;
+    }
+
+    return rc;
+}
+
+/**
+ * Compile all the tracks into one array of events ordered by tick
+ *
+ * @param[in] dec Pointer to a decoder
+ * @return 0 on success, -1 on error
+ */
+static int compile( PKMDEC dec )
+{
+    if( startCompile( dec ) == -1 )
+        return -1;
+
+    return compileEvents( dec, UINT32_MAX );
+}
+
+/* events compiled at once while a stream is played */
+#define COMPILE_EVENTS  256
+
+/**
+ * Check if there is a next event to play, compiling more on demand
+ *
+ * @param[in] dec Pointer to a decoder
+ * @return true if there is, otherwise false
+ */
+static bool nextEvent( PKMDEC dec )
+{
+    while( dec->eventPos == dec->eventCount && dec->compiling )
+    {
+        if( compileEvents( dec, COMPILE_EVENTS ) == -1 )
+            break;
+    }
+
+    return dec->eventPos < dec->eventCount;
+}
+
+/**
+ * Get tempo set by an event
+ *
+ * @param[in] dec Pointer to a decoder
+ * @param[in] ev Pointer to an event
+ * @param[out] tempo Tempo in us/qn
+ * @return true if @a ev sets valid tempo, otherwise false leaving @a tempo
+ */
+static bool eventTempo( PKMDEC dec, PKMEVENT ev, uint32_t *tempo )
+{
+    uint8_t *data = dec->mfd->buffer + ev->offset;
+
+    if( ev->status == 0xFF && ev->data[ 0 ] == 0x51 )  /* set tempo */
+    {
+        uint32_t t = data[ 0 ] << 16 | data[ 1 ] << 8 | data[ 2 ];
+
+        /* ticks are timed by tempo */
+        if( t == 0 )
+            return false;
+
+        *tempo = t;
+
+        return true;
+    }
+
+    /* F0 of OS/2 SysEx was skipped already */
+    if( ev->status == 0xF0 && dec->header.format == OS2MIDI
+        && ev->length > 7 && data[ 4 ] == 2 )           /* Tempo Control */
+    {
+        uint8_t tl = data[ 5 ] & 0x7F;
+        uint8_t tm = data[ 6 ] & 0x7F;
+        int bpm = ( tm << 7 | tl ) / 10;
+
+        /* ignore tempo below 1 bpm */
+        if( bpm == 0 )
+            return false;
+
+        *tempo = 60 * 1000000 / bpm;
+
+        return true;
+    }
+
+    return false;
+}
+
+/* entries of tempo map to grow at once */
+#define TEMPO_MAP_DELTA 64
+
+/**
+ * Get an entry of tempo map at a tick, adding it after the last one
+ *
+ * @param[in] dec Pointer to a decoder
+ * @param[in] tick Tick of an entry, not before the last one
+ * @return Pointer to an entry on success, NULL on error
+ */
+static PKMTEMPO addTempo( PKMDEC dec, uint32_t tick )
+{
+    PKMTEMPO last = dec->tempoMap + dec->tempoCount - 1;
+
+    if( last->tick == tick )
+        return last;
+
+    if( dec->tempoCount == dec->tempoSize )
+    {
+        int size = dec->tempoSize + TEMPO_MAP_DELTA;
+
+        PKMTEMPO map = realloc( dec->tempoMap, size * sizeof( *map ));
+        if( !map )
+            return NULL;
+
+        dec->tempoMap = map;
+        dec->tempoSize = size;
+
+        last = map + dec->tempoCount - 1;
+    }
+
+    PKMTEMPO entry = last + 1;
+
+    *entry = *last;
+    entry->tick = tick;
+    entry->timeNum = mapTime( last, tick );
+
+    dec->tempoCount++;
+
+    return entry;
+}
+
+/* ticks per beat and bar of an entry of tempo map */
+#define BEAT_TICKS( dec, entry ) \
+    MAX( 4 * ( dec )->header.division / MAX(( entry )->denominator, 1 ), 1 )
+#define BAR_TICKS( dec, entry ) \
+    ( BEAT_TICKS( dec, entry ) * MAX(( entry )->numerator, 1 ))
+
+/**
+ * Add tempo and time signature of events compiled newly to tempo map
+ *
+ * @param[in] dec Pointer to a decoder
+ * @return 0 on success, -1 on error
+ */
+static int updateTempoMap( PKMDEC dec )
+{
+    int rc = 0;
+
+    lockTempo( dec );
+
+    if( dec->tempoCount == 0 )
+    {
+        dec->tempoMap = malloc( TEMPO_MAP_DELTA * sizeof( *dec->tempoMap ));
+        if( !dec->tempoMap )
+        {
+            rc = -1;
+            goto exit_unlock;
+        }
+
+        dec->tempoSize = TEMPO_MAP_DELTA;
+        dec->tempoCount = 1;
+
+        KMTEMPO first = {
+            .tempo = DEFAULT_TEMPO,
+            .numerator = DEFAULT_NUMERATOR,
+            .denominator = DEFAULT_DENOMINATOR,
+        };
+
+        dec->tempoMap[ 0 ] = first;
+    }
+
+    for( ; dec->tempoPos < dec->eventCount; dec->tempoPos++ )
+    {
+        PKMEVENT ev = dec->events + dec->tempoPos;
+        bool sig = ev->status == 0xFF && ev->data[ 0 ] == 0x58;
+        uint32_t tempo;
+
+        if( !eventTempo( dec, ev, &tempo ) && !sig )
+            continue;
+
+        PKMTEMPO entry = addTempo( dec, ev->tick );
+        if( !entry )
+        {
+            rc = -1;
+            break;
+        }
+
+        if( !sig )
+        {
+            entry->tempo = tempo;
+
+            continue;
+        }
+
+        /* a new bar starts at a new time signature */
+        uint32_t ticks = ev->tick - entry->sigTick;
+        uint32_t barTicks = BAR_TICKS( dec, entry );
+        uint8_t *data = dec->mfd->buffer + ev->offset;
+
+        entry->sigBar += ( ticks + barTicks - 1 ) / barTicks;
+        entry->sigTick = ev->tick;
+        entry->numerator = data[ 0 ];
+        entry->denominator = 1 << MIN( data[ 1 ], 7 ); /* power of 2 */
+    }
+
+exit_unlock:
+    unlockTempo( dec );
+
+    return rc;
+}
+
+/**
+ * Find an entry of tempo map in effect
+ *
+ * @param[in] dec Pointer to a decoder
+ * @param[in] key Tick, or time in us/division
+ * @param[in] time Flag to indicate @a key is time
+ * @return Pointer to the last entry at or before @a key
+ */
+static PKMTEMPO findTempo( PKMDEC dec, uint64_t key, bool time )
+{
+    int lo = 0;
+    int hi = dec->tempoCount - 1;
+
+    while( lo < hi )
+    {
+        int mid = lo + ( hi - lo + 1 ) / 2;
+        PKMTEMPO entry = dec->tempoMap + mid;
+
+        if(( time ? entry->timeNum : entry->tick ) <= key )
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+
+    return dec->tempoMap + lo;
+}
+
+/**
+ * Get time of a tick with an entry of tempo map
+ *
+ * @param[in] entry Pointer to an entry in effect at @a tick
+ * @param[in] tick Tick
+ * @return Time of @a tick in us/division
+ */
+static uint64_t mapTime( PKMTEMPO entry, uint32_t tick )
+{
+    return entry->timeNum + ( uint64_t )( tick - entry->tick ) * entry->tempo;
+}
+
+/**
+ * Convert a tick to a sample position with tempo map
+ *
+ * The same as tickToSample() while playing in sample timing.
+ *
+ * @param[in] dec Pointer to a decoder
+ * @param[in] tick Tick
+ * @return Sample position of @a tick
+ */
+static uint64_t mapSample( PKMDEC dec, uint32_t tick )
+{
+    uint64_t num = mapTime( findTempo( dec, tick, false ), tick );
+    uint64_t den = dec->header.division * CLOCK_BASE;
+
+    /* split to avoid overflow */
+    return num / den * dec->sampleRate + num % den * dec->sampleRate / den;
+}
+
+/* tempo map of a stream grows while it is played */
+static void lockTempo( PKMDEC dec )
+{
+    if( dec->tempoInited )
+        pthread_mutex_lock( &dec->tempoMutex );
+}
+
+static void unlockTempo( PKMDEC dec )
+{
+    if( dec->tempoInited )
+        pthread_mutex_unlock( &dec->tempoMutex );
+}
+
+/**
+ * Play meta event
+ *
+ * @param[in] dec Pointer to a decoder
+ * @param[in] ev Pointer to an event
+ * @return 0 on success, -1 on error
+ */
+static int playMetaEvent( PKMDEC dec, PKMEVENT ev )
+{
+    uint8_t *data = dec->mfd->buffer + ev->offset;
+
+    switch( ev->data[ 0 ])
+    {
+        case 0x51: /* set tempo */
+            eventTempo( dec, ev, &dec->tempo );
+            break;
+
+        case 0x58: /* time signature */
+            dec->numerator = data[ 0 ];
+            dec->denominator = 1 << MIN( data[ 1 ], 7 ); /* power of 2 */
+            break;
+    }
+
+    return 0;
+}
+
+/**
+ * Play OS/2 SysEx event
+ *
+ * @param[in] dec Pointer to a decoder
+ * @param[in] ev Pointer to an event
+ * @return 0 on success, -1 on error
+ */
+static int playOS2SysExEvent( PKMDEC dec, PKMEVENT ev )
+{
+    /* Tempo Control */
+    eventTempo( dec, ev, &dec->tempo );
+
+    return 0;
+}
+
+/**
+ * Play event
+ *
+ * @param[in] dec Pointer to a decoder
+ * @param[in] ev Pointer to an event
+ * @param[in] mode Decode mode
+ * @return 0 on success, -1 on error
+ */
+static int playEvent( PKMDEC dec, PKMEVENT ev, int mode )
+{
+    uint8_t event   = ev->status & 0xF0;
+    uint8_t channel = ev->status & 0x0F;
+    uint8_t *data   = ev->data;
+
+    /* route to a synthesizer of a stem */
+    fluid_synth_t *synth = dec->chSynth[ channel ];
+
+    PKMCHSTATE state = dec->channels + channel;
+
+    /* pass MIDI event to fluidsynth except when scanning */
+    switch( event )
+    {
+        case 0x00:  /* decoding error */
+            return -1;
+
+        case 0x80:  /* note off */
+            dec->notes[ channel ][ data[ 0 ]] = 0;
+
+            if( mode == DECODE_PLAY )
+                fluid_synth_noteoff( synth, channel, data[ 0 ]);
+            break;
+
+        case 0x90:  /* note on */
+            /* velocity 0 means note off */
+            dec->notes[ channel ][ data[ 0 ]] = data[ 1 ];
+
+            if( mode == DECODE_PLAY )
+                fluid_synth_noteon( synth, channel, data[ 0 ], data[ 1 ]);
+            break;
+
+        case 0xA0: /* polyphonic aftertouch */
+            /* not supported */
+            break;
+
+        case 0xB0:  /* control mode hnage */
+            /* all sound off, all notes off and mode messages */
+            if( data[ 0 ] == 120 || data[ 0 ] >= 123 )
+                memset( dec->notes[ channel ], 0,
+                        sizeof( dec->notes[ channel ]));
+
+            controlChange( state, data[ 0 ], data[ 1 ]);
+
+            if( mode == DECODE_SCAN )
+                scanLoopPoint( dec, ev, samplePosition( dec ));
+            else
+                fluid_synth_cc( synth, channel, data[ 0 ], data[ 1 ]);
+            break;
+
+        case 0xC0:  /* program change */
+            state->program = data[ 0 ];
+
+            if( mode != DECODE_SCAN )
+                fluid_synth_program_change( synth, channel, data[ 0 ]);
+            break;
+
+        case 0xD0:  /* channel key pressure */
+            state->pressure = data[ 0 ];
+
+            if( mode != DECODE_SCAN )
+                fluid_synth_channel_pressure( synth, channel, data[ 0 ]);
+            break;
+
+        case 0xE0: /* pitch bend */
+            state->bend[ 0 ] = data[ 0 ];
+            state->bend[ 1 ] = data[ 1 ];
+
+            if( mode != DECODE_SCAN )
+                fluid_synth_pitch_bend( synth, channel,
+                                        ( data[ 1 ] << 7) | data[ 0 ]);
+            break;
+
+        case 0xF0:
+            /* OS/2 SysEx events are for a driver */
+            if( mode == DECODE_PLAY && dec->dataFunc
+                && ( ev->status == 0xFF || dec->header.format != OS2MIDI ))
+                dec->dataFunc( dec->dataArg, ev->status,
+                               ev->status == 0xFF ? ev->data[ 0 ] : 0,
+                               dec->mfd->buffer + ev->offset, ev->length );
+
+            if( ev->status == 0xFF )
+            {
+                if( mode == DECODE_SCAN )
+                    scanLoopPoint( dec, ev, samplePosition( dec ));
+
+                return playMetaEvent( dec, ev );
+            }
+
+            if( dec->header.format == OS2MIDI )
+                return playOS2SysExEvent( dec, ev );
+
+#ifdef HAVE_FLUID_SYNTH_SYSEX
+            /* pass F0 SysEx events without F0 and F7 EOX */
+            if( ev->status == 0xF0 && mode != DECODE_SCAN )
+            {
+                const char *sysex = ( const char * )dec->mfd->buffer
+                                    + ev->offset;
+
+                fluid_synth_sysex( dec->synth, sysex, ev->length - 1,
+                                   NULL, NULL, NULL, 0 );
+
+                for( int i = 1; i < dec->stemCount; i++ )
+                    fluid_synth_sysex( dec->stems[ i ].synth, sysex,
+                                       ev->length - 1, NULL, NULL, NULL, 0 );
+            }
+#endif
+            break;
+    }
+
+    return 0;
+}
+
+/**
+ * Play events of the current tick
+ *
+ * @param[in] dec Pointer to a decoder
+ * @param[in] mode Decode mode
+ * @return 0 on success, -1 on error or on finished
+ */
+static int playEvents( PKMDEC dec, int mode )
+{
+    uint64_t start = mode == DECODE_PLAY ? statStart( dec ) : 0;
+    int rc = 0;
+
+    while( nextEvent( dec )
+           && dec->events[ dec->eventPos ].tick <= dec->tick )
+    {
+        if( playEvent( dec, dec->events + dec->eventPos, mode ) == -1 )
+        {
+            rc = -1;
+            break;
+        }
+
+        dec->eventPos++;
+    }
+
+    /* finished ? */
+    if( !nextEvent( dec ))
+    {
+        rc = -1;
+
+        /* the end of a stream is known now */
+        if( dec->streaming )
+        {
+            __atomic_store_n( &dec->duration, dec->clock,
+                              __ATOMIC_RELAXED );
+            __atomic_store_n( &dec->streaming, false, __ATOMIC_RELEASE );
+        }
+    }
+
+    if( mode == DECODE_PLAY )
+        statEnd( dec, &dec->stat.scheduleNs, start );
+
+    return rc;
+}
+
+/**
+ * Check if a synthesizer has voices playing
+ *
+ * @param[in] synth Synthesizer
+ * @return true if any voices are playing, otherwise false
+ */
+static bool hasVoices( fluid_synth_t *synth )
+{
+    fluid_voice_t *voices[ 1 ];
+
+    /* voices in release stage are also playing */
+    fluid_synth_get_voicelist( synth, voices, 1, -1 );
+
+    return voices[ 0 ] != NULL;
+}
+
+/* threshold of silence, less than 1 LSB of 16 bits */
+#define SILENCE_S16     1
+#define SILENCE_FLOAT   ( 1.0f / 32768 )
+
+/**
+ * Check if samples are inaudible
+ *
+ * @param[in] dec Pointer to a decoder
+ * @param[in] buf Samples
+ * @param[in] n A number of values in @a buf
+ * @return true if inaudible, otherwise false
+ */
+static bool isQuiet( PKMDEC dec, const void *buf, int n )
+{
+    if( dec->bps == KMDEC_BPS_FLOAT )
+    {
+        const float *p = buf;
+
+        for( int i = 0; i < n; i++ )
+        {
+            if( p[ i ] >= SILENCE_FLOAT || p[ i ] <= -SILENCE_FLOAT )
+                return false;
+        }
+    }
+    else
+    {
+        const int16_t *p = buf;
+
+        for( int i = 0; i < n; i++ )
+        {
+            if( p[ i ] > SILENCE_S16 || p[ i ] < -SILENCE_S16 )
+                return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Set where to render interleaved samples
+ *
+ * @param[in] dec Pointer to a decoder
+ * @param[out] out Where to render samples
+ * @param[in] buf Buffer for interleaved samples
+ */
+static void outInterleaved( PKMDEC dec, PKMOUT out, void *buf )
+{
+    out->left = buf;
+    out->right = ( char * )buf + ( dec->bps >> 3 );
+    out->incr = 2;
+}
+
+/**
+ * Render samples, or fill silence without synthesis
+ *
+ * A synthesizer is silent if no voices are playing, and reverb and chorus
+ * have decayed inaudibly.
+ *
+ * @param[in] dec Pointer to a decoder
+ * @param[in] synth Synthesizer to render
+ * @param[in, out] silent Flag if @a synth is silent
+ * @param[out] voices Buffer to count voices of @a synth
+ * @param[in] out Where to render samples
+ * @param[in] samples A number of samples to render
+ */
+static void synthWrite( PKMDEC dec, fluid_synth_t *synth, bool *silent,
+                        fluid_voice_t **voices, PKMOUT out, int samples )
+{
+    int len = samples * ( dec->bps >> 3 );
+    bool planar = out->incr == 1;
+    uint64_t start = statStart( dec );
+
+    statAdd( dec, &dec->stat.chunks, 1 );
+    statAdd( dec, &dec->stat.samples, samples );
+
+    /* notes may have been played since the last rendering */
+    if( *silent && !hasVoices( synth ))
+    {
+        if( planar )
+        {
+            memset( out->left, 0, len );
+            memset( out->right, 0, len );
+        }
+        else
+            memset( out->left, 0, len * 2 );
+
+        statEnd( dec, &dec->stat.synthNs, start );
+
+        return;
+    }
+
+    dec->synth_write( synth, samples, out->left, 0, out->incr,
+                      out->right, 0, out->incr );
+
+    *silent = !hasVoices( synth )
+              && ( planar ? isQuiet( dec, out->left, samples )
+                            && isQuiet( dec, out->right, samples )
+                          : isQuiet( dec, out->left, samples * 2 ));
+
+    statEnd( dec, &dec->stat.synthNs, start );
+
+    statVoices( dec, synth, voices );
+}
+
+/**
+ * Decode MIDI messages
+ *
+ * In play mode, samples are rendered into @a out if it has room for all of
+ * them. Otherwise, they are rendered into the internal buffer.
+ *
+ * @param[in] dec Pointer to a decoder
+ * @param[in] mode Decode mode
+ * @param[in] out Where to render samples in play mode, or NULL
+ * @param[in] samples Room of @a out, or samples wanted by stems
+ * @return Samples rendered into @a out on success, -1 on error or on
+ *         finished
+ */
+static int decode( PKMDEC dec, int mode, PKMOUT out, int samples )
+{
+    if( dec->timing == KMDEC_TIMING_SAMPLE )
+        return decodeSample( dec, mode, out, samples, UINT64_MAX );
+
+    if( playEvents( dec, mode ) == -1 )
+        return -1;
+
+    /* live events are played at the start of a next step */
+    if( mode == DECODE_PLAY )
+        playLiveEvents( dec );
+
+    uint32_t nextTick = dec->events[ dec->eventPos ].tick;
+
+    int ticksPerSec = dec->header.division * CLOCK_BASE / dec->tempo;
+    int delta = ticksPerSec * dec->clockUnit / CLOCK_BASE;
+
+    /*
+     * delta should be 1 at least. Otherwise tick does not progress
+     * any more until tempo is changed to set delta to a value bigger
+     * than 0.
+     */
+    if( delta == 0 )
+        delta = 1;
+
+    if( dec->tick + delta > nextTick )
+        delta = nextTick - dec->tick;
+
+    int written = 0;
+
+    if( mode == DECODE_PLAY )
+    {
+        int room = samples;
+        int len;
+
+        samples = delta * dec->sampleRate / ticksPerSec;
+        len = samples * dec->sampleSize;
+
+        if( dec->stemCount > 0 )
+        {
+            if( renderStems( dec, samples ) == -1 )
+                return -1;
+        }
+        else if( out && samples <= room )
+        {
+            /* render directly */
+            synthWrite( dec, dec->synth, &dec->silent, dec->voices,
+                        out, samples );
+
+            written = samples;
+        }
+        else
+        {
+            /* grow only */
+            if( len > dec->bufSize )
+            {
+                char *buffer = realloc( dec->buffer, len );
+                if( !buffer )
+                    return -1;
+
+                dec->buffer = buffer;
+                dec->bufSize = len;
+            }
+
+            KMOUT internal;
+
+            outInterleaved( dec, &internal, dec->buffer );
+            synthWrite( dec, dec->synth, &dec->silent, dec->voices,
+                        &internal, samples );
+
+            dec->bufLen = len;
+            dec->bufPos = 0;
+        }
+    }
+
+    /* accumulate ticks */
+    dec->tick += delta;
+
+    /* accumulate clocks */
+    dec->clock += CLOCK_BASE * delta / ticksPerSec;
+
+    return written;
+}
+
+/**
+ * Get a sample position of a tick at or after the current tick
+ *
+ * @param[in] dec Pointer to a decoder
+ * @param[in] tick Tick
+ * @return Sample position of @a tick
+ */
+static uint64_t tickToSample( PKMDEC dec, uint32_t tick )
+{
+    /* time in us/division is exact, so there is no drift */
+    uint64_t num = dec->timeNum + ( uint64_t )( tick - dec->tick ) * dec->tempo;
+    uint64_t den = dec->header.division * CLOCK_BASE;
+
+    /* split to avoid overflow */
+    return num / den * dec->sampleRate + num % den * dec->sampleRate / den;
+}
+
+/**
+ * Decode MIDI messages with sample-accurate timing
+ *
+ * Samples are rendered up to the exact sample position of a next event,
+ * without a fixed clock grid. In play mode, samples are rendered into @a out
+ * as many as it can hold. If it cannot hold even one sample, one sample is
+ * rendered into the internal buffer.
+ *
+ * @param[in] dec Pointer to a decoder
+ * @param[in] mode Decode mode
+ * @param[in] out Where to render samples in play mode, or NULL
+ * @param[in] wanted Room of @a out, or samples wanted by stems
+ * @param[in] until Sample position not to advance beyond
+ * @return Samples rendered into @a out on success, -1 on error or on
+ *         finished
+ */
+static int decodeSample( PKMDEC dec, int mode, PKMOUT out, int wanted,
+                         uint64_t until )
+{
+    if( playEvents( dec, mode ) == -1 )
+        return -1;
+
+    /* stop at a next live event, too */
+    if( mode == DECODE_PLAY )
+        until = MIN( until, playLiveEvents( dec ));
+
+    uint32_t nextTick = dec->events[ dec->eventPos ].tick;
+    uint64_t nextSample = tickToSample( dec, nextTick );
+    uint64_t samples = MIN( nextSample, until ) - dec->samplePos;
+
+    int written = 0;
+
+    if( mode == DECODE_PLAY && samples > 0 )
+    {
+        int room = out ? wanted : 0;
+
+        if( dec->stemCount > 0 )
+        {
+            /* render as many as wanted into each stem */
+            samples = MIN( samples, ( uint64_t )MAX( wanted, 1 ));
+
+            if( renderStems( dec, samples ) == -1 )
+                return -1;
+        }
+        else if( room > 0 )
+        {
+            /* render directly */
+            samples = MIN( samples, ( uint64_t )room );
+
+            synthWrite( dec, dec->synth, &dec->silent, dec->voices,
+                        out, samples );
+
+            written = samples;
+        }
+        else
+        {
+            samples = 1;
+
+            if( dec->sampleSize > dec->bufSize )
+            {
+                char *buffer = realloc( dec->buffer, dec->sampleSize );
+                if( !buffer )
+                    return -1;
+
+                dec->buffer = buffer;
+                dec->bufSize = dec->sampleSize;
+            }
+
+            KMOUT internal;
+
+            outInterleaved( dec, &internal, dec->buffer );
+            synthWrite( dec, dec->synth, &dec->silent, dec->voices,
+                        &internal, samples );
+
+            dec->bufLen = dec->sampleSize;
+            dec->bufPos = 0;
+        }
+    }
+
+    dec->samplePos += samples;
+
+    /* reached a next event ? */
+    if( dec->samplePos == nextSample )
+    {
+        dec->timeNum += ( uint64_t )( nextTick - dec->tick ) * dec->tempo;
+        dec->tick = nextTick;
+    }
+
+    dec->clock = dec->samplePos * CLOCK_BASE / dec->sampleRate;
+
+    return written;
+}
+
+/**
+ * Get monotonic time
+ *
+ * @return Time in ns
+ */
+static uint64_t nowNs( void )
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+
+    if( clock_gettime( CLOCK_MONOTONIC, &ts ) == 0 )
+        return ts.tv_sec * UINT64_C( 1000000000 ) + ts.tv_nsec;
+#endif
+
+    struct timeval tv;
+
+    gettimeofday( &tv, NULL );
+
+    return tv.tv_sec * UINT64_C( 1000000000 ) + tv.tv_usec * 1000;
+}
+
+/**
+ * Start timing a phase
+ *
+ * @param[in] dec Pointer to a decoder
+ * @return Start time in ns, 0 if statistics are disabled
+ */
+static uint64_t statStart( PKMDEC dec )
+{
+    return dec->stats ? nowNs() : 0;
+}
+
+/**
+ * Finish timing a phase
+ *
+ * @param[in] dec Pointer to a decoder
+ * @param[in, out] counter Time spent in a phase
+ * @param[in] start Start time returned by statStart()
+ */
+static void statEnd( PKMDEC dec, uint64_t *counter, uint64_t start )
+{
+    if( dec->stats )
+        __atomic_add_fetch( counter, nowNs() - start, __ATOMIC_RELAXED );
+}
+
+/**
+ * Add to a counter of statistics
+ *
+ * Counters are updated atomically, because stems and a producer of
+ * asynchronous rendering update them in their own threads.
+ *
+ * @param[in] dec Pointer to a decoder
+ * @param[in, out] counter Counter
+ * @param[in] n Value to add
+ */
+static void statAdd( PKMDEC dec, uint64_t *counter, uint64_t n )
+{
+    if( dec->stats )
+        __atomic_add_fetch( counter, n, __ATOMIC_RELAXED );
+}
+
+/**
+ * Update peak active voices with voices of a synthesizer
+ *
+ * @param[in] dec Pointer to a decoder
+ * @param[in] synth Synthesizer
+ * @param[out] voices Buffer of at least polyphony + 1 entries
+ */
+static void statVoices( PKMDEC dec, fluid_synth_t *synth,
+                        fluid_voice_t **voices )
+{
+    if( !dec->stats )
+        return;
+
+    int count;
+
+    /* terminated by NULL if less than a buffer size */
+    fluid_synth_get_voicelist( synth, voices, dec->polyphony + 1, -1 );
+
+    for( count = 0; count <= dec->polyphony && voices[ count ]; count++ )
+        /* nothing */;
+
+    int peak = __atomic_load_n( &dec->stat.peakVoices, __ATOMIC_RELAXED );
+
+    while( count > peak
+           && !__atomic_compare_exchange_n( &dec->stat.peakVoices, &peak,
+                                            count, true, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED ))
+        /* nothing */;
+}
+
+/**
+ * Release notes sounding now without forgetting them
+ *
+ * @param[in] dec Pointer to a decoder
+ */
+static void releaseNotes( PKMDEC dec )
+{
+    for( int ch = 0; ch < 16; ch++ )
+    {
+        for( int key = 0; key < 128; key++ )
+        {
+            if( dec->notes[ ch ][ key ])
+                fluid_synth_noteoff( dec->chSynth[ ch ], ch, key );
+        }
+    }
+}
+
+/**
+ * Play notes which should be sounding at the current position
+ *
+ * @param[in] dec Pointer to a decoder
+ */
+static void restoreNotes( PKMDEC dec )
+{
+    for( int ch = 0; ch < 16; ch++ )
+    {
+        /* percussion notes are one-shot */
+        if( ch == PERCUSSION_CHANNEL )
+            continue;
+
+        for( int key = 0; key < 128; key++ )
+        {
+            if( dec->notes[ ch ][ key ])
+                fluid_synth_noteon( dec->chSynth[ ch ], ch, key,
+                                    dec->notes[ ch ][ key ]);
+        }
+    }
+}
+
+/**
+ * Update a channel state with a control change
+ *
+ * @param[in] state Pointer to a channel state
+ * @param[in] ctrl Controller number
+ * @param[in] val Value of a controller
+ */
+static void controlChange( PKMCHSTATE state, uint8_t ctrl, uint8_t val )
+{
+    /* channel mode messages do not carry a state */
+    if( ctrl >= 120 )
+    {
+        /* reset all controllers */
+        if( ctrl == 121 )
+        {
+            for( int i = 0; i < 120; i++ )
+            {
+                /* keep bank, volume, pan and effect depths */
+                if( i != 0 && i != 32 && i != 7 && i != 10
+                    && ( i < 91 || i > 95 ))
+                    state->cc[ i ] = NOT_SET;
+            }
+
+            state->pressure = NOT_SET;
+            state->bend[ 0 ] = state->bend[ 1 ] = NOT_SET;
+        }
+
+        return;
+    }
+
+    state->cc[ ctrl ] = val;
+
+    /* data entry for RPN 0, pitch bend sensitivity */
+    if(( ctrl == 6 || ctrl == 38 )
+       && state->cc[ 101 ] == 0 && state->cc[ 100 ] == 0 )
+        state->bendRange[ ctrl == 38 ] = val;
+}
+
+/**
+ * Pass a saved channel state to fluidsynth
+ *
+ * @param[in] dec Pointer to a decoder
+ * @param[in] ch Channel
+ */
+static void restoreChannel( PKMDEC dec, int ch )
+{
+    fluid_synth_t *synth = dec->chSynth[ ch ];
+    PKMCHSTATE state = dec->channels + ch;
+
+    /* bank select should precede program change */
+    if( state->cc[ 0 ] != NOT_SET )
+        fluid_synth_cc( synth, ch, 0, state->cc[ 0 ]);
+
+    if( state->cc[ 32 ] != NOT_SET )
+        fluid_synth_cc( synth, ch, 32, state->cc[ 32 ]);
+
+    if( state->program != NOT_SET )
+        fluid_synth_program_change( synth, ch, state->program );
+
+    if( state->bendRange[ 0 ] != NOT_SET )
+    {
+        fluid_synth_cc( synth, ch, 101, 0 );
+        fluid_synth_cc( synth, ch, 100, 0 );
+        fluid_synth_cc( synth, ch, 6, state->bendRange[ 0 ]);
+
+        if( state->bendRange[ 1 ] != NOT_SET )
+            fluid_synth_cc( synth, ch, 38, state->bendRange[ 1 ]);
+    }
+
+    for( int i = 0; i < 120; i++ )
+    {
+        /* skip bank select and data entry */
+        if( i == 0 || i == 32 || i == 6 || i == 38 || i == 96 || i == 97 )
+            continue;
+
+        if( state->cc[ i ] != NOT_SET )
+            fluid_synth_cc( synth, ch, i, state->cc[ i ]);
+    }
+
+    if( state->pressure != NOT_SET )
+        fluid_synth_channel_pressure( synth, ch, state->pressure );
+
+    if( state->bend[ 0 ] != NOT_SET )
+        fluid_synth_pitch_bend( synth, ch,
+                                ( state->bend[ 1 ] << 7 ) | state->bend[ 0 ]);
+}
+
+/**
+ * Get a sample position of the current clock
+ *
+ * @param[in] dec Pointer to a decoder
+ * @return Sample position
+ */
+static uint64_t samplePosition( PKMDEC dec )
+{
+    /* sample position is exact only in sample timing */
+    if( dec->timing == KMDEC_TIMING_SAMPLE )
+        return dec->samplePos;
+
+    return dec->clock * dec->sampleRate / CLOCK_BASE;
+}
+
+/**
+ * Record a loop point of an event while scanning
+ *
+ * CC111 and a marker of `loopStart' mark a loop start, and a marker of
+ * `loopEnd' marks a loop end. The first ones are used.
+ *
+ * @param[in] dec Pointer to a decoder
+ * @param[in] ev Pointer to an event
+ * @param[in] pos Sample position of @a ev
+ */
+static void scanLoopPoint( PKMDEC dec, PKMEVENT ev, uint64_t pos )
+{
+    const char *text = ( const char * )dec->mfd->buffer + ev->offset;
+
+    if(( ev->status & 0xF0 ) == 0xB0 )
+    {
+        if( ev->data[ 0 ] == 111 && dec->loopStart == 0 )
+            dec->loopStart = pos;
+    }
+    else if( ev->data[ 0 ] == 0x06 )    /* marker */
+    {
+        if( ev->length == 9 && !strncasecmp( text, "loopStart", 9 )
+            && dec->loopStart == 0 )
+            dec->loopStart = pos;
+        else if( ev->length == 7 && !strncasecmp( text, "loopEnd", 7 )
+                 && dec->loopEnd == NO_LOOP )
+            dec->loopEnd = pos;
+    }
+}
+
+/**
+ * Calculate duration and loop points with tempo map
+ *
+ * The same as scanMidi() without seek index in sample timing.
+ *
+ * @param[in] dec Pointer to a decoder
+ */
+static void mapDuration( PKMDEC dec )
+{
+    uint32_t end = 0;
+
+    dec->loopStart = 0;
+    dec->loopEnd = NO_LOOP;
+
+    for( uint32_t i = 0; i < dec->eventCount; i++ )
+    {
+        PKMEVENT ev = dec->events + i;
+
+        end = ev->tick;
+
+        /* stop at a broken event */
+        if( ev->status == 0x00 )
+            break;
+
+        if(( ev->status & 0xF0 ) == 0xB0 || ev->status == 0xFF )
+            scanLoopPoint( dec, ev, mapSample( dec, ev->tick ));
+    }
+
+    dec->duration = mapSample( dec, end ) * CLOCK_BASE / dec->sampleRate;
+}
+
+/**
+ * Append a snapshot of the current state to seek index
+ *
+ * @param[in] dec Pointer to a decoder
+ * @return 0 on success, -1 on error
+ */
+static int addSnapshot( PKMDEC dec )
+{
+    if( dec->snapshotCount == dec->snapshotSize )
+    {
+        int size = dec->snapshotSize ? dec->snapshotSize * 2 : 64;
+        PKMSNAPSHOT snapshots = realloc( dec->snapshots,
+                                         size * sizeof( *snapshots ));
+
+        if( !snapshots )
+            return -1;
+
+        dec->snapshots = snapshots;
+        dec->snapshotSize = size;
+    }
+
+    PKMSNAPSHOT snap = dec->snapshots + dec->snapshotCount++;
+
+    snap->eventPos = dec->eventPos;
+    snap->tick = dec->tick;
+    snap->clock = dec->clock;
+    snap->timeNum = dec->timeNum;
+    snap->samplePos = dec->samplePos;
+    snap->tempo = dec->tempo;
+    snap->numerator = dec->numerator;
+    snap->denominator = dec->denominator;
+    memcpy( snap->channels, dec->channels, sizeof( snap->channels ));
+    memcpy( snap->notes, dec->notes, sizeof( snap->notes ));
+
+    return 0;
+}
+
+/**
+ * Restore decoder state from a snapshot
+ *
+ * @param[in] dec Pointer to a decoder
+ * @param[in] snap Pointer to a snapshot
+ * @return 0 on success, -1 on error
+ */
+static int restoreSnapshot( PKMDEC dec, PKMSNAPSHOT snap )
+{
+    if( reset( dec ) == -1 )
+        return -1;
+
+    dec->eventPos = snap->eventPos;
+    dec->tick = snap->tick;
+    dec->clock = snap->clock;
+    dec->timeNum = snap->timeNum;
+    dec->samplePos = snap->samplePos;
+    dec->tempo = snap->tempo;
+    dec->numerator = snap->numerator;
+    dec->denominator = snap->denominator;
+    memcpy( dec->channels, snap->channels, sizeof( dec->channels ));
+    memcpy( dec->notes, snap->notes, sizeof( dec->notes ));
+
+    for( int ch = 0; ch < 16; ch++ )
+        restoreChannel( dec, ch );
+
+    return 0;
+}
+
+/**
+ * Find the last snapshot not after the given clock
+ *
+ * @param[in] dec Pointer to a decoder
+ * @param[in] clock Clock in us
+ * @return Pointer to a snapshot on success, NULL if not found
+ */
+static PKMSNAPSHOT findSnapshot( PKMDEC dec, uint64_t clock )
+{
+    int lo = 0;
+    int hi = dec->snapshotCount;
+
+    /* binary search of the first snapshot after clock */
+    while( lo < hi )
+    {
+        int mid = ( lo + hi ) / 2;
+
+        if( dec->snapshots[ mid ].clock <= clock )
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo > 0 ? dec->snapshots + lo - 1 : NULL;
+}
+
+static int defaultOpen( const char *name )
+{
+    return open( name, O_RDONLY | O_BINARY );
+}
+
+static int defaultRead( int fd, void *buf, size_t n )
+{
+    return read( fd, buf, n );
+}
+
+static int defaultSeek( int fd, long offset, int origin )
+{
+    static int origins[] = { SEEK_SET, SEEK_CUR, SEEK_END };
+
+    if( origin >= sizeof( origins ) / sizeof( origins[ 0 ]))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return lseek( fd, offset, origins[ origin ]);
+}
+
+static int defaultTell( int fd )
+{
+    return tell( fd );
+}
+
+static int defaultClose( int fd )
+{
+    return close( fd );
+}
+
+static KMDECIOFUNCS defaultIO = {
+    .open = defaultOpen,
+    .read = defaultRead,
+    .seek = defaultSeek,
+    .tell = defaultTell,
+    .close = defaultClose,
+};
+
+/* list of shared sound fonts */
+static PKMSF2 sf2List = NULL;
+static pthread_mutex_t sf2Mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sf2Cond = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Release a shared sound font with a lock held
+ *
+ * @param[in] sf2 Pointer to a shared sound font
+ */
+static void unrefSoundFont( PKMSF2 sf2 )
+{
+    if( --sf2->refCount == 0 )
+    {
+        PKMSF2 *p;
+
+        /* removed already if failed to load */
+        for( p = &sf2List; *p && *p != sf2; p = &( *p )->next )
+            /* nothing */;
+
+        if( *p )
+            *p = sf2->next;
+
+        delete_fluid_synth( sf2->synth );
+        if( sf2->settings )
+            delete_fluid_settings( sf2->settings );
+        free( sf2->name );
+        free( sf2 );
+    }
+}
+
+/**
+ * Get a shared sound font, load it if not loaded yet
+ *
+ * @param[in] name File name of a sound font
+ * @return Pointer to a shared sound font on success, NULL on error
+ */
+static PKMSF2 acquireSoundFont( const char *name )
+{
+    PKMSF2 sf2;
+
+    pthread_mutex_lock( &sf2Mutex );
+
+    for( sf2 = sf2List; sf2; sf2 = sf2->next )
+    {
+        if( strcmp( sf2->name, name ) == 0 )
+            break;
+    }
+
+    if( sf2 )
+    {
+        sf2->refCount++;
+
+        /* loaded by another thread */
+        while( sf2->loading )
+            pthread_cond_wait( &sf2Cond, &sf2Mutex );
+
+        if( !sf2->sfont )
+        {
+            unrefSoundFont( sf2 );
+
+            sf2 = NULL;
+        }
+
+        goto exit_unlock;
+    }
+
+    sf2 = calloc( 1, sizeof( *sf2 ));
+    if( !sf2 )
+        goto exit_unlock;
+
+    sf2->name = strdup( name );
+    if( !sf2->name )
+    {
+        free( sf2 );
+
+        sf2 = NULL;
+
+        goto exit_unlock;
+    }
+
+    /* others wait for a placeholder instead of a lock */
+    sf2->refCount = 1;
+    sf2->loading = true;
+
+    sf2->next = sf2List;
+    sf2List = sf2;
+
+    pthread_mutex_unlock( &sf2Mutex );
+
+    int id;
+    fluid_sfont_t *sfont = NULL;
+
+    /* a synthesizer only to own a sound font */
+    if(( sf2->settings = new_fluid_settings())
+       && ( sf2->synth = new_fluid_synth( sf2->settings ))
+       && ( id = fluid_synth_sfload( sf2->synth, name, 0 )) != -1 )
+        sfont = fluid_synth_get_sfont_by_id( sf2->synth, id );
+
+    pthread_mutex_lock( &sf2Mutex );
+
+    sf2->sfont = sfont;
+    sf2->loading = false;
+
+    pthread_cond_broadcast( &sf2Cond );
+
+    if( !sfont )
+    {
+        PKMSF2 *p;
+
+        /* not found by a next acquisition, which loads again */
+        for( p = &sf2List; *p != sf2; p = &( *p )->next )
+            /* nothing */;
+
+        *p = sf2->next;
+        sf2->next = NULL;
+
+        unrefSoundFont( sf2 );
+
+        sf2 = NULL;
+    }
+
+exit_unlock:
+    pthread_mutex_unlock( &sf2Mutex );
+
+    return sf2;
+}
+
+/**
+ * Release a shared sound font, unload it if not used any more
+ *
+ * @param[in] sf2 Pointer to a shared sound font
+ */
+static void releaseSoundFont( PKMSF2 sf2 )
+{
+    pthread_mutex_lock( &sf2Mutex );
+
+    unrefSoundFont( sf2 );
+
+    pthread_mutex_unlock( &sf2Mutex );
+}
+
+static int sharedSfontFree( fluid_sfont_t *sfont )
+{
+    releaseSoundFont( sfont->data );
+    free( sfont );
+
+    return 0;
+}
+
+static char *sharedSfontGetName( fluid_sfont_t *sfont )
+{
+    fluid_sfont_t *shared = (( PKMSF2 )sfont->data )->sfont;
+
+    return shared->get_name( shared );
+}
+
+static fluid_preset_t *sharedSfontGetPreset( fluid_sfont_t *sfont,
+                                             unsigned int bank,
+                                             unsigned int prenum )
+{
+    fluid_sfont_t *shared = (( PKMSF2 )sfont->data )->sfont;
+    fluid_preset_t *preset = shared->get_preset( shared, bank, prenum );
+
+    /* a preset belongs to a sound font of a caller synthesizer */
+    if( preset )
+        preset->sfont = sfont;
+
+    return preset;
+}
+
+static void sharedSfontIterationStart( fluid_sfont_t *sfont )
+{
+    fluid_sfont_t *shared = (( PKMSF2 )sfont->data )->sfont;
+
+    shared->iteration_start( shared );
+}
+
+static int sharedSfontIterationNext( fluid_sfont_t *sfont,
+                                     fluid_preset_t *preset )
+{
+    fluid_sfont_t *shared = (( PKMSF2 )sfont->data )->sfont;
+    int rc = shared->iteration_next( shared, preset );
+
+    if( rc )
+        preset->sfont = sfont;
+
+    return rc;
+}
+
+static int sharedLoaderFree( fluid_sfloader_t *loader )
+{
+    free( loader );
+
+    return 0;
+}
+
+/**
+ * Load a sound font for a synthesizer from shared sound fonts
+ *
+ * @param[in] loader Pointer to a sound font loader
+ * @param[in] filename File name of a sound font
+ * @return Pointer to a sound font on success, NULL to fall back to other
+ *         loaders
+ */
+static fluid_sfont_t *sharedLoaderLoad( fluid_sfloader_t *loader,
+                                        const char *filename )
+{
+    fluid_sfont_t *sfont;
+    PKMSF2 sf2;
+
+    sfont = calloc( 1, sizeof( *sfont ));
+    if( !sfont )
+        return NULL;
+
+    sf2 = acquireSoundFont( filename );
+    if( !sf2 )
+    {
+        free( sfont );
+
+        return NULL;
+    }
+
+    sfont->data = sf2;
+    sfont->free = sharedSfontFree;
+    sfont->get_name = sharedSfontGetName;
+    sfont->get_preset = sharedSfontGetPreset;
+    sfont->iteration_start = sharedSfontIterationStart;
+    sfont->iteration_next = sharedSfontIterationNext;
+
+    return sfont;
+}
+
+/**
+ * Let a synthesizer load sound fonts from shared sound fonts
+ *
+ * @param[in] synth Pointer to a synthesizer
+ * @return 0 on success, -1 on error
+ */
+static int addSharedLoader( fluid_synth_t *synth )
+{
+    fluid_sfloader_t *loader;
+
+    loader = calloc( 1, sizeof( *loader ));
+    if( !loader )
+        return -1;
+
+    loader->free = sharedLoaderFree;
+    loader->load = sharedLoaderLoad;
+
+    /* freed by fluidsynth */
+    fluid_synth_add_sfloader( synth, loader );
+
+    return 0;
+}
+
+/**
+ * Free MIDI data of a decoder
+ *
+ * @param[in] dec Pointer to a decoder
+ */
+static void freeMidi( PKMDEC dec )
+{
+    free( dec->snapshots );
+    free( dec->heap );
+    free( dec->events );
+    free( dec->tracks );
+
+    memClose( dec->mfd );
+
+    if( dec->closeFd )
+        dec->io->close( dec->fd );
+
+    dec->snapshots = NULL;
+    dec->snapshotSize = 0;
+    dec->snapshotCount = 0;
+
+    dec->events = NULL;
+    dec->eventSize = 0;
+    dec->eventCount = 0;
+
+    dec->heap = NULL;
+    dec->heapCount = 0;
+    dec->compiling = false;
+    dec->streaming = false;
+
+    lockTempo( dec );
+    free( dec->tempoMap );
+    dec->tempoMap = NULL;
+    dec->tempoSize = 0;
+    dec->tempoCount = 0;
+    dec->tempoPos = 0;
+    unlockTempo( dec );
+
+    dec->tracks = NULL;
+    dec->mfd = NULL;
+    dec->closeFd = false;
+}
+
+/**
+ * Load MIDI data in a memory FD into a new decoder without a synthesizer
+ *
+ * @param[in] mfd Memory FD of MIDI data, closed on error
+ * @param[in] fd File descriptor of a midi file, -1 if none
+ * @param[in] closeFd Flag to indicate to close fd
+ * @param[in] io IO functions to use
+ * @param[in] filter Filter of events, or NULL
+ * @param[in] spare Buffers to reuse, or NULL. Used ones are taken
+ * @return Decoder on success, NULL on error
+ */
+static PKMDEC newMidi( PKMEMFD mfd, int fd, bool closeFd, PKMDECIOFUNCS io,
+                       PKMDECFILTER filter, PKMSPARE spare )
+{
+    PKMDEC dec;
+
+    dec = calloc( 1, sizeof( *dec ));
+    if( !dec )
+    {
+        memClose( mfd );
+
+        if( closeFd )
+            io->close( fd );
+
+        return NULL;
+    }
+
+    /* init `sf' first in order to call kmdecClose() on failure */
+    dec->sf = -1;
+
+    dec->fd = fd;
+    dec->closeFd = closeFd;
+
+    dec->io = io;
+
+    /* events are filtered while compiled */
+    if( filter )
+        dec->filter = *filter;
+
+    dec->mfd = mfd;
+    if( !dec->mfd )
+        goto fail;
+
+    /* events are compiled into a spare array */
+    if( spare && spare->events )
+    {
+        dec->events = spare->events;
+        dec->eventSize = spare->eventSize;
+
+        spare->events = NULL;
+        spare->eventSize = 0;
+    }
+
+    /* parsing is timed always, because options are not known yet */
+    uint64_t start = nowNs();
+
+    if( initMidiInfo( dec ) == -1 )
+        goto fail;
+
+    /* a stream is compiled while it is played */
+    if(( mfd->stream ? startCompile( dec ) : compile( dec )) == -1 )
+        goto fail;
+
+    dec->stat.parseNs = nowNs() - start;
+
+    dec->clockUnit = DEFAULT_CLOCK_UNIT * ( CLOCK_BASE / 1000 );
+
+    return dec;
+
+fail:
+    kmdecClose( dec );
+
+    return NULL;
+}
+
+/**
+ * Load MIDI data into a new decoder without a synthesizer
+ *
+ * @param[in] fd File descriptor of a midi file
+ * @param[in] closeFd Flag to indicate to close fd
+ * @param[in] io IO functions to use
+ * @param[in] filter Filter of events, or NULL
+ * @param[in] stream Flag to read a file on demand
+ * @param[in] spare Buffers to reuse, or NULL. Used ones are taken
+ * @return Decoder on success, NULL on error
+ */
+static PKMDEC openMidi( int fd, bool closeFd, PKMDECIOFUNCS io,
+                        PKMDECFILTER filter, bool stream, PKMSPARE spare )
+{
+    if( !io )
+        io = &defaultIO;
+
+    return newMidi( stream ? memOpenStream( fd, io )
+                           : memOpen( fd, io, spare ),
+                    fd, closeFd, io, filter, spare );
+}
+
+/**
+ * Calculate duration, and build seek index if wanted
+ *
+ * Decoder is left at the end of MIDI.
+ *
+ * @param[in] dec Pointer to a decoder
+ * @param[in] stop Flag to stop scanning, or NULL
+ * @return 0 on success, -1 on error or on stopped
+ */
+static int scanMidi( PKMDEC dec, bool *stop )
+{
+    if( reset( dec ) == -1 )
+        return -1;
+
+    dec->loopStart = 0;
+    dec->loopEnd = NO_LOOP;
+
+    uint64_t snapshotClock = dec->seekInterval;
+
+    do
+    {
+        if( stop && __atomic_load_n( stop, __ATOMIC_RELAXED ))
+            return -1;
+
+        if( dec->seekInterval > 0 && dec->clock >= snapshotClock )
+        {
+            if( addSnapshot( dec ) == -1 )
+                return -1;
+
+            while( snapshotClock <= dec->clock )
+                snapshotClock += dec->seekInterval;
+        }
+    } while( decode( dec, DECODE_SCAN, NULL, 0 ) != -1 );
+
+    dec->duration = dec->clock;
+
+    return 0;
+}
+
+/**
+ * Calculate duration, and build seek index if wanted
+ *
+ * @param[in] dec Pointer to a decoder
+ * @return 0 on success, -1 on error
+ */
+static int scanDuration( PKMDEC dec )
+{
+    if( scanMidi( dec, NULL ) == -1 )
+        return -1;
+
+    /* reset decoder to intial status */
+    return reset( dec );
+}
+
+/**
+ * Thread of background scan
+ *
+ * @param[in] arg Pointer to a decoder
+ * @return NULL
+ */
+static void *scanProc( void *arg )
+{
+    PKMDEC dec = arg;
+    PKMDEC scan = dec->scanDec;
+
+    if( scanMidi( scan, &dec->scanStop ) == -1
+        && !__atomic_load_n( &dec->scanStop, __ATOMIC_RELAXED ))
+    {
+        /* out of memory for seek index, scan without it */
+        free( scan->snapshots );
+        scan->snapshots = NULL;
+        scan->snapshotSize = 0;
+        scan->snapshotCount = 0;
+
+        scan->seekInterval = 0;
+
+        scanMidi( scan, &dec->scanStop );
+    }
+
+    __atomic_store_n( &dec->scanDone, true, __ATOMIC_RELEASE );
+
+    return NULL;
+}
+
+/**
+ * Start scanning duration in background
+ *
+ * A scan runs on a decoder state of its own, sharing MIDI data read-only.
+ * Duration and seek index are adopted by finishScan().
+ *
+ * @param[in] dec Pointer to a decoder
+ * @return 0 on success, -1 on error
+ */
+static int startScan( PKMDEC dec )
+{
+    if( !dec->scanInited )
+    {
+        if( pthread_mutex_init( &dec->scanMutex, NULL ))
+            return -1;
+
+        dec->scanInited = true;
+    }
+
+    /* events are only scanned, so no synthesizers are needed */
+    PKMDEC scan = calloc( 1, sizeof( *scan ));
+    if( !scan )
+        return -1;
+
+    /* the rest is set by reset() and scanMidi() */
+    scan->mfd = dec->mfd;
+    scan->header = dec->header;
+    scan->events = dec->events;
+    scan->eventCount = dec->eventCount;
+    scan->timing = dec->timing;
+    scan->clockUnit = dec->clockUnit;
+    scan->sampleRate = dec->sampleRate;
+    scan->seekInterval = dec->seekInterval;
+
+    dec->scanDec = scan;
+    dec->scanDone = false;
+    dec->scanStop = false;
+
+    if( pthread_create( &dec->scanThread, NULL, scanProc, dec ))
+    {
+        dec->scanDec = NULL;
+        free( scan );
+
+        return -1;
+    }
+
+    __atomic_store_n( &dec->scanning, true, __ATOMIC_RELEASE );
+
+    return 0;
+}
+
+/**
+ * Adopt duration and seek index of a finished background scan
+ *
+ * A scan is adopted once, even if called from several threads.
+ *
+ * @param[in] dec Pointer to a decoder
+ * @param[in] wait Flag to wait for a scan to finish
+ */
+static void finishScan( PKMDEC dec, bool wait )
+{
+    if( !__atomic_load_n( &dec->scanning, __ATOMIC_ACQUIRE )
+        || ( !wait && !__atomic_load_n( &dec->scanDone, __ATOMIC_ACQUIRE )))
+        return;
+
+    /* do not wait for other thread adopting a scan on polling */
+    if( wait )
+        pthread_mutex_lock( &dec->scanMutex );
+    else if( pthread_mutex_trylock( &dec->scanMutex ))
+        return;
+
+    if( dec->scanning )
+    {
+        pthread_join( dec->scanThread, NULL );
+
+        PKMDEC scan = dec->scanDec;
+
+        dec->duration = scan->duration;
+        dec->loopStart = scan->loopStart;
+        dec->loopEnd = scan->loopEnd;
+
+        dec->snapshots = scan->snapshots;
+        dec->snapshotSize = scan->snapshotSize;
+        dec->snapshotCount = scan->snapshotCount;
+
+        free( scan );
+
+        dec->scanDec = NULL;
+
+        /* results are visible to whom sees the end of a scan */
+        __atomic_store_n( &dec->scanning, false, __ATOMIC_RELEASE );
+    }
+
+    pthread_mutex_unlock( &dec->scanMutex );
+}
+
+/**
+ * Stop a background scan, discarding its results
+ *
+ * @param[in] dec Pointer to a decoder
+ */
+static void stopScan( PKMDEC dec )
+{
+    if( !__atomic_load_n( &dec->scanning, __ATOMIC_ACQUIRE ))
+        return;
+
+    pthread_mutex_lock( &dec->scanMutex );
+
+    if( dec->scanning )
+    {
+        __atomic_store_n( &dec->scanStop, true, __ATOMIC_RELAXED );
+
+        pthread_join( dec->scanThread, NULL );
+
+        free( dec->scanDec->snapshots );
+        free( dec->scanDec );
+
+        dec->scanDec = NULL;
+
+        __atomic_store_n( &dec->scanning, false, __ATOMIC_RELEASE );
+    }
+
+    pthread_mutex_unlock( &dec->scanMutex );
+}
+
+/**
+ * Calculate duration now, or start scanning it in background
+ *
+ * @param[in] dec Pointer to a decoder
+ * @return 0 on success, -1 on error
+ */
+static int prepareDuration( PKMDEC dec )
+{
+    /* duration of a stream is known at the end of playing */
+    if( dec->compiling )
+    {
+        dec->streaming = true;
+
+        /* loop points are not scanned */
+        dec->loopStart = 0;
+        dec->loopEnd = NO_LOOP;
+
+        return reset( dec );
+    }
+
+    /* no need to play events without seek index in sample timing */
+    if( dec->timing == KMDEC_TIMING_SAMPLE && dec->seekInterval == 0 )
+    {
+        mapDuration( dec );
+
+        return reset( dec );
+    }
+
+    if( dec->deferDuration )
+    {
+        if( reset( dec ) == -1 )
+            return -1;
+
+        /* not known until a scan is adopted */
+        dec->loopStart = 0;
+        dec->loopEnd = NO_LOOP;
+
+        /* scan now if a thread is not available */
+        if( startScan( dec ) == 0 )
+            return 0;
+    }
+
+    return scanDuration( dec );
+}
+
+/**
+ * Set on or off a setting to activate a feature
+ *
+ * @param[in] settings Settings of fluidsynth
+ * @param[in] name Name of a setting
+ * @param[in] active Flag to activate
+ * @return 0 on success, -1 on error
+ */
+static int setActive( fluid_settings_t *settings, const char *name,
+                      bool active )
+{
+    /* a string before fluidsynth 1.1.0, an integer since then */
+    if( fluid_settings_setstr( settings, name, active ? "yes" : "no"))
+        return 0;
+
+    return fluid_settings_setint( settings, name, active ) ? 0 : -1;
+}
+
+/**
+ * Seed random states for dither
+ *
+ * @param[in] dec Pointer to a decoder
+ * @param[in] seed Seed, 0 for the initial states
+ */
+static void seedDither( PKMDEC dec, uint32_t seed )
+{
+    /* seeds of xorshift, should not be 0 */
+    for( int i = 0; i < 4; i++ )
+    {
+        dec->ditherA[ i ] = 0x9E3779B9 * ( i + 1 ) + 0x632BE5AB * seed;
+        dec->ditherB[ i ] = 0x85EBCA6B * ( i + 1 ) + 0xC2B2AE35 * seed;
+
+        if( dec->ditherA[ i ] == 0 )
+            dec->ditherA[ i ] = 1;
+
+        if( dec->ditherB[ i ] == 0 )
+            dec->ditherB[ i ] = 1;
+    }
+}
+
+/**
+ * Apply audio information and options to settings
+ *
+ * @param[in] dec Pointer to a decoder
+ * @param[in] pkai Pointer to audio information
+ * @param[in] opts Options to use
+ * @return 0 on success, -1 on error
+ */
+static int configure( PKMDEC dec, PKMDECAUDIOINFO pkai, PKMDECOPTIONS opts )
+{
+    static KMPRESET presets[] = {
+        /* KMDEC_PRESET_DEFAULT */
+        { 0, KMDEC_EFFECT_DEFAULT, KMDEC_EFFECT_DEFAULT, KMDEC_INTERP_DEFAULT },
+        /* KMDEC_PRESET_PREVIEW */
+        { 32, KMDEC_EFFECT_OFF, KMDEC_EFFECT_OFF, KMDEC_INTERP_LINEAR },
+        /* KMDEC_PRESET_REALTIME */
+        { 128, KMDEC_EFFECT_ON, KMDEC_EFFECT_ON, KMDEC_INTERP_4THORDER },
+        /* KMDEC_PRESET_OFFLINE_HQ */
+        { 256, KMDEC_EFFECT_ON, KMDEC_EFFECT_ON, KMDEC_INTERP_7THORDER },
+    };
+
+    fluid_settings_t *settings = dec->settings;
+    char *sampleFormat;
+    int bps = pkai->bps;
+    int rate = opts->renderRate ? opts->renderRate : pkai->sampleRate;
+
+    if( opts->dither < KMDEC_DITHER_DEFAULT
+        || opts->dither > KMDEC_DITHER_TPDF )
+        return -1;
+
+    if( opts->renderRate < 0 )
+        return -1;
+
+    /* samples are resampled in float */
+    bool resample = rate != pkai->sampleRate;
+
+    /* render in float, and convert in kmididec */
+    if(( bps == KMDEC_BPS_S16
+         && ( opts->dither != KMDEC_DITHER_DEFAULT || resample ))
+       || bps == KMDEC_BPS_S32 )
+    {
+        bps = KMDEC_BPS_FLOAT;
+
+        dec->convert = true;
+        dec->format = pkai->bps;
+        dec->dither = opts->dither;
+
+        seedDither( dec, 0 );
+
+#ifdef HAVE_SSE2
+        dec->sse2 = __builtin_cpu_supports("sse2");
+#endif
+    }
+
+    if( bps == KMDEC_BPS_S16 )
+    {
+        sampleFormat = "16bits";
+        dec->synth_write = fluid_synth_write_s16;
+    }
+    else if( bps == KMDEC_BPS_FLOAT )
+    {
+        sampleFormat = "float";
+        dec->synth_write = fluid_synth_write_float;
+    }
+    else
+        return -1;
+
+    if( !fluid_settings_setstr( settings, "audio.sample-format",
+                                          sampleFormat )
+        || !fluid_settings_setint( settings, "synth.audio-channels",
+                                   pkai->channels >> 1 )
+        || !fluid_settings_setnum( settings, "synth.sample-rate", rate ))
+        return -1;
+
+    dec->sampleRate = rate;
+
+    /* samples in a decoder */
+    dec->sampleSize = pkai->channels * ( bps >> 3 );
+    dec->bps = bps;
+
+    if( opts->preset < 0
+        || opts->preset >= sizeof( presets ) / sizeof( presets[ 0 ]))
+        return -1;
+
+    /* options override a preset */
+    KMPRESET preset = presets[ opts->preset ];
+
+    if( opts->polyphony > 0 )
+        preset.polyphony = opts->polyphony;
+
+    if( opts->reverb != KMDEC_EFFECT_DEFAULT )
+        preset.reverb = opts->reverb;
+
+    if( opts->chorus != KMDEC_EFFECT_DEFAULT )
+        preset.chorus = opts->chorus;
+
+    if( opts->interpolation != KMDEC_INTERP_DEFAULT )
+        preset.interpolation = opts->interpolation;
+
+    if( preset.polyphony > 0
+        && !fluid_settings_setint( settings, "synth.polyphony",
+                                   preset.polyphony ))
+        return -1;
+
+    if( preset.reverb != KMDEC_EFFECT_DEFAULT
+        && setActive( settings, "synth.reverb.active",
+                      preset.reverb == KMDEC_EFFECT_ON ) == -1 )
+        return -1;
+
+    if( preset.chorus != KMDEC_EFFECT_DEFAULT
+        && setActive( settings, "synth.chorus.active",
+                      preset.chorus == KMDEC_EFFECT_ON ) == -1 )
+        return -1;
+
+    /* not supported before fluidsynth 1.1.0, ignore errors */
+    if( opts->cpuCores > 0 )
+        fluid_settings_setint( settings, "synth.cpu-cores", opts->cpuCores );
+
+    switch( preset.interpolation )
+    {
+        case KMDEC_INTERP_DEFAULT:
+            dec->interp = -1;
+            break;
+
+        case KMDEC_INTERP_NONE:
+            dec->interp = FLUID_INTERP_NONE;
+            break;
+
+        case KMDEC_INTERP_LINEAR:
+            dec->interp = FLUID_INTERP_LINEAR;
+            break;
+
+        case KMDEC_INTERP_4THORDER:
+            dec->interp = FLUID_INTERP_4THORDER;
+            break;
+
+        case KMDEC_INTERP_7THORDER:
+            dec->interp = FLUID_INTERP_7THORDER;
+            break;
+
+        default:
+            return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Set interpolation method of a synthesizer
+ *
+ * @param[in] dec Pointer to a decoder
+ * @param[in] synth Synthesizer
+ */
+static void setInterp( PKMDEC dec, fluid_synth_t *synth )
+{
+    /* not a setting, but a synthesizer property */
+    if( dec->interp != -1 )
+        fluid_synth_set_interp_method( synth, -1, dec->interp );
+}
+
+/**
+ * Open decoder
+ *
+ * @param[in] dec Decoder loaded MIDI data, closed on error
+ * @param[in] sf2name Sound font file to open
+ * @param[in] pkai Pointer to audio information
+ * @param[in] opts Options to use
+ * @return Decoder on success, NULL on error
+ */
+static
+PKMDEC openEx( PKMDEC dec, const char *sf2name, PKMDECAUDIOINFO pkai,
+               PKMDECOPTIONS opts )
+{
+    static KMDECOPTIONS defaultOpts = {
+        .seekInterval = 0,
+        .timing = KMDEC_TIMING_CLOCK,
+        .stems = 0,
+        .stemMap = NULL,
+        .preset = KMDEC_PRESET_DEFAULT,
+        .dither = KMDEC_DITHER_DEFAULT,
+    };
+
+    if( !opts )
+        opts = &defaultOpts;
+
+    if( !dec )
+        return NULL;
+
+    dec->settings = new_fluid_settings();
+    if( !dec->settings )
+        goto fail;
+
+    /* settings are applied when a synthesizer is created */
+    if( configure( dec, pkai, opts ) == -1 )
+        goto fail;
+
+    dec->synth = new_fluid_synth( dec->settings );
+    if( !dec->synth )
+        goto fail;
+
+    if( addSharedLoader( dec->synth ) == -1 )
+        goto fail;
+
+    dec->sf = fluid_synth_sfload( dec->synth, sf2name, 1 );
+    if( dec->sf == -1 )
+        goto fail;
+
+    /* for synthesizers of parallel rendering */
+    dec->sf2name = strdup( sf2name );
+    if( !dec->sf2name )
+        goto fail;
+
+    setInterp( dec, dec->synth );
+
+    if( !fluid_settings_getint( dec->settings, "synth.polyphony",
+                                &dec->polyphony ))
+        dec->polyphony = DEFAULT_POLYPHONY;
+
+    dec->stats = opts->stats;
+
+    /* polyphony may be large for a stack */
+    if( dec->stats
+        && !( dec->voices = malloc(( dec->polyphony + 1 )
+                                   * sizeof( *dec->voices ))))
+        goto fail;
+
+    for( int ch = 0; ch < 16; ch++ )
+        dec->chSynth[ ch ] = dec->synth;
+
+    if( opts->stems != 0 && openStems( dec, sf2name, opts ) == -1 )
+        goto fail;
+
+    /* get clock unit from fluidsynth in ms */
+    if( !fluid_settings_getint( dec->settings, "synth.min-note-length",
+                                &dec->clockUnit ))
+        dec->clockUnit = DEFAULT_CLOCK_UNIT;
+    dec->clockUnit *= CLOCK_BASE / 1000;    /* ms to us */
+
+    /* a synthesizer renders at a different rate */
+    if( dec->sampleRate != pkai->sampleRate
+        && ( opts->stems > 0
+             || openResampler( dec, dec->sampleRate, pkai->sampleRate,
+                               pkai->channels ) == -1 ))
+        goto fail;
+
+    dec->seekInterval = CLOCK_BASE * opts->seekInterval / 1000;
+
+    if( opts->timing != KMDEC_TIMING_CLOCK
+        && opts->timing != KMDEC_TIMING_SAMPLE )
+        goto fail;
+
+    dec->timing = opts->timing;
+
+    dec->deferDuration = opts->deferDuration;
+
+    if( opts->cacheSize < 0 )
+        goto fail;
+
+    dec->loop = opts->loop;
+    dec->cacheBudget = opts->cacheSize;
+
+    dec->stream = opts->stream;
+
+    dec->dataFunc = opts->dataFunc;
+    dec->dataArg = opts->dataArg;
+
+    if( pthread_mutex_init( &dec->tempoMutex, NULL ))
+        goto fail;
+
+    dec->tempoInited = true;
+
+    dec->live = calloc( 1, sizeof( *dec->live ));
+    if( !dec->live )
+        goto fail;
+
+    if( pthread_mutex_init( &dec->live->mutex, NULL ))
+    {
+        free( dec->live );
+        dec->live = NULL;
+
+        goto fail;
+    }
+    dec->endPos = NO_LOOP;
+
+    if( prepareDuration( dec ) == -1 )
+        goto fail;
+
+    return dec;
+
+fail:
+    kmdecClose( dec );
+
+    return NULL;
+}
+
+/**
+ * Keep buffers of MIDI of a decoder to reuse by a next load
+ *
+ * @param[in] dec Pointer to a decoder having MIDI
+ * @param[in] spare Where to keep buffers
+ */
+static void keepSpare( PKMDEC dec, PKMSPARE spare )
+{
+    if( dec->events )
+    {
+        free( spare->events );
+
+        spare->events = dec->events;
+        spare->eventSize = dec->eventSize;
+
+        dec->events = NULL;
+        dec->eventSize = 0;
+    }
+
+    /* a buffer of a caller or a mapping is not ours */
+    if( dec->mfd && dec->mfd->store == MEMFD_ALLOC && dec->mfd->buffer )
+    {
+        free( spare->buffer );
+
+        spare->buffer = dec->mfd->buffer;
+        spare->bufferSize = dec->mfd->size;
+
+        dec->mfd->buffer = NULL;
+    }
+}
+
+/* swap values of two lvalues of the same type */
+#define SWAP( a, b ) \
+    do { __typeof__( a ) t_ = ( a ); ( a ) = ( b ); ( b ) = t_; } while( 0 )
+
+/**
+ * Swap MIDI data and its duration of two decoders
+ *
+ * @param[in] dec Pointer to a decoder
+ * @param[in] midi Pointer to other decoder
+ */
+static void swapMidi( PKMDEC dec, PKMDEC midi )
+{
+    SWAP( dec->fd, midi->fd );
+    SWAP( dec->closeFd, midi->closeFd );
+    SWAP( dec->io, midi->io );
+    SWAP( dec->mfd, midi->mfd );
+
+    SWAP( dec->header, midi->header );
+    SWAP( dec->tracks, midi->tracks );
+
+    for( int i = 0; i < dec->header.tracks; i++ )
+        dec->tracks[ i ].dec = dec;
+
+    for( int i = 0; i < midi->header.tracks; i++ )
+        midi->tracks[ i ].dec = midi;
+
+    SWAP( dec->events, midi->events );
+    SWAP( dec->eventSize, midi->eventSize );
+    SWAP( dec->eventCount, midi->eventCount );
+
+    SWAP( dec->heap, midi->heap );
+    SWAP( dec->heapCount, midi->heapCount );
+    SWAP( dec->compiling, midi->compiling );
+    SWAP( dec->streaming, midi->streaming );
+
+    lockTempo( dec );
+    SWAP( dec->tempoMap, midi->tempoMap );
+    SWAP( dec->tempoSize, midi->tempoSize );
+    SWAP( dec->tempoCount, midi->tempoCount );
+    SWAP( dec->tempoPos, midi->tempoPos );
+    unlockTempo( dec );
+
+    SWAP( dec->snapshots, midi->snapshots );
+    SWAP( dec->snapshotSize, midi->snapshotSize );
+    SWAP( dec->snapshotCount, midi->snapshotCount );
+
+    SWAP( dec->duration, midi->duration );
+    SWAP( dec->loopStart, midi->loopStart );
+    SWAP( dec->loopEnd, midi->loopEnd );
+}
+
+/**
+ * Replace MIDI data of a decoder with the one loaded into a new decoder
+ *
+ * @param[in] dec Pointer to a decoder
+ * @param[in] midi Decoder returned by newMidi(), NULL if failed
+ * @param[in] clock Clock to continue from if failed
+ * @return 0 on success, -1 on error
+ */
+static int loadMidi( PKMDEC dec, PKMDEC midi, uint64_t clock )
+{
+    if( !midi )
+    {
+        /* continue from where samples have been consumed */
+        if( dec->ring )
+        {
+            seekClock( dec, clock );
+            startAsync( dec );
+        }
+
+        return -1;
+    }
+
+    /* a scan reads the current MIDI, restarted if a new one fails */
+    finishScan( dec, false );
+
+    bool scanning = __atomic_load_n( &dec->scanning, __ATOMIC_ACQUIRE );
+
+    stopScan( dec );
+
+    /* samples of the current MIDI */
+    uint64_t outPos = dec->outPos;
+
+    clearCache( dec );
+    resetResampler( dec );
+
+    /* keep the current MIDI in a new decoder until a new one is prepared */
+    swapMidi( dec, midi );
+
+    if( prepareDuration( dec ) == -1 )
+    {
+        swapMidi( dec, midi );
+
+        kmdecClose( midi );
+
+        /* continue from where samples have been consumed */
+        reset( dec );
+
+        if( USE_CACHE( dec ))
+            dec->outPos = outPos;
+        else
+            seekClock( dec, clock );
+
+        if( scanning )
+            startScan( dec );
+
+        if( dec->ring )
+            startAsync( dec );
+
+        return -1;
+    }
+
+    /* statistics are accumulated over loaded MIDI */
+    for( int i = 0; i < KMDEC_EVENT_TYPES; i++ )
+        dec->stat.events[ i ] += midi->stat.events[ i ];
+    dec->stat.parseNs += midi->stat.parseNs;
+
+    if( dec->recycle )
+        keepSpare( midi, &dec->spare );
+
+    kmdecClose( midi );
+
+    if( dec->ring && startAsync( dec ) == -1 )
+        return -1;
+
+    return 0;
+}
+
+/**
+ * Load new MIDI data into a decoder, keeping a synthesizer
+ *
+ * @param[in] dec Pointer to a decoder
+ * @param[in] fd File descriptor of a midi file
+ * @param[in] closeFd Flag to indicate to close fd
+ * @param[in] io IO functions to use
+ * @return 0 on success, -1 on error
+ */
+static int load( PKMDEC dec, int fd, bool closeFd, PKMDECIOFUNCS io )
+{
+    PKMDEC midi;
+    uint64_t clock = currentClock( dec );
+
+    stopAsync( dec );
+
+    /* load into a temporary decoder not to lose the current one on error */
+    midi = openMidi( fd, closeFd, io, &dec->filter, dec->stream,
+                     SPARE( dec ));
+
+    return loadMidi( dec, midi, clock );
+}
+
+/**
+ * Probe MIDI information
+ *
+ * @param[in] fd File descriptor of a midi file
+ * @param[in] closeFd Flag to indicate to close fd
+ * @param[in] io IO functions to use
+ * @param[out] info Pointer to MIDI information
+ * @return 0 on success, -1 on error
+ */
+static int probe( int fd, bool closeFd, PKMDECIOFUNCS io,
+                  PKMDECMIDIINFO info )
+{
+    PKMDEC dec;
+
+    dec = openMidi( fd, closeFd, io, NULL, false, NULL );
+    if( !dec )
+        return -1;
+
+    if( scanDuration( dec ) == -1 )
+    {
+        kmdecClose( dec );
+
+        return -1;
+    }
+
+    info->format = dec->header.format;
+    info->tracks = dec->header.tracks;
+    info->division = dec->header.division;
+    info->duration = kmdecGetDuration( dec );
+
+    kmdecClose( dec );
+
+    return 0;
+}
+
+/**
+ * Open decoder with a file name
+ *
+ * @param[in] name File name to open
+ * @param[in] sf2name Sound font file to open
+ * @param[in] pkai Pointer to audio information
+ * @return Decoder on success, NULL on error
+ */
+PKMDEC kmdecOpen( const char *name, const char *sf2name, PKMDECAUDIOINFO pkai )
+{
+    return kmdecOpenEx( name, sf2name, pkai, NULL );
+}
+
+/**
+ * Open decoder with a file name
+ *
+ * @param[in] name File name to open
+ * @param[in] sf2name Sound font file to open
+ * @param[in] pkai Pointer to audio information
+ * @param[in] io Pointer to IO functions. If NULL, file IOs is used
+ * @return Decoder on success, NULL on error
+ */
+PKMDEC kmdecOpenEx( const char *name, const char *sf2name,
+                    PKMDECAUDIOINFO pkai, PKMDECIOFUNCS io )
+{
+    return kmdecOpenOpt( name, sf2name, pkai, io, NULL );
+}
+
+/**
+ * Open decoder with a file name and options
+ *
+ * @param[in] name File name to open
+ * @param[in] sf2name Sound font file to open
+ * @param[in] pkai Pointer to audio information
+ * @param[in] io Pointer to IO functions. If NULL, file IOs is used
+ * @param[in] opts Pointer to options. If NULL, defaults are used
+ * @return Decoder on success, NULL on error
+ */
+PKMDEC kmdecOpenOpt( const char *name, const char *sf2name,
+                     PKMDECAUDIOINFO pkai, PKMDECIOFUNCS io,
+                     PKMDECOPTIONS opts )
+{
+    int fd;
+
+    if( io )
+        fd = io->open( name );
+    else
+        fd = defaultOpen( name );
+
+    if( fd == -1)
+        return NULL;
+
+    return openEx( openMidi( fd, true, io, FILTER( opts ), STREAM( opts ),
+                             NULL ),
+                   sf2name, pkai, opts );
+}
+
+/**
+ * Open decoder with a file descriptor
+ *
+ * @param[in] fd File descriptor of a midi file
+ * @param[in] sf2name Sound font file to open
+ * @param[in] pkai Pointer to audio information
+ * @return Decoder on success, NULL on error
+ */
+PKMDEC kmdecOpenFd( int fd, const char *sf2name, PKMDECAUDIOINFO pkai )
+{
+    return kmdecOpenFdEx( fd, sf2name, pkai, NULL );
+}
+
+/**
+ * Open decoder with a file descriptor
+ *
+ * @param[in] fd File descriptor of a midi file
+ * @param[in] sf2name Sound font file to open
+ * @param[in] pkai Pointer to audio information
+ * @param[in] io Pointer to IO functions. If NULL, file IOs is used
+ * @return Decoder on success, NULL on error
+ */
+PKMDEC kmdecOpenFdEx( int fd, const char *sf2name,
+                    PKMDECAUDIOINFO pkai, PKMDECIOFUNCS io )
+{
+    return kmdecOpenFdOpt( fd, sf2name, pkai, io, NULL );
+}
+
+/**
+ * Open decoder with a file descriptor and options
+ *
+ * @param[in] fd File descriptor of a midi file
+ * @param[in] sf2name Sound font file to open
+ * @param[in] pkai Pointer to audio information
+ * @param[in] io Pointer to IO functions. If NULL, file IOs is used
+ * @param[in] opts Pointer to options. If NULL, defaults are used
+ * @return Decoder on success, NULL on error
+ */
+PKMDEC kmdecOpenFdOpt( int fd, const char *sf2name, PKMDECAUDIOINFO pkai,
+                       PKMDECIOFUNCS io, PKMDECOPTIONS opts )
+{
+    return openEx( openMidi( fd, false, io, FILTER( opts ), STREAM( opts ),
+                             NULL ),
+                   sf2name, pkai, opts );
+}
+
+/**
+ * Open decoder with MIDI data in a memory buffer
+ *
+ * @param[in] buf MIDI data, used in place until kmdecClose()
+ * @param[in] len Length of @a buf in bytes
+ * @param[in] sf2name Sound font file to open
+ * @param[in] pkai Pointer to audio information
+ * @param[in] opts Pointer to options. If NULL, defaults are used
+ * @return Decoder on success, NULL on error
+ */
+PKMDEC kmdecOpenMem( const void *buf, size_t len, const char *sf2name,
+                     PKMDECAUDIOINFO pkai, PKMDECOPTIONS opts )
+{
+    return openEx( newMidi( memOpenBuffer( buf, len ), -1, false,
+                            &defaultIO, FILTER( opts ), NULL ),
+                   sf2name, pkai, opts );
+}
+
+/**
+ * Open decoder with a memory-mapped file
+ *
+ * @param[in] name File name to map
+ * @param[in] sf2name Sound font file to open
+ * @param[in] pkai Pointer to audio information
+ * @param[in] opts Pointer to options. If NULL, defaults are used
+ * @return Decoder on success, NULL on error
+ */
+PKMDEC kmdecOpenMap( const char *name, const char *sf2name,
+                     PKMDECAUDIOINFO pkai, PKMDECOPTIONS opts )
+{
+    return openEx( newMidi( memOpenMap( name ), -1, false, &defaultIO,
+                            FILTER( opts ), NULL ), sf2name, pkai, opts );
+}
+
+/**
+ * Probe MIDI information of a file name without a synthesizer
+ *
+ * @param[in] name File name to open
+ * @param[in] io Pointer to IO functions. If NULL, file IOs is used
+ * @param[out] info Pointer to MIDI information
+ * @return 0 on success, -1 on error
+ */
+int kmdecProbe( const char *name, PKMDECIOFUNCS io, PKMDECMIDIINFO info )
+{
+    int fd;
+
+    if( !info )
+        return -1;
+
+    if( io )
+        fd = io->open( name );
+    else
+        fd = defaultOpen( name );
+
+    if( fd == -1)
+        return -1;
+
+    return probe( fd, true, io, info );
+}
+
+/**
+ * Probe MIDI information of a file descriptor without a synthesizer
+ *
+ * @param[in] fd File descriptor of a midi file
+ * @param[in] io Pointer to IO functions. If NULL, file IOs is used
+ * @param[out] info Pointer to MIDI information
+ * @return 0 on success, -1 on error
+ */
+int kmdecProbeFd( int fd, PKMDECIOFUNCS io, PKMDECMIDIINFO info )
+{
+    if( !info )
+        return -1;
+
+    return probe( fd, false, io, info );
+}
+
+/**
+ * Load a new MIDI file into a decoder
+ *
+ * @param[in] dec Pointer to a decoder
+ * @param[in] name File name to open
+ * @param[in] io Pointer to IO functions. If NULL, file IOs is used
+ * @return 0 on success, -1 on error. On error, the current MIDI is kept
+ */
+int kmdecLoad( PKMDEC dec, const char *name, PKMDECIOFUNCS io )
+{
+    int fd;
+
+    if( !dec )
+        return -1;
+
+    if( io )
+        fd = io->open( name );
+    else
+        fd = defaultOpen( name );
+
+    if( fd == -1)
+        return -1;
+
+    return load( dec, fd, true, io );
+}
+
+/**
+ * Load a new MIDI file descriptor into a decoder
+ *
+ * @param[in] dec Pointer to a decoder
+ * @param[in] fd File descriptor of a midi file
+ * @param[in] io Pointer to IO functions. If NULL, file IOs is used
+ * @return 0 on success, -1 on error. On error, the current MIDI is kept
+ */
+int kmdecLoadFd( PKMDEC dec, int fd, PKMDECIOFUNCS io )
+{
+    if( !dec )
+        return -1;
+
+    return load( dec, fd, false, io );
+}
+
+/**
+ * Load a sound font into the cache shared by decoders
+ *
+ * @param[in] sf2name Sound font file to load
+ * @return 0 on success, -1 on error
+ */
+int kmdecPreloadSoundFont( const char *sf2name )
+{
+    PKMSF2 sf2;
+
+    if( !sf2name )
+        return -1;
+
+    sf2 = acquireSoundFont( sf2name );
+    if( !sf2 )
+        return -1;
+
+    pthread_mutex_lock( &sf2Mutex );
+
+    sf2->preloadCount++;
+
+    pthread_mutex_unlock( &sf2Mutex );
+
+    return 0;
+}
+
+/**
+ * Release a sound font loaded by kmdecPreloadSoundFont()
+ *
+ * @param[in] sf2name Sound font file to release
+ * @return 0 on success, -1 on error
+ */
+int kmdecReleaseSoundFont( const char *sf2name )
+{
+    PKMSF2 sf2;
+
+    if( !sf2name )
+        return -1;
+
+    pthread_mutex_lock( &sf2Mutex );
+
+    for( sf2 = sf2List; sf2; sf2 = sf2->next )
+    {
+        if( strcmp( sf2->name, sf2name ) == 0 )
+            break;
+    }
+
+    /* not preloaded ? */
+    if( sf2 && sf2->preloadCount == 0 )
+        sf2 = NULL;
+
+    if( sf2 )
+    {
+        sf2->preloadCount--;
+        unrefSoundFont( sf2 );
+    }
+
+    pthread_mutex_unlock( &sf2Mutex );
+
+    return sf2 ? 0 : -1;
+}
+
+/**
+ * Close decoder
+ *
+ * @param[in] dec Pointer to a deocder
+ * @return 0 on success, -1 on error
+ */
+void kmdecClose( PKMDEC dec )
+{
+    if( !dec )
+        return;
+
+    stopScan( dec );
+
+    stopAsync( dec );
+    free( dec->ring );
+
+    if( dec->asyncInited )
+    {
+        pthread_cond_destroy( &dec->asyncCond );
+        pthread_mutex_destroy( &dec->asyncMutex );
+    }
+
+    if( dec->scanInited )
+        pthread_mutex_destroy( &dec->scanMutex );
+
+    if( dec->live )
+    {
+        pthread_mutex_destroy( &dec->live->mutex );
+        free( dec->live );
+    }
+
+    free( dec->buffer );
+    free( dec->convBuf );
+    free( dec->planarBuf );
+    free( dec->voices );
+
+    clearCache( dec );
+
+    closeResampler( dec );
+
+    closeStems( dec );
+
+    if( dec->sf != -1 )
+        fluid_synth_sfunload( dec->synth, dec->sf, 1 );
+    delete_fluid_synth( dec->synth );
+    delete_fluid_settings( dec->settings );
+    free( dec->sf2name );
+
+    freeMidi( dec );
+
+    free( dec->spare.buffer );
+    free( dec->spare.events );
+
+    if( dec->tempoInited )
+        pthread_mutex_destroy( &dec->tempoMutex );
+
+    free( dec );
+}
+
+/**
+ * Create synthesizers and threads for stems
+ *
+ * @param[in] dec Pointer to a decoder
+ * @param[in] sf2name Sound font file to open
+ * @param[in] opts Options to use
+ * @return 0 on success, -1 on error
+ */
+static int openStems( PKMDEC dec, const char *sf2name, PKMDECOPTIONS opts )
+{
+    /* a single stem is rendered by the main synthesizer alone */
+    if( opts->stems < 1 || opts->stems > MAX_STEMS )
+        return -1;
+
+    for( int ch = 0; opts->stemMap && ch < 16; ch++ )
+    {
+        if( opts->stemMap[ ch ] >= opts->stems )
+            return -1;
+    }
+
+    if( pthread_mutex_init( &dec->stemMutex, NULL ))
+        return -1;
+
+    if( pthread_cond_init( &dec->stemCond, NULL ))
+    {
+        pthread_mutex_destroy( &dec->stemMutex );
+
+        return -1;
+    }
+
+    if( pthread_cond_init( &dec->stemDoneCond, NULL ))
+    {
+        pthread_cond_destroy( &dec->stemCond );
+        pthread_mutex_destroy( &dec->stemMutex );
+
+        return -1;
+    }
+
+    dec->stemInited = true;
+
+    dec->stems = calloc( opts->stems, sizeof( *dec->stems ));
+    if( !dec->stems )
+        return -1;
+
+    dec->stemCount = opts->stems;
+
+    dec->stems[ 0 ].dec = dec;
+    dec->stems[ 0 ].synth = dec->synth;
+    dec->stems[ 0 ].sf = -1;
+
+    /* stems are rendered by their own threads */
+    for( int i = 0; dec->stats && i < dec->stemCount; i++ )
+    {
+        PKMSTEM stem = dec->stems + i;
+
+        stem->voices = malloc(( dec->polyphony + 1 )
+                              * sizeof( *stem->voices ));
+        if( !stem->voices )
+            return -1;
+    }
+
+    for( int i = 1; i < dec->stemCount; i++ )
+    {
+        PKMSTEM stem = dec->stems + i;
+
+        stem->dec = dec;
+        stem->sf = -1;
+
+        stem->synth = new_fluid_synth( dec->settings );
+        if( !stem->synth )
+            return -1;
+
+        /* a sound font is shared with the first stem */
+        if( addSharedLoader( stem->synth ) == -1 )
+            return -1;
+
+        stem->sf = fluid_synth_sfload( stem->synth, sf2name, 1 );
+        if( stem->sf == -1 )
+            return -1;
+
+        setInterp( dec, stem->synth );
+
+        if( pthread_create( &stem->thread, NULL, stemProc, stem ))
+            return -1;
+
+        stem->threadStarted = true;
+    }
+
+    for( int ch = 0; ch < 16; ch++ )
+    {
+        int i = opts->stemMap ? opts->stemMap[ ch ] : ch % dec->stemCount;
+
+        dec->chSynth[ ch ] = dec->stems[ i ].synth;
+    }
+
+    return 0;
+}
+
+/**
+ * Destroy synthesizers and threads for stems
+ *
+ * @param[in] dec Pointer to a decoder
+ */
+static void closeStems( PKMDEC dec )
+{
+    if( !dec->stemInited )
+        return;
+
+    pthread_mutex_lock( &dec->stemMutex );
+    dec->stemQuit = true;
+    pthread_cond_broadcast( &dec->stemCond );
+    pthread_mutex_unlock( &dec->stemMutex );
+
+    for( int i = 0; i < dec->stemCount; i++ )
+    {
+        PKMSTEM stem = dec->stems + i;
+
+        if( stem->threadStarted )
+            pthread_join( stem->thread, NULL );
+
+        /* the first stem uses a synthesizer of a decoder */
+        if( i > 0 )
+        {
+            if( stem->sf != -1 )
+                fluid_synth_sfunload( stem->synth, stem->sf, 1 );
+            delete_fluid_synth( stem->synth );
+        }
+
+        free( stem->buffer );
+        free( stem->voices );
+    }
+
+    free( dec->stems );
+
+    pthread_cond_destroy( &dec->stemDoneCond );
+    pthread_cond_destroy( &dec->stemCond );
+    pthread_mutex_destroy( &dec->stemMutex );
+}
+
+/**
+ * Rendering thread of a stem
+ *
+ * @param[in] arg Pointer to a stem
+ * @return NULL
+ */
+static void *stemProc( void *arg )
+{
+    PKMSTEM stem = arg;
+    PKMDEC dec = stem->dec;
+    uint32_t job = 0;
+    KMOUT out;
+
+    while( 1 )
+    {
+        int samples;
+
+        pthread_mutex_lock( &dec->stemMutex );
+        while( !dec->stemQuit && dec->stemJob == job )
+            pthread_cond_wait( &dec->stemCond, &dec->stemMutex );
+
+        if( dec->stemQuit )
+        {
+            pthread_mutex_unlock( &dec->stemMutex );
+            break;
+        }
+
+        job = dec->stemJob;
+        samples = dec->stemSamples;
+        pthread_mutex_unlock( &dec->stemMutex );
+
+        outInterleaved( dec, &out, stem->buffer );
+        synthWrite( dec, stem->synth, &stem->silent, stem->voices, &out,
+                    samples );
+
+        pthread_mutex_lock( &dec->stemMutex );
+        if( --dec->stemPending == 0 )
+            pthread_cond_signal( &dec->stemDoneCond );
+        pthread_mutex_unlock( &dec->stemMutex );
+    }
+
+    return NULL;
+}
+
+/**
+ * Render samples of all the stems in parallel
+ *
+ * @param[in] dec Pointer to a decoder
+ * @param[in] samples Samples to render
+ * @return 0 on success, -1 on error
+ */
+static int renderStems( PKMDEC dec, int samples )
+{
+    int len = samples * dec->sampleSize;
+
+    /* grow only */
+    for( int i = 0; i < dec->stemCount; i++ )
+    {
+        PKMSTEM stem = dec->stems + i;
+
+        if( len > stem->bufSize )
+        {
+            char *buffer = realloc( stem->buffer, len );
+            if( !buffer )
+                return -1;
+
+            stem->buffer = buffer;
+            stem->bufSize = len;
+        }
+    }
+
+    /* start other stems */
+    pthread_mutex_lock( &dec->stemMutex );
+    dec->stemSamples = samples;
+    dec->stemPending = dec->stemCount - 1;
+    dec->stemJob++;
+    pthread_cond_broadcast( &dec->stemCond );
+    pthread_mutex_unlock( &dec->stemMutex );
+
+    /* render the first stem in this thread */
+    PKMSTEM stem = dec->stems;
+    KMOUT out;
+
+    outInterleaved( dec, &out, stem->buffer );
+    synthWrite( dec, stem->synth, &stem->silent, stem->voices, &out,
+                    samples );
+
+    pthread_mutex_lock( &dec->stemMutex );
+    while( dec->stemPending > 0 )
+        pthread_cond_wait( &dec->stemDoneCond, &dec->stemMutex );
+    pthread_mutex_unlock( &dec->stemMutex );
+
+    dec->bufLen = len;
+    dec->bufPos = 0;
+
+    return 0;
+}
+
+/**
+ * Mix samples of all the stems
+ *
+ * @param[in] dec Pointer to a decoder
+ * @param[out] buffer Where to store mixed samples
+ * @param[in] len Bytes to mix
+ */
+static void mixStems( PKMDEC dec, void *buffer, int len )
+{
+    if( dec->bps == KMDEC_BPS_FLOAT )
+    {
+        float *out = buffer;
+
+        for( int j = 0; j < len / ( int )sizeof( float ); j++ )
+        {
+            float sum = 0;
+
+            for( int i = 0; i < dec->stemCount; i++ )
+                sum += (( float * )( dec->stems[ i ].buffer
+                                     + dec->bufPos ))[ j ];
+
+            out[ j ] = sum;
+        }
+    }
+    else
+    {
+        int16_t *out = buffer;
+
+        for( int j = 0; j < len / ( int )sizeof( int16_t ); j++ )
+        {
+            int sum = 0;
+
+            for( int i = 0; i < dec->stemCount; i++ )
+                sum += (( int16_t * )( dec->stems[ i ].buffer
+                                       + dec->bufPos ))[ j ];
+
+            out[ j ] = sum > INT16_MAX ? INT16_MAX :
+                       sum < INT16_MIN ? INT16_MIN : sum;
+        }
+    }
+}
+
+/**
+ * Fill buffers of stems, or a buffer with the mix of stems
+ *
+ * @param[in] dec Pointer to a deocder
+ * @param[out] buffers Buffers of stems, or NULL to mix
+ * @param[out] mix Where to store the mix if @a buffers is NULL
+ * @param[in] size Size of each buffer in bytes
+ * @return Size filled in each buffer in bytes
+ */
+static int decodeStems( PKMDEC dec, void *buffers[], void *mix, int size )
+{
+    int total = 0;
+
+    /* mix in whole samples */
+    if( !buffers )
+        size -= size % dec->sampleSize;
+
+    while( size > 0 )
+    {
+        if( dec->bufLen == 0
+            && decode( dec, DECODE_PLAY, NULL, size / dec->sampleSize ) == -1 )
+            break;
+
+        int len = MIN( size, dec->bufLen );
+        uint64_t start = statStart( dec );
+
+        if( buffers )
+        {
+            for( int i = 0; i < dec->stemCount; i++ )
+                memcpy(( char * )buffers[ i ] + total,
+                       dec->stems[ i ].buffer + dec->bufPos, len );
+        }
+        else
+            mixStems( dec, ( char * )mix + total, len );
+
+        statEnd( dec, &dec->stat.copyNs, start );
+        statAdd( dec, &dec->stat.bytesCopied,
+                 len * ( buffers ? dec->stemCount : 1 ));
+
+        size -= len;
+
+        dec->bufPos += len;
+        dec->bufLen -= len;
+
+        total += len;
+    }
+
+    return total;
+}
+
+/**
+ * Render samples in the caller's thread
+ *
+ * @param[in] dec Pointer to a deocder
+ * @param[out] buffer Where to store samples
+ * @param[in] size Size of buffer in bytes
+ * @return Size filled in buffer in bytes
+ */
+static int renderSync( PKMDEC dec, void *buffer, int size )
+{
+    if( dec->stemCount > 0 )
+        return decodeStems( dec, NULL, buffer, size );
+
+    int total = 0;
+
+    while( size > 0 )
+    {
+        int len;
+
+        if( dec->bufLen == 0 )
+        {
+            KMOUT out;
+
+            outInterleaved( dec, &out, buffer );
+
+            len = decode( dec, DECODE_PLAY, &out, size / dec->sampleSize );
+            if( len == -1 )
+                break;
+
+            len *= dec->sampleSize;
+        }
+        else
+        {
+            uint64_t start = statStart( dec );
+
+            len = MIN( size, dec->bufLen );
+            memcpy( buffer, dec->buffer + dec->bufPos, len );
+
+            dec->bufPos += len;
+            dec->bufLen -= len;
+
+            statEnd( dec, &dec->stat.copyNs, start );
+            statAdd( dec, &dec->stat.bytesCopied, len );
+        }
+
+        buffer = ( char * )buffer + len;
+        size -= len;
+
+        total += len;
+    }
+
+    return total;
+}
+
+/* samples to convert or to deinterleave at once */
+#define CONV_SAMPLES    4096
+
+/**
+ * Deinterleave samples into channel buffers
+ *
+ * @param[in] dec Pointer to a deocder
+ * @param[out] buffers Buffers of left and right channels
+ * @param[in] offset Offset in @a buffers in bytes
+ * @param[in] in Interleaved samples
+ * @param[in] samples A number of samples
+ */
+static void deinterleave( PKMDEC dec, void *buffers[], int offset,
+                          const void *in, int samples )
+{
+    uint64_t start = statStart( dec );
+
+    if( dec->bps == KMDEC_BPS_FLOAT )
+    {
+        const float *p = in;
+        float *left = ( float * )(( char * )buffers[ 0 ] + offset );
+        float *right = ( float * )(( char * )buffers[ 1 ] + offset );
+
+        for( int i = 0; i < samples; i++ )
+        {
+            left[ i ] = p[ i * 2 ];
+            right[ i ] = p[ i * 2 + 1 ];
+        }
+    }
+    else
+    {
+        const int16_t *p = in;
+        int16_t *left = ( int16_t * )(( char * )buffers[ 0 ] + offset );
+        int16_t *right = ( int16_t * )(( char * )buffers[ 1 ] + offset );
+
+        for( int i = 0; i < samples; i++ )
+        {
+            left[ i ] = p[ i * 2 ];
+            right[ i ] = p[ i * 2 + 1 ];
+        }
+    }
+
+    statEnd( dec, &dec->stat.copyNs, start );
+    statAdd( dec, &dec->stat.bytesCopied, samples * dec->sampleSize );
+}
+
+/**
+ * Render samples into channel buffers in the caller's thread
+ *
+ * Samples are rendered directly into channel buffers by a synthesizer.
+ *
+ * @param[in] dec Pointer to a deocder
+ * @param[out] buffers Buffers of left and right channels
+ * @param[in] size Size of each buffer in bytes
+ * @return Size filled in each buffer in bytes
+ */
+static int renderPlanar( PKMDEC dec, void *buffers[], int size )
+{
+    int chSize = dec->bps >> 3;
+    int total = 0;
+
+    /* in whole samples */
+    size -= size % chSize;
+
+    while( size > 0 )
+    {
+        int samples;
+
+        if( dec->bufLen == 0 )
+        {
+            KMOUT out =
+            {
+                .left = ( char * )buffers[ 0 ] + total,
+                .right = ( char * )buffers[ 1 ] + total,
+                .incr = 1,
+            };
+
+            samples = decode( dec, DECODE_PLAY, &out, size / chSize );
+            if( samples == -1 )
+                break;
+        }
+        else
+        {
+            samples = MIN( size / chSize, dec->bufLen / dec->sampleSize );
+
+            /* drop a partial sample left by kmdecDecode() */
+            if( samples == 0 )
+            {
+                dec->bufLen = 0;
+
+                continue;
+            }
+
+            deinterleave( dec, buffers, total, dec->buffer + dec->bufPos,
+                          samples );
+
+            dec->bufPos += samples * dec->sampleSize;
+            dec->bufLen -= samples * dec->sampleSize;
+        }
+
+        size -= samples * chSize;
+
+        total += samples * chSize;
+    }
+
+    return total;
+}
+
+/**
+ * Fill channel buffers with samples
+ *
+ * Samples buffered in a ring or mixed from stems are interleaved, so they
+ * are deinterleaved. Otherwise, they are rendered directly.
+ *
+ * @param[in] dec Pointer to a deocder
+ * @param[out] buffers Buffers of left and right channels
+ * @param[in] size Size of each buffer in bytes
+ * @return Size filled in each buffer in bytes
+ */
+static int renderChannels( PKMDEC dec, void *buffers[], int size )
+{
+    if( !dec->ring && dec->stemCount == 0 )
+        return renderPlanar( dec, buffers, size );
+
+    int chSize = dec->bps >> 3;
+    int total = 0;
+
+    while( size >= chSize )
+    {
+        int n = MIN( size / chSize, CONV_SAMPLES );
+        int len = n * dec->sampleSize;
+
+        /* grow only */
+        if( len > dec->planarSize )
+        {
+            char *buf = realloc( dec->planarBuf, len );
+            if( !buf )
+                break;
+
+            dec->planarBuf = buf;
+            dec->planarSize = len;
+        }
+
+        len = dec->ring ? renderAsync( dec, dec->planarBuf, len ) :
+                          renderSync( dec, dec->planarBuf, len );
+
+        int samples = len / dec->sampleSize;
+
+        deinterleave( dec, buffers, total, dec->planarBuf, samples );
+
+        size -= samples * chSize;
+
+        total += samples * chSize;
+
+        /* finished ? */
+        if( samples < n )
+            break;
+    }
+
+    return total;
+}
+
+/**
+ * Grow a buffer for samples to convert
+ *
+ * @param[in] dec Pointer to a decoder
+ * @param[in] size Size in bytes
+ * @return 0 on success, -1 on error
+ */
+static int growConv( PKMDEC dec, int size )
+{
+    if( size > dec->convSize )
+    {
+        float *buf = realloc( dec->convBuf, size );
+        if( !buf )
+            return -1;
+
+        dec->convBuf = buf;
+        dec->convSize = size;
+    }
+
+    return 0;
+}
+
+/* next random number of xorshift32 */
+#define XORSHIFT( x ) \
+    (( x ) ^= ( x ) << 13, ( x ) ^= ( x ) >> 17, ( x ) ^= ( x ) << 5 )
+
+/* scale of a random number to [0, 1) */
+#define RANDOM_UNIT ( 1.0f / 16777216 )
+
+/**
+ * Convert float samples to s16 samples
+ *
+ * @param[in] dec Pointer to a decoder
+ * @param[out] out s16 samples
+ * @param[in] in float samples
+ * @param[in] n A number of samples
+ */
+static void floatToS16C( PKMDEC dec, int16_t *out, const float *in, int n )
+{
+    bool dither = dec->dither == KMDEC_DITHER_TPDF;
+
+    for( int i = 0; i < n; i++ )
+    {
+        float v = in[ i ] * 32767.0f;
+
+        if( dither )
+        {
+            /* triangular PDF in ( -1, 1 ) LSB */
+            XORSHIFT( dec->ditherA[ 0 ]);
+            XORSHIFT( dec->ditherB[ 0 ]);
+
+            v += (( float )( dec->ditherA[ 0 ] >> 8 )
+                  - ( float )( dec->ditherB[ 0 ] >> 8 )) * RANDOM_UNIT;
+        }
+
+        if( v >= 32767.0f )
+            out[ i ] = INT16_MAX;
+        else if( v <= -32768.0f )
+            out[ i ] = INT16_MIN;
+        else
+            out[ i ] = v >= 0 ? ( int )( v + 0.5f ) : ( int )( v - 0.5f );
+    }
+}
+
+/**
+ * Convert float samples to s32 samples
+ *
+ * Float has 24 bits precision, so s32 samples are not dithered.
+ *
+ * @param[out] out s32 samples
+ * @param[in] in float samples
+ * @param[in] n A number of samples
+ */
+static void floatToS32C( int32_t *out, const float *in, int n )
+{
+    for( int i = 0; i < n; i++ )
+    {
+        float v = in[ i ] * 2147483648.0f;
+
+        if( v >= 2147483648.0f )
+            out[ i ] = INT32_MAX;
+        else if( v <= -2147483648.0f )
+            out[ i ] = INT32_MIN;
+        else
+            out[ i ] = lrintf( v );   /* v + 0.5f is not exact */
+    }
+}
+
+#ifdef HAVE_SSE2
+/**
+ * Next random numbers of 4 xorshift32 generators
+ *
+ * @param[in, out] x States of generators
+ * @return Random numbers in [0, 1)
+ */
+__attribute__(( target("sse2")))
+static inline __m128 randomSSE2( __m128i *x )
+{
+    *x = _mm_xor_si128( *x, _mm_slli_epi32( *x, 13 ));
+    *x = _mm_xor_si128( *x, _mm_srli_epi32( *x, 17 ));
+    *x = _mm_xor_si128( *x, _mm_slli_epi32( *x, 5 ));
+
+    return _mm_mul_ps( _mm_cvtepi32_ps( _mm_srli_epi32( *x, 8 )),
+                       _mm_set1_ps( RANDOM_UNIT ));
+}
+
+/**
+ * Convert float samples to s16 samples with SSE2
+ *
+ * @param[in] dec Pointer to a decoder
+ * @param[out] out s16 samples
+ * @param[in] in float samples
+ * @param[in] n A number of samples
+ */
+__attribute__(( target("sse2")))
+static void floatToS16SSE2( PKMDEC dec, int16_t *out, const float *in,
+                            int n )
+{
+    const __m128 scale = _mm_set1_ps( 32767.0f );
+    const __m128 maxv = _mm_set1_ps( 32767.0f );
+    const __m128 minv = _mm_set1_ps( -32768.0f );
+
+    bool dither = dec->dither == KMDEC_DITHER_TPDF;
+    __m128i a = _mm_loadu_si128(( __m128i * )dec->ditherA );
+    __m128i b = _mm_loadu_si128(( __m128i * )dec->ditherB );
+
+    int i;
+
+    for( i = 0; i + 8 <= n; i += 8 )
+    {
+        __m128 lo = _mm_mul_ps( _mm_loadu_ps( in + i ), scale );
+        __m128 hi = _mm_mul_ps( _mm_loadu_ps( in + i + 4 ), scale );
+
+        if( dither )
+        {
+            lo = _mm_add_ps( lo, _mm_sub_ps( randomSSE2( &a ),
+                                             randomSSE2( &b )));
+            hi = _mm_add_ps( hi, _mm_sub_ps( randomSSE2( &a ),
+                                             randomSSE2( &b )));
+        }
+
+        /* out-of-range values are not saturated by conversion */
+        lo = _mm_min_ps( _mm_max_ps( lo, minv ), maxv );
+        hi = _mm_min_ps( _mm_max_ps( hi, minv ), maxv );
+
+        _mm_storeu_si128(( __m128i * )( out + i ),
+                         _mm_packs_epi32( _mm_cvtps_epi32( lo ),
+                                          _mm_cvtps_epi32( hi )));
+    }
+
+    _mm_storeu_si128(( __m128i * )dec->ditherA, a );
+    _mm_storeu_si128(( __m128i * )dec->ditherB, b );
+
+    floatToS16C( dec, out + i, in + i, n - i );
+}
+
+/**
+ * Convert float samples to s32 samples with SSE2
+ *
+ * @param[out] out s32 samples
+ * @param[in] in float samples
+ * @param[in] n A number of samples
+ */
+__attribute__(( target("sse2")))
+static void floatToS32SSE2( int32_t *out, const float *in, int n )
+{
+    const __m128 scale = _mm_set1_ps( 2147483648.0f );
+
+    int i;
+
+    for( i = 0; i + 4 <= n; i += 4 )
+    {
+        __m128 v = _mm_mul_ps( _mm_loadu_ps( in + i ), scale );
+
+        /*
+         * out-of-range values are converted to INT32_MIN, so flip them to
+         * INT32_MAX if positive
+         */
+        __m128i over = _mm_castps_si128( _mm_cmpge_ps( v, scale ));
+
+        _mm_storeu_si128(( __m128i * )( out + i ),
+                         _mm_xor_si128( _mm_cvtps_epi32( v ), over ));
+    }
+
+    floatToS32C( out + i, in + i, n - i );
+}
+#endif
+
+/**
+ * Convert float samples to an output format with the fastest way
+ *
+ * @param[in] dec Pointer to a decoder
+ * @param[out] out Samples in an output format
+ * @param[in] in float samples
+ * @param[in] n A number of samples
+ */
+static void convert( PKMDEC dec, void *out, const float *in, int n )
+{
+    uint64_t start = statStart( dec );
+
+#ifdef HAVE_SSE2
+    if( dec->sse2 )
+    {
+        if( dec->format == KMDEC_BPS_S32 )
+            floatToS32SSE2( out, in, n );
+        else
+            floatToS16SSE2( dec, out, in, n );
+    }
+    else
+#endif
+    if( dec->format == KMDEC_BPS_S32 )
+        floatToS32C( out, in, n );
+    else
+        floatToS16C( dec, out, in, n );
+
+    statEnd( dec, &dec->stat.convertNs, start );
+}
+
+/**
+ * Fill the given buffer with samples converted from float samples
+ *
+ * @param[in] dec Pointer to a deocder
+ * @param[out] buffer Where to store samples in an output format
+ * @param[in] size Size of buffer in bytes
+ * @return Size filled in buffer in bytes
+ */
+static int decodeConvert( PKMDEC dec, void *buffer, int size )
+{
+    int width = KMDEC_BPS_BITS( dec->format ) >> 3;
+    int total = 0;
+
+    while( size >= width )
+    {
+        int n = MIN( size / width, CONV_SAMPLES );
+
+        if( growConv( dec, n * sizeof( float )) == -1 )
+            break;
+
+        int len = dec->ring ?
+                  renderAsync( dec, dec->convBuf, n * sizeof( float )) :
+                  renderSync( dec, dec->convBuf, n * sizeof( float ));
+
+        int converted = len / sizeof( float );
+
+        convert( dec, buffer, dec->convBuf, converted );
+
+        buffer = ( char * )buffer + converted * width;
+        size -= converted * width;
+
+        total += converted * width;
+
+        /* finished ? */
+        if( converted < n )
+            break;
+    }
+
+    return total;
+}
+
+/**
+ * Fill channel buffers with samples converted from float samples
+ *
+ * @param[in] dec Pointer to a deocder
+ * @param[out] buffers Buffers of left and right channels
+ * @param[in] size Size of each buffer in bytes
+ * @return Size filled in each buffer in bytes
+ */
+static int decodeConvertPlanar( PKMDEC dec, void *buffers[], int size )
+{
+    int width = KMDEC_BPS_BITS( dec->format ) >> 3;
+    void *chBufs[ 2 ];
+    int total = 0;
+
+    while( size >= width )
+    {
+        int n = MIN( size / width, CONV_SAMPLES );
+
+        if( growConv( dec, 2 * n * sizeof( float )) == -1 )
+            break;
+
+        chBufs[ 0 ] = dec->convBuf;
+        chBufs[ 1 ] = dec->convBuf + n;
+
+        int len = renderChannels( dec, chBufs, n * sizeof( float ));
+
+        int converted = len / sizeof( float );
+
+        for( int i = 0; i < 2; i++ )
+            convert( dec, ( char * )buffers[ i ] + total, chBufs[ i ],
+                     converted );
+
+        size -= converted * width;
+
+        total += converted * width;
+
+        /* finished ? */
+        if( converted < n )
+            break;
+    }
+
+    return total;
+}
+
+/**
+ * Fill buffers of stems with samples converted from float samples
+ *
+ * @param[in] dec Pointer to a deocder
+ * @param[out] buffers Buffers of stems
+ * @param[in] size Size of each buffer in bytes
+ * @return Size filled in each buffer in bytes
+ */
+static int decodeStemsConvert( PKMDEC dec, void *buffers[], int size )
+{
+    int width = KMDEC_BPS_BITS( dec->format ) >> 3;
+    void *stemBufs[ MAX_STEMS ];
+    int total = 0;
+
+    while( size >= width )
+    {
+        int n = MIN( size / width, CONV_SAMPLES );
+
+        if( growConv( dec, dec->stemCount * n * sizeof( float )) == -1 )
+            break;
+
+        for( int i = 0; i < dec->stemCount; i++ )
+            stemBufs[ i ] = dec->convBuf + i * n;
+
+        int len = decodeStems( dec, stemBufs, NULL, n * sizeof( float ));
+
+        int converted = len / sizeof( float );
+
+        for( int i = 0; i < dec->stemCount; i++ )
+            convert( dec, ( char * )buffers[ i ] + total, stemBufs[ i ],
+                     converted );
+
+        size -= converted * width;
+
+        total += converted * width;
+
+        /* finished ? */
+        if( converted < n )
+            break;
+    }
+
+    return total;
+}
+
+/**
+ * Publish samples rendered by a producer with its clock
+ *
+ * @param[in] dec Pointer to a decoder
+ * @param[in] head New write position
+ */
+static void publishAsync( PKMDEC dec, uint32_t head )
+{
+    uint32_t seq = dec->asyncSeq;
+
+    /* a reader retries while a sequence is odd or changed */
+    __atomic_store_n( &dec->asyncSeq, seq + 1, __ATOMIC_RELAXED );
+    __atomic_thread_fence( __ATOMIC_RELEASE );
+
+    __atomic_store_n( &dec->asyncClock, dec->clock, __ATOMIC_RELAXED );
+    __atomic_store_n( &dec->ringHead, head, __ATOMIC_RELEASE );
+
+    __atomic_store_n( &dec->asyncSeq, seq + 2, __ATOMIC_RELEASE );
+}
+
+/**
+ * Render a chunk into a ring buffer
+ *
+ * @param[in] dec Pointer to a decoder
+ * @param[in] head Write position
+ * @param[in] tail Read position
+ * @param[in] chunk Maximum size to render in bytes
+ */
+static void fillAsync( PKMDEC dec, uint32_t head, uint32_t tail,
+                       uint32_t chunk )
+{
+    uint32_t pos = head & ( dec->ringSize - 1 );
+    uint32_t len = dec->ringSize - ( head - tail );
+
+    len = MIN( len, dec->ringSize - pos );
+    len = MIN( len, chunk );
+
+    int filled = renderSync( dec, dec->ring + pos, len );
+
+    publishAsync( dec, head + filled );
+
+    /* finished ? */
+    if( filled < len )
+        __atomic_store_n( &dec->ringEof, true, __ATOMIC_RELEASE );
+}
+
+/**
+ * Producer thread of asynchronous rendering
+ *
+ * @param[in] arg Pointer to a decoder
+ * @return NULL
+ */
+static void *asyncProc( void *arg )
+{
+    PKMDEC dec = arg;
+    uint32_t chunk = dec->ringSize / 4;
+
+    while( !__atomic_load_n( &dec->ringEof, __ATOMIC_RELAXED ))
+    {
+        uint32_t head = dec->ringHead;
+        uint32_t tail = __atomic_load_n( &dec->ringTail, __ATOMIC_ACQUIRE );
+        bool stop;
+
+        if( dec->ringSize - ( head - tail ) < chunk )
+        {
+            /*
+             * wait for room for a chunk. A consumer never blocks, and
+             * takes a mutex only to wake up a producer sleeping
+             */
+            pthread_mutex_lock( &dec->asyncMutex );
+            while( !dec->asyncStop )
+            {
+                __atomic_store_n( &dec->asyncSleeping, true,
+                                  __ATOMIC_SEQ_CST );
+
+                tail = __atomic_load_n( &dec->ringTail, __ATOMIC_SEQ_CST );
+                if( dec->ringSize - ( head - tail ) >= chunk )
+                    break;
+
+                pthread_cond_wait( &dec->asyncCond, &dec->asyncMutex );
+            }
+            __atomic_store_n( &dec->asyncSleeping, false, __ATOMIC_RELAXED );
+            stop = dec->asyncStop;
+            pthread_mutex_unlock( &dec->asyncMutex );
+
+            if( stop )
+                break;
+        }
+
+        if( __atomic_load_n( &dec->asyncStop, __ATOMIC_RELAXED ))
+            break;
+
+        fillAsync( dec, head, tail, chunk );
+    }
+
+    return NULL;
+}
+
+/**
+ * Start a producer thread
+ *
+ * @param[in] dec Pointer to a decoder
+ * @return 0 on success, -1 on error
+ */
+static int startAsync( PKMDEC dec )
+{
+    dec->ringHead = 0;
+    dec->ringTail = 0;
+    dec->ringEof = false;
+    dec->asyncClock = dec->clock;
+    dec->asyncSeq = 0;
+    dec->asyncSleeping = false;
+    dec->asyncStop = false;
+
+    /* render a first chunk ahead not to underrun on start */
+    fillAsync( dec, 0, 0, dec->ringSize / 4 );
+
+    if( pthread_create( &dec->asyncThread, NULL, asyncProc, dec ))
+        return -1;
+
+    dec->asyncRunning = true;
+
+    return 0;
+}
+
+/**
+ * Stop a producer thread, and discard samples not consumed yet
+ *
+ * @param[in] dec Pointer to a decoder
+ */
+static void stopAsync( PKMDEC dec )
+{
+    if( !dec->asyncRunning )
+        return;
+
+    pthread_mutex_lock( &dec->asyncMutex );
+    __atomic_store_n( &dec->asyncStop, true, __ATOMIC_RELAXED );
+    pthread_cond_broadcast( &dec->asyncCond );
+    pthread_mutex_unlock( &dec->asyncMutex );
+
+    pthread_join( dec->asyncThread, NULL );
+
+    dec->asyncRunning = false;
+
+    dec->ringHead = 0;
+    dec->ringTail = 0;
+    dec->ringEof = false;
+}
+
+/**
+ * Copy samples rendered by a producer thread
+ *
+ * This never blocks. On underrun, the rest of @a buffer is filled with
+ * silence.
+ *
+ * @param[in] dec Pointer to a deocder
+ * @param[out] buffer Where to store samples
+ * @param[in] size Size of buffer in bytes
+ * @return Size filled in buffer in bytes
+ */
+static int renderAsync( PKMDEC dec, void *buffer, int size )
+{
+    int total = 0;
+
+    /* failed to restart a producer ? */
+    if( !dec->asyncRunning )
+        return 0;
+
+    while( size > 0 )
+    {
+        uint32_t tail = dec->ringTail;
+        bool eof = __atomic_load_n( &dec->ringEof, __ATOMIC_ACQUIRE );
+        uint32_t head = __atomic_load_n( &dec->ringHead, __ATOMIC_ACQUIRE );
+
+        if( head == tail )
+        {
+            /* rendered all ? */
+            if( eof )
+                break;
+
+            /* underrun, play silence rather than wait for a producer */
+            memset( buffer, 0, size );
+
+            total += size;
+
+            break;
+        }
+
+        uint32_t pos = tail & ( dec->ringSize - 1 );
+        uint32_t len = MIN( head - tail, dec->ringSize - pos );
+
+        len = MIN( len, ( uint32_t )size );
+
+        uint64_t start = statStart( dec );
+
+        memcpy( buffer, dec->ring + pos, len );
+
+        statEnd( dec, &dec->stat.copyNs, start );
+        statAdd( dec, &dec->stat.bytesCopied, len );
+
+        __atomic_store_n( &dec->ringTail, tail + len, __ATOMIC_SEQ_CST );
+
+        buffer = ( char * )buffer + len;
+        size -= len;
+
+        total += len;
+    }
+
+    /* let a producer fill consumed room if waiting for it */
+    if( __atomic_exchange_n( &dec->asyncSleeping, false, __ATOMIC_SEQ_CST ))
+    {
+        pthread_mutex_lock( &dec->asyncMutex );
+        pthread_cond_signal( &dec->asyncCond );
+        pthread_mutex_unlock( &dec->asyncMutex );
+    }
+
+    return total;
+}
+
+/**
+ * Get a clock of samples consumed by a caller
+ *
+ * @param[in] dec Pointer to a deocder
+ * @return Clock in us
+ */
+static uint64_t currentClock( PKMDEC dec )
+{
+    if( !dec->asyncRunning )
+        return dec->clock;
+
+    uint64_t clock;
+    uint32_t head;
+    uint32_t seq;
+
+    /* a clock and a write position are updated together by a producer */
+    do
+    {
+        while(( seq = __atomic_load_n( &dec->asyncSeq,
+                                       __ATOMIC_ACQUIRE )) & 1 )
+            /* nothing */;
+
+        clock = __atomic_load_n( &dec->asyncClock, __ATOMIC_RELAXED );
+        head = __atomic_load_n( &dec->ringHead, __ATOMIC_RELAXED );
+
+        __atomic_thread_fence( __ATOMIC_ACQUIRE );
+    } while( __atomic_load_n( &dec->asyncSeq, __ATOMIC_RELAXED ) != seq );
+
+    uint32_t tail = __atomic_load_n( &dec->ringTail, __ATOMIC_ACQUIRE );
+
+    /* exclude samples buffered in a ring */
+    uint64_t buffered = CLOCK_BASE * (( head - tail ) / dec->sampleSize )
+                        / dec->sampleRate;
+
+    return clock > buffered ? clock - buffered : 0;
+}
+
+/**
+ * Get bytes per sample of output
+ *
+ * @param[in] dec Pointer to a deocder
+ * @return Bytes per sample
+ */
+static int outSampleSize( PKMDEC dec )
+{
+    /* samples are converted after resampled */
+    if( !dec->convert || dec->resampler )
+        return dec->sampleSize;
+
+    return dec->sampleSize / sizeof( float )
+           * ( KMDEC_BPS_BITS( dec->format ) >> 3 );
+}
+
+/**
+ * Fill the given buffer with rendered samples in output format
+ *
+ * @param[in] dec Pointer to a deocder
+ * @param[out] buffer where to store samples
+ * @param[in] size Size of buffer in bytes
+ * @return Size filled in buffer in bytes
+ */
+static int renderOut( PKMDEC dec, void *buffer, int size )
+{
+    if( dec->convert && !dec->resampler )
+        return decodeConvert( dec, buffer, size );
+
+    if( dec->ring )
+        return renderAsync( dec, buffer, size );
+
+    return renderSync( dec, buffer, size );
+}
+
+/* samples per block of render cache */
+#define CACHE_BLOCK     4096
+
+/**
+ * Seek rendering to a sample position
+ *
+ * @param[in] dec Pointer to a deocder
+ * @param[in] pos Sample position
+ * @return 0 on success, -1 on error
+ */
+static int seekRender( PKMDEC dec, uint64_t pos )
+{
+    /* round up not to seek before pos */
+    uint64_t clock = ( pos * CLOCK_BASE + dec->sampleRate - 1 )
+                     / dec->sampleRate;
+
+    stopAsync( dec );
+
+    int rc = seekClock( dec, clock );
+
+    if( dec->ring && startAsync( dec ) == -1 )
+        rc = -1;
+
+    dec->renderPos = pos;
+
+    return rc;
+}
+
+/**
+ * Store rendered samples into a block of render cache
+ *
+ * Samples are stored only if they continue samples of a block, and
+ * a block is allocated only within a memory budget.
+ *
+ * @param[in] dec Pointer to a deocder
+ * @param[in] block Index of a block
+ * @param[in] offset Offset of samples in a block in bytes
+ * @param[in] buf Samples
+ * @param[in] len Length of @a buf in bytes
+ */
+static void storeCache( PKMDEC dec, uint64_t block, int offset,
+                        const void *buf, int len )
+{
+    int blockSize = CACHE_BLOCK * outSampleSize( dec );
+
+    /* blocks before a loop are not played again while looping */
+    if( len == 0 || ( dec->loop && ( block + 1 ) * CACHE_BLOCK
+                                   <= dec->loopStart ))
+        return;
+
+    if( block >= dec->cacheCount )
+    {
+        if( offset != 0 || dec->cacheUsed + blockSize > dec->cacheBudget )
+            return;
+
+        int count = MAX( dec->cacheCount * 2, ( int )block + 1 );
+        PKMCACHEBLOCK cache = realloc( dec->cache, count * sizeof( *cache ));
+
+        if( !cache )
+            return;
+
+        memset( cache + dec->cacheCount, 0,
+                ( count - dec->cacheCount ) * sizeof( *cache ));
+
+        dec->cache = cache;
+        dec->cacheCount = count;
+    }
+
+    PKMCACHEBLOCK b = dec->cache + block;
+
+    if( !b->data )
+    {
+        if( offset != 0 || dec->cacheUsed + blockSize > dec->cacheBudget )
+            return;
+
+        b->data = malloc( blockSize );
+        if( !b->data )
+            return;
+
+        dec->cacheUsed += blockSize;
+    }
+
+    if( b->fill == offset )
+    {
+        memcpy( b->data + offset, buf, len );
+        b->fill += len;
+    }
+}
+
+/**
+ * Free render cache, and rewind positions of it
+ *
+ * @param[in] dec Pointer to a deocder
+ */
+static void clearCache( PKMDEC dec )
+{
+    for( int i = 0; i < dec->cacheCount; i++ )
+        free( dec->cache[ i ].data );
+
+    free( dec->cache );
+
+    dec->cache = NULL;
+    dec->cacheCount = 0;
+    dec->cacheUsed = 0;
+
+    dec->outPos = 0;
+    dec->renderPos = 0;
+    dec->endPos = NO_LOOP;
+}
+
+/**
+ * Fill the given buffer through render cache, looping if wanted
+ *
+ * @param[in] dec Pointer to a deocder
+ * @param[out] buffer where to store samples
+ * @param[in] size Size of buffer in bytes
+ * @return Size filled in buffer in bytes
+ */
+static int decodeCached( PKMDEC dec, void *buffer, int size )
+{
+    int sampleSize = outSampleSize( dec );
+    int blockSize = CACHE_BLOCK * sampleSize;
+    int total = 0;
+
+    /* loop points are known after a scan, play without looping until then */
+    if( dec->loop )
+        finishScan( dec, false );
+
+    bool loop = dec->loop
+                && !__atomic_load_n( &dec->scanning, __ATOMIC_ACQUIRE );
+
+    while( size >= sampleSize )
+    {
+        uint64_t end = dec->endPos;
+
+        if( loop )
+            end = MIN( end, dec->loopEnd );
+
+        if( dec->outPos >= end )
+        {
+            if( !loop || dec->loopStart >= end )
+                break;
+
+            /* wrap around without a gap */
+            dec->outPos = dec->loopStart;
+        }
+
+        uint64_t block = dec->outPos / CACHE_BLOCK;
+        int offset = dec->outPos % CACHE_BLOCK * sampleSize;
+        int len = MIN(( uint64_t )( size / sampleSize ), end - dec->outPos )
+                  * sampleSize;
+        PKMCACHEBLOCK b = block < dec->cacheCount ? dec->cache + block : NULL;
+
+        if( b && b->fill > offset )
+        {
+            uint64_t start = statStart( dec );
+
+            len = MIN( len, b->fill - offset );
+            memcpy( buffer, b->data + offset, len );
+
+            statEnd( dec, &dec->stat.copyNs, start );
+            statAdd( dec, &dec->stat.bytesCopied, len );
+        }
+        else
+        {
+            /* render up to the end of a block to cache it */
+            int wanted = MIN( len, blockSize - offset );
+
+            len = 0;
+
+            if( dec->renderPos == dec->outPos
+                || seekRender( dec, dec->outPos ) == 0 )
+            {
+                len = renderOut( dec, buffer, wanted );
+                len -= len % sampleSize;
+
+                dec->renderPos += len / sampleSize;
+
+                storeCache( dec, block, offset, buffer, len );
+            }
+
+            /* reached the end */
+            if( len < wanted )
+                dec->endPos = dec->outPos + len / sampleSize;
+        }
+
+        dec->outPos += len / sampleSize;
+
+        buffer = ( char * )buffer + len;
+        size -= len;
+
+        total += len;
+    }
+
+    return total;
+}
+
+/**
+ * Fill the given buffer with rendered samples, through render cache if used
+ *
+ * @param[in] dec Pointer to a deocder
+ * @param[out] buffer where to store samples
+ * @param[in] size Size of buffer in bytes
+ * @return Size filled in buffer in bytes
+ */
+static int decodeRendered( PKMDEC dec, void *buffer, int size )
+{
+    if( USE_CACHE( dec ))
+        return decodeCached( dec, buffer, size );
+
+    return renderOut( dec, buffer, size );
+}
+
+/* taps of each phase of a resampler, even */
+#define RESAMPLE_TAPS       32
+
+/* half of taps, frames needed around an output */
+#define RESAMPLE_HALF       ( RESAMPLE_TAPS / 2 )
+
+/* maximum phases of a resampler */
+#define RESAMPLE_MAX_PHASES 1024
+
+/* passband relative to the lower Nyquist frequency */
+#define RESAMPLE_PASSBAND   0.9
+
+/* beta of Kaiser window, about 80dB of stopband attenuation */
+#define RESAMPLE_BETA       8.0
+
+/* frames rendered into a resampler at once at most */
+#define RESAMPLE_FRAMES     4096
+
+/**
+ * Calculate zeroth order modified Bessel function of the first kind
+ *
+ * @param[in] x Argument
+ * @return I0( @a x )
+ */
+static double besselI0( double x )
+{
+    double sum = 1.0;
+    double term = 1.0;
+
+    for( int k = 1; term > sum * 1e-12; k++ )
+    {
+        term *= ( x / 2 / k ) * ( x / 2 / k );
+        sum += term;
+    }
+
+    return sum;
+}
+
+/**
+ * Open a resampler converting a rate of a synthesizer to an output rate
+ *
+ * @param[in] dec Pointer to a decoder
+ * @param[in] inRate Sample rate of a synthesizer
+ * @param[in] outRate Sample rate of output
+ * @param[in] channels A number of channels
+ * @return 0 on success, -1 on error
+ */
+static int openResampler( PKMDEC dec, int inRate, int outRate, int channels )
+{
+    PKMRESAMPLER rs;
+    int a = inRate, b = outRate;
+
+    if( inRate <= 0 || outRate <= 0 )
+        return -1;
+
+    /* reduce a ratio of rates */
+    while( b )
+    {
+        int t = a % b;
+
+        a = b;
+        b = t;
+    }
+
+    if( outRate / a > RESAMPLE_MAX_PHASES )
+        return -1;
+
+    rs = calloc( 1, sizeof( *rs ));
+    if( !rs )
+        return -1;
+
+    rs->up = outRate / a;
+    rs->down = inRate / a;
+    rs->channels = channels;
+
+    rs->coefs = malloc( rs->up * RESAMPLE_TAPS * sizeof( *rs->coefs ));
+
+    /* silence before the first frame is stored by resetResampler() */
+    rs->inSize = RESAMPLE_FRAMES;
+    rs->in = malloc( rs->inSize * channels * sizeof( *rs->in ));
+
+    if( !rs->coefs || !rs->in )
+    {
+        free( rs->coefs );
+        free( rs->in );
+        free( rs );
+
+        return -1;
+    }
+
+    /* cutoff in cycles per input sample */
+    double cutoff = RESAMPLE_PASSBAND * MIN( inRate, outRate ) / 2 / inRate;
+    double i0Beta = besselI0( RESAMPLE_BETA );
+
+    for( int p = 0; p < rs->up; p++ )
+    {
+        float *c = rs->coefs + p * RESAMPLE_TAPS;
+        double sum = 0;
+
+        /* windowed sinc, in order of input frames */
+        for( int k = 0; k < RESAMPLE_TAPS; k++ )
+        {
+            double t = k - ( RESAMPLE_HALF - 1 ) - ( double )p / rs->up;
+            double x = 2 * cutoff * t;
+            double r = t / RESAMPLE_HALF;
+            double h = x == 0 ? 1.0 : sin( M_PI * x ) / ( M_PI * x );
+
+            h *= r * r < 1 ? besselI0( RESAMPLE_BETA * sqrt( 1 - r * r ))
+                             / i0Beta : 0;
+
+            c[ k ] = h;
+            sum += h;
+        }
+
+        /* unity gain at DC in every phase */
+        for( int k = 0; k < RESAMPLE_TAPS; k++ )
+            c[ k ] /= sum;
+    }
+
+    dec->resampler = rs;
+
+    resetResampler( dec );
+
+    return 0;
+}
+
+/**
+ * Close a resampler
+ *
+ * @param[in] dec Pointer to a decoder
+ */
+static void closeResampler( PKMDEC dec )
+{
+    PKMRESAMPLER rs = dec->resampler;
+
+    if( !rs )
+        return;
+
+    free( rs->coefs );
+    free( rs->in );
+    free( rs );
+
+    dec->resampler = NULL;
+}
+
+/**
+ * Discard frames in a resampler to resample from a new position
+ *
+ * @param[in] dec Pointer to a decoder
+ */
+static void resetResampler( PKMDEC dec )
+{
+    PKMRESAMPLER rs = dec->resampler;
+
+    if( !rs )
+        return;
+
+    /* silence before the first frame */
+    memset( rs->in, 0, ( RESAMPLE_HALF - 1 ) * rs->channels
+                       * sizeof( *rs->in ));
+
+    rs->inCount = RESAMPLE_HALF - 1;
+    rs->inPos = RESAMPLE_HALF - 1;
+    rs->phase = 0;
+    rs->eof = false;
+    rs->eofCount = 0;
+}
+
+/**
+ * Fill a resampler with rendered frames
+ *
+ * @param[in] dec Pointer to a decoder
+ * @param[in] frames Frames wanted
+ * @return 0 on success, -1 on error
+ */
+static int fillResampler( PKMDEC dec, int frames )
+{
+    PKMRESAMPLER rs = dec->resampler;
+    int frameSize = rs->channels * sizeof( float );
+
+    /* drop frames not needed any more */
+    int drop = MIN( rs->inPos - ( RESAMPLE_HALF - 1 ), rs->inCount );
+    if( drop > 0 )
+    {
+        memmove( rs->in, rs->in + drop * rs->channels,
+                 ( rs->inCount - drop ) * frameSize );
+
+        rs->inCount -= drop;
+        rs->inPos -= drop;
+    }
+
+    /* room for silence after the last frame */
+    if( rs->inCount + frames + RESAMPLE_HALF > rs->inSize )
+    {
+        int size = rs->inCount + frames + RESAMPLE_HALF;
+        float *in = realloc( rs->in, size * frameSize );
+        if( !in )
+            return -1;
+
+        rs->in = in;
+        rs->inSize = size;
+    }
+
+    int len = decodeRendered( dec, rs->in + rs->inCount * rs->channels,
+                              frames * frameSize );
+
+    rs->inCount += len / frameSize;
+
+    if( len < frames * frameSize )
+    {
+        rs->eof = true;
+        rs->eofCount = rs->inCount;
+
+        /* silence after the last frame */
+        memset( rs->in + rs->inCount * rs->channels, 0,
+                ( rs->inSize - rs->inCount ) * frameSize );
+
+        rs->inCount = rs->inSize;
+    }
+
+    return 0;
+}
+
+/**
+ * Resample rendered frames to an output rate
+ *
+ * @param[in] dec Pointer to a decoder
+ * @param[out] out Resampled frames in float, interleaved
+ * @param[in] frames Frames wanted
+ * @return Frames stored in @a out
+ */
+static int resample( PKMDEC dec, float *out, int frames )
+{
+    PKMRESAMPLER rs = dec->resampler;
+    int channels = rs->channels;
+    int done = 0;
+
+    while( done < frames )
+    {
+        /* frames up to the last tap of the next output */
+        if( rs->inCount < rs->inPos + RESAMPLE_HALF + 1 )
+        {
+            if( rs->eof )
+            {
+                /* padded with silence enough */
+                break;
+            }
+
+            /* input frames of the remaining outputs */
+            int wanted = ( int )(( uint64_t )( frames - done ) * rs->down
+                                 / rs->up ) + RESAMPLE_TAPS;
+
+            if( fillResampler( dec, MIN( wanted, RESAMPLE_FRAMES )) == -1 )
+                break;
+
+            continue;
+        }
+
+        /* outputs after the last frame are not wanted */
+        if( rs->eof && rs->inPos >= rs->eofCount )
+            break;
+
+        const float *c = rs->coefs + rs->phase * RESAMPLE_TAPS;
+        const float *x = rs->in
+                         + ( rs->inPos - ( RESAMPLE_HALF - 1 )) * channels;
+
+        if( channels == 2 )
+        {
+            float l = 0, r = 0;
+
+            for( int k = 0; k < RESAMPLE_TAPS; k++ )
+            {
+                l += c[ k ] * x[ k * 2 ];
+                r += c[ k ] * x[ k * 2 + 1 ];
+            }
+
+            out[ 0 ] = l;
+            out[ 1 ] = r;
+        }
+        else
+        {
+            for( int ch = 0; ch < channels; ch++ )
+            {
+                float v = 0;
+
+                for( int k = 0; k < RESAMPLE_TAPS; k++ )
+                    v += c[ k ] * x[ k * channels + ch ];
+
+                out[ ch ] = v;
+            }
+        }
+
+        out += channels;
+        done++;
+
+        rs->phase += rs->down;
+        rs->inPos += rs->phase / rs->up;
+        rs->phase %= rs->up;
+    }
+
+    return done;
+}
+
+/**
+ * Fill the given buffer with samples resampled to an output rate
+ *
+ * @param[in] dec Pointer to a deocder
+ * @param[out] buffer Where to store samples in an output format
+ * @param[in] size Size of buffer in bytes
+ * @return Size filled in buffer in bytes
+ */
+static int decodeResampled( PKMDEC dec, void *buffer, int size )
+{
+    int channels = dec->resampler->channels;
+    int width = dec->convert ? KMDEC_BPS_BITS( dec->format ) >> 3 :
+                               sizeof( float );
+    int frameSize = channels * width;
+    int total = 0;
+
+    while( size >= frameSize )
+    {
+        int n = MIN( size / frameSize, CONV_SAMPLES );
+
+        if( growConv( dec, n * channels * sizeof( float )) == -1 )
+            break;
+
+        int frames = resample( dec, dec->convBuf, n );
+
+        if( dec->convert )
+            convert( dec, buffer, dec->convBuf, frames * channels );
+        else
+            memcpy( buffer, dec->convBuf, frames * frameSize );
+
+        buffer = ( char * )buffer + frames * frameSize;
+        size -= frames * frameSize;
+
+        total += frames * frameSize;
+
+        /* finished ? */
+        if( frames < n )
+            break;
+    }
+
+    return total;
+}
+
+/**
+ * Fill channel buffers with samples resampled to an output rate
+ *
+ * @param[in] dec Pointer to a deocder
+ * @param[out] buffers Buffers of left and right channels
+ * @param[in] size Size of each buffer in bytes
+ * @return Size filled in each buffer in bytes
+ */
+static int decodeResampledPlanar( PKMDEC dec, void *buffers[], int size )
+{
+    int width = dec->convert ? KMDEC_BPS_BITS( dec->format ) >> 3 :
+                               sizeof( float );
+    float *chBufs[ 2 ];
+    int total = 0;
+
+    while( size >= width )
+    {
+        int n = MIN( size / width, CONV_SAMPLES );
+
+        /* interleaved frames, and then left and right channels */
+        if( growConv( dec, 4 * n * sizeof( float )) == -1 )
+            break;
+
+        chBufs[ 0 ] = dec->convBuf + 2 * n;
+        chBufs[ 1 ] = dec->convBuf + 3 * n;
+
+        int frames = resample( dec, dec->convBuf, n );
+
+        for( int i = 0; i < frames; i++ )
+        {
+            chBufs[ 0 ][ i ] = dec->convBuf[ i * 2 ];
+            chBufs[ 1 ][ i ] = dec->convBuf[ i * 2 + 1 ];
+        }
+
+        for( int i = 0; i < 2; i++ )
+        {
+            char *out = ( char * )buffers[ i ] + total;
+
+            if( dec->convert )
+                convert( dec, out, chBufs[ i ], frames );
+            else
+                memcpy( out, chBufs[ i ], frames * width );
+        }
+
+        size -= frames * width;
+
+        total += frames * width;
+
+        /* finished ? */
+        if( frames < n )
+            break;
+    }
+
+    return total;
+}
+
+/**
+ * Fill the given buffer with decoded MIDI messages
+ *
+ * @param[in] dec Pointer to a deocder
+ * @param[out] buffer where to store the decoded messages
+ * @param[in] size Size of buffer in bytes
+ * @return Size filled in buffer in bytes
+ */
+int kmdecDecode( PKMDEC dec, void *buffer, int size )
+{
+    if( !dec )
+        return 0;
+
+    if( dec->resampler )
+        return decodeResampled( dec, buffer, size );
+
+    return decodeRendered( dec, buffer, size );
+}
+
+/**
+ * Fill channel buffers with decoded MIDI messages
+ *
+ * @param[in] dec Pointer to a deocder
+ * @param[out] buffers Buffers of left and right channels
+ * @param[in] size Size of each buffer in bytes
+ * @return Size filled in each buffer in bytes
+ */
+int kmdecDecodePlanar( PKMDEC dec, void *buffers[], int size )
+{
+    if( !dec || !buffers )
+        return 0;
+
+    if( dec->resampler )
+        return decodeResampledPlanar( dec, buffers, size );
+
+    if( dec->convert )
+        return decodeConvertPlanar( dec, buffers, size );
+
+    return renderChannels( dec, buffers, size );
+}
+
+/**
+ * Fill buffers of stems with decoded MIDI messages
+ *
+ * @param[in] dec Pointer to a deocder
+ * @param[out] buffers Buffers of stems
+ * @param[in] size Size of each buffer in bytes
+ * @return Size filled in each buffer in bytes
+ */
+int kmdecDecodeStems( PKMDEC dec, void *buffers[], int size )
+{
+    if( !dec || !buffers || dec->stemCount == 0 || dec->ring )
+        return 0;
+
+    if( dec->convert )
+        return decodeStemsConvert( dec, buffers, size );
+
+    return decodeStems( dec, buffers, NULL, size );
+}
+
+/**
+ * Get statistics of a decoder
+ *
+ * @param[in] dec Pointer to a deocder
+ * @param[out] stats Pointer to statistics
+ * @return 0 on success, -1 on error
+ */
+int kmdecGetStats( PKMDEC dec, PKMDECSTATS stats )
+{
+    if( !dec || !stats )
+        return -1;
+
+    /* counters may be being updated by other threads */
+    for( int i = 0; i < KMDEC_EVENT_TYPES; i++ )
+        stats->events[ i ] = __atomic_load_n( &dec->stat.events[ i ],
+                                              __ATOMIC_RELAXED );
+
+    stats->chunks = __atomic_load_n( &dec->stat.chunks, __ATOMIC_RELAXED );
+    stats->samples = __atomic_load_n( &dec->stat.samples, __ATOMIC_RELAXED );
+    stats->bytesCopied = __atomic_load_n( &dec->stat.bytesCopied,
+                                          __ATOMIC_RELAXED );
+    stats->peakVoices = __atomic_load_n( &dec->stat.peakVoices,
+                                         __ATOMIC_RELAXED );
+    stats->parseNs = __atomic_load_n( &dec->stat.parseNs, __ATOMIC_RELAXED );
+    stats->scheduleNs = __atomic_load_n( &dec->stat.scheduleNs,
+                                         __ATOMIC_RELAXED );
+    stats->synthNs = __atomic_load_n( &dec->stat.synthNs, __ATOMIC_RELAXED );
+    stats->copyNs = __atomic_load_n( &dec->stat.copyNs, __ATOMIC_RELAXED );
+    stats->convertNs = __atomic_load_n( &dec->stat.convertNs,
+                                        __ATOMIC_RELAXED );
+
+    return 0;
+}
+
+/**
+ * Get duration of MIDI file in milli-seconds
+ *
+ * @param[in] dec Pointer to a deocder
+ * @return Length of MIDI in milli-seconds, -1 if a stream is not decoded
+ *         to the end yet
+ */
+int kmdecGetDuration( PKMDEC dec )
+{
+    if( !dec )
+        return -1;
+
+    finishScan( dec, true );
+
+    if( __atomic_load_n( &dec->streaming, __ATOMIC_ACQUIRE ))
+        return -1;
+
+    return 1000 * dec->duration / CLOCK_BASE;
+}
+
+/**
+ * Check if duration of MIDI file is ready
+ *
+ * @param[in] dec Pointer to a deocder
+ * @return 1 if ready, 0 if not ready, -1 on error
+ */
+int kmdecIsDurationReady( PKMDEC dec )
+{
+    if( !dec )
+        return -1;
+
+    finishScan( dec, false );
+
+    return !__atomic_load_n( &dec->scanning, __ATOMIC_ACQUIRE )
+           && !__atomic_load_n( &dec->streaming, __ATOMIC_ACQUIRE );
+}
+
+/**
+ * Get current position of decoder in milli-seconds
+ *
+ * @param[in] dec Pointer to a deocder
+ * @return Current position of decoder in milli-seconds
+ */
+int kmdecGetPosition( PKMDEC dec )
+{
+    if( !dec )
+        return -1;
+
+    if( USE_CACHE( dec ))
+        return 1000 * dec->outPos / dec->sampleRate;
+
+    return 1000 * currentClock( dec ) / CLOCK_BASE;
+}
+
+/**
+ * Seek to the given clock
+ *
+ * @param[in] dec Pointer to a deocder
+ * @param[in] clock Clock in us
+ * @return 0 on success, -1 on error
+ */
+static int seekClock( PKMDEC dec, uint64_t clock )
+{
+    if( clock != dec->clock )
+    {
+        PKMSNAPSHOT snap = findSnapshot( dec, clock );
+
+        /* jump to the nearest snapshot, rewind, or stop notes sounding now */
+        if( snap && ( clock < dec->clock || snap->clock > dec->clock ))
+            restoreSnapshot( dec, snap );
+        else if( clock < dec->clock )
+            reset( dec );
+        else
+            releaseNotes( dec );
+
+        /* fast-forward with control events only */
+        if( dec->timing == KMDEC_TIMING_SAMPLE )
+        {
+            uint64_t target = clock * dec->sampleRate / CLOCK_BASE;
+
+            while( dec->samplePos < target
+                   && decodeSample( dec, DECODE_SEEK, NULL, 0,
+                                    target ) != -1 )
+                /* nothing */;
+
+            /* clock from samples may be less than clock a bit */
+            if( dec->samplePos == target )
+                dec->clock = clock;
+        }
+        else
+        {
+            while( dec->clock < clock
+                   && decode( dec, DECODE_SEEK, NULL, 0 ) != -1 )
+                /* nothing */;
+        }
+
+        restoreNotes( dec );
+    }
+
+    if( dec->clock >= clock )
+        return 0;
+
+    return -1;
+}
+
+/**
+ * Seek to the given position
+ *
+ * @param[in] dec Pointer to a deocder
+ * @param[in] offset Offset in ms
+ * @param[in] origin Origin of seek
+ * @return 0 on success, -1 on error
+ */
+int kmdecSeek( PKMDEC dec, int offset, int origin )
+{
+    if( !dec )
+        return -1;
+
+    uint64_t clock, originClock;
+
+    /* use seek index if ready, and wait for duration if needed */
+    finishScan( dec, origin == KMDEC_SEEK_END );
+
+    bool streaming = __atomic_load_n( &dec->streaming, __ATOMIC_ACQUIRE );
+
+    switch( origin )
+    {
+        case KMDEC_SEEK_SET:
+            originClock = 0;
+            break;
+
+        case KMDEC_SEEK_CUR:
+            originClock = USE_CACHE( dec ) ?
+                          CLOCK_BASE * dec->outPos / dec->sampleRate :
+                          currentClock( dec );
+            break;
+
+        case KMDEC_SEEK_END:
+            /* the end of a stream is not known yet */
+            if( streaming )
+                return -1;
+
+            originClock = dec->duration;
+            break;
+
+        default:
+            return -1;
+    }
+
+    clock = originClock + CLOCK_BASE * offset / 1000;
+    /* wrapped around ? */
+    if( offset < 0 && clock > originClock )
+        clock = 0;
+    else if( !__atomic_load_n( &dec->scanning, __ATOMIC_ACQUIRE )
+             && !streaming && clock > dec->duration )
+        clock = dec->duration;
+
+    /* frames rendered ahead for resampling */
+    resetResampler( dec );
+
+    /* samples may be played from render cache */
+    if( USE_CACHE( dec ))
+    {
+        dec->outPos = clock * dec->sampleRate / CLOCK_BASE;
+
+        return 0;
+    }
+
+    /* discard samples rendered ahead */
+    stopAsync( dec );
+
+    int rc = seekClock( dec, clock );
+
+    if( dec->ring && startAsync( dec ) == -1 )
+        return -1;
+
+    return rc;
+}
+
+/**
+ * Set asynchronous rendering
+ *
+ * @param[in] dec Pointer to a deocder
+ * @param[in] size Size of a ring buffer in bytes, 0 to disable
+ * @return 0 on success, -1 on error
+ */
+int kmdecSetAsync( PKMDEC dec, int size )
+{
+    if( !dec || size < 0 )
+        return -1;
+
+    uint64_t clock = currentClock( dec );
 
-    if( memRead( mfd, data, len ) == -1 )
-        return -1;
-    track->offset += len;
+    stopAsync( dec );
 
-    /* check F0 SysEx syntax which should end with F7 EOX */
-    if( status == 0xF0 && data[ len - 1 ] != 0xF7 )
+    free( dec->ring );
+    dec->ring = NULL;
+    dec->ringSize = 0;
+
+    /* continue from where samples have been consumed */
+    if( seekClock( dec, clock ) == -1 )
         return -1;
 
-    data[ 0 ] &= 0x7F;
-    data[ 1 ] &= 0x7F;
+    if( size == 0 )
+        return 0;
 
-    /* pass MIDI event to fluidsynth */
-    switch( event )
+    if( !dec->asyncInited )
     {
-        case 0x80:  /* note off */
-            fluid_synth_noteoff( synth, channel, data[ 0 ]);
-            break;
+        if( pthread_mutex_init( &dec->asyncMutex, NULL ))
+            return -1;
 
-        case 0x90:  /* note on */
-            fluid_synth_noteon( synth, channel, data[ 0 ], data[ 1 ]);
-            break;
+        if( pthread_cond_init( &dec->asyncCond, NULL ))
+        {
+            pthread_mutex_destroy( &dec->asyncMutex );
 
-        case 0xA0: /* polyphonic aftertouch */
-            /* not supported */
-            break;
+            return -1;
+        }
 
-        case 0xB0:  /* control mode hnage */
-            fluid_synth_cc( synth, channel, data[ 0 ], data[ 1 ]);
-            break;
+        dec->asyncInited = true;
+    }
 
-        case 0xC0:  /* program change */
-            fluid_synth_program_change( synth, channel, data[ 0 ]);
-            break;
+    /* power of 2 to wrap around positions */
+    uint32_t ringSize = 4096;
+    while( ringSize < ( uint32_t )size )
+        ringSize <<= 1;
 
-        case 0xD0:  /* channel key pressure */
-            fluid_synth_channel_pressure( synth, channel, data[ 0 ]);
-            break;
+    dec->ring = malloc( ringSize );
+    if( !dec->ring )
+        return -1;
 
-        case 0xE0: /* pitch bend */
-            fluid_synth_pitch_bend( synth, channel,
-                                    ( data[ 1 ] << 7) | data[ 0 ]);
-            break;
+    dec->ringSize = ringSize;
 
-        case 0xF0:
-            /* ignore SysEx events */
-            break;
+    if( startAsync( dec ) == -1 )
+    {
+        free( dec->ring );
+        dec->ring = NULL;
+        dec->ringSize = 0;
+
+        return -1;
     }
 
-    return decodeDelta( track );
+    return 0;
 }
 
+/* length of a segment of parallel rendering in ms */
+#define MIN_SEGMENT     5000
+#define MAX_SEGMENT     30000
+
+/* segments per job to balance loads */
+#define SEGMENTS_PER_JOB    4
+
 /**
- * Decode OS/2 SysEx event
+ * Open a decoder to render segments of a decoder
  *
- * @param[in] track Pointer to a track
- * @return 0 on success, -1 on error
+ * A segment decoder is a copy of decoder state with its own synthesizer,
+ * sharing MIDI data and seek index read-only.
+ *
+ * @param[in] dec Pointer to a decoder
+ * @return Segment decoder on success, NULL on error
  */
-static int decodeOS2SysExEvent( PKMTRK track )
+static PKMDEC openSegment( PKMDEC dec )
 {
-    PKMEMFD mfd = track->dec->mfd;
-    uint8_t sysex[ 10 - 1 ]; /* F0 was consumed already */
-    int i;
+    PKMDEC seg = malloc( sizeof( *seg ));
+    if( !seg )
+        return NULL;
 
-    /* SysEx event ends with 0xF7 */
-    for( i = 0; i < sizeof( sysex ); i++ )
-    {
-        if( memRead( mfd, sysex + i, 1 ) == -1)
-            return -1;
+    /* stems are mixed by one synthesizer */
+    *seg = *dec;
+    seg->synth = NULL;
+    seg->sf = -1;
+    seg->stemCount = 0;
+    seg->stems = NULL;
+    seg->stemInited = false;
+    seg->stats = false;
+    seg->voices = NULL;
+    seg->convBuf = NULL;
+    seg->convSize = 0;
+    seg->planarBuf = NULL;
+    seg->planarSize = 0;
+    seg->buffer = NULL;
+    seg->bufSize = 0;
+    seg->ring = NULL;
+    seg->asyncRunning = false;
+    seg->asyncInited = false;
+    seg->scanning = false;
+    seg->scanDec = NULL;
+    seg->scanInited = false;
+    seg->loop = false;
+    seg->cache = NULL;
+    seg->cacheCount = 0;
+    seg->cacheBudget = 0;
+    seg->live = NULL;
+    seg->dataFunc = NULL;
+    seg->tempoInited = false;
+    seg->resampler = NULL;
+
+    seg->synth = new_fluid_synth( dec->settings );
+    if( !seg->synth )
+        goto fail;
 
-        track->offset++;
+    /* a sound font is shared with a decoder */
+    if( addSharedLoader( seg->synth ) == -1 )
+        goto fail;
 
-        if( sysex[ i ] == 0xF7 )
-            break;
-    }
+    seg->sf = fluid_synth_sfload( seg->synth, dec->sf2name, 1 );
+    if( seg->sf == -1 )
+        goto fail;
 
-    /* Ignore not supported SysEx event */
-    if( i == sizeof( sysex ))
-    {
-        do
-        {
-            if( memRead( mfd, sysex, 1 ) == -1 )
-                return -1;
+    setInterp( seg, seg->synth );
 
-            track->offset++;
-        } while( sysex[ 0 ] != 0xF7 );
-    }
-    else if( memcmp( sysex, "\x00\x00\x3A", 3 ) == 0 )
-    {
-        uint8_t type = sysex[ 3 ] & 0x7F;
+    for( int ch = 0; ch < 16; ch++ )
+        seg->chSynth[ ch ] = seg->synth;
 
-        if( type == 1 )         /* Timing Compression(Long) */
-        {
-            uint8_t ll = sysex[ 4 ] & 0x7F;
-            uint8_t mm = sysex[ 5 ] & 0x7F;
+    return seg;
 
-            track->nextTick += mm << 7 | ll;
-        }
-        else if( type >= 7 )    /* Timing Compression(Short) */
-            track->nextTick += type;
-        else if( type == 3 )    /* Device Driver Control */
-        {
-            uint8_t cmd = sysex[ 4 ];
+fail:
+    closeSegment( seg );
 
-            if( cmd == 2 )      /* Tempo Control */
-            {
-                uint8_t tl = sysex[ 5 ] & 0x7F;
-                uint8_t tm = sysex[ 6 ] & 0x7F;
+    return NULL;
+}
 
-                track->dec->tempo = 60 * 1000000 / (( tm << 7 | tl ) / 10 );
-            }
-        }
-    }
+/**
+ * Close a segment decoder
+ *
+ * @param[in] seg Segment decoder
+ */
+static void closeSegment( PKMDEC seg )
+{
+    if( !seg )
+        return;
 
-    return 0;
+    free( seg->buffer );
+    free( seg->convBuf );
+    free( seg->planarBuf );
+
+    if( seg->sf != -1 )
+        fluid_synth_sfunload( seg->synth, seg->sf, 1 );
+    delete_fluid_synth( seg->synth );
+
+    free( seg );
 }
 
 /**
- * Decode OS/2 event
+ * Render a segment
  *
- * @param[in] track Pointer to a track
+ * A segment is rendered from the initial state for determinism, regardless
+ * of segments rendered before by the same decoder.
+ *
+ * @param[in] par Pointer to parallel rendering
+ * @param[in] seg Segment decoder
+ * @param[in] i Index of a segment
  * @return 0 on success, -1 on error
  */
-static int decodeOS2Event( PKMTRK track )
+static int renderSegment( PKMPARALLEL par, PKMDEC seg, int i )
 {
-    PKMEMFD mfd = track->dec->mfd;
-    fluid_synth_t *synth = track->dec->synth;
-
-    uint8_t status;
-    uint8_t event;
-    uint8_t channel;
+    PKMSEGMENT segment = par->segments + i;
+    uint64_t start = i * par->segSamples;
+    uint64_t from = start > par->overlap ? start - par->overlap : 0;
+    bool last = i == par->segCount - 1;
+    int size = par->segSamples * par->frameSize;
+
+    segment->buffer = malloc( size );
+    if( !segment->buffer )
+        return -1;
 
-    if( track->offset >= track->length )
-    {
-        track->nextTick = END_OF_TRACK;
+    reset( seg );
+    seedDither( seg, i );
 
+    /* clock from samples may be less than clock a bit */
+    if( seekClock( seg, from * CLOCK_BASE / seg->sampleRate ) == -1 )
         return 0;
-    }
 
-    if( memRead( mfd, &status, 1 ) == -1 )
-        return -1;
-    track->offset++;
-
-    /* implicit status ? */
-    if( status < 0x80 )
+    /* warm up voices and effects, from where seek index restored */
+    while( seg->samplePos < start )
     {
-        status = track->status;
-        if( memSeek( mfd, -1, KMDEC_SEEK_CUR ) == -1 )
-            return -1;
-        track->offset--;
-    }
-
-    if( status < 0x80 )
-        return -1;
+        uint64_t samples = MIN( start - seg->samplePos, par->segSamples );
+        int len = samples * par->frameSize;
 
-    if( status < 0xF0 )
-        track->status = status;
+        if( kmdecDecode( seg, segment->buffer, len ) < len )
+            return 0;
+    }
 
-    event   = status & 0xF0;
-    channel = status & 0x0F;
+    while( 1 )
+    {
+        int len = kmdecDecode( seg, segment->buffer + segment->len,
+                               size - segment->len );
 
-    /* calculate length of event data */
-    int len = 0;
+        segment->len += len;
 
-    /*
-     * status event 0x80, 0x90, 0xA0, 0xB0, 0xE0: len = 2
-     * status event 0xC0, 0xD0: len = 1
-     */
-    switch( event )
-    {
-        case 0x80: case 0x90: case 0xA0: case 0xB0: case 0xE0:
-            len = 2;
+        /* a last segment is rendered up to the end */
+        if( !last || segment->len < size )
             break;
 
-        case 0xC0: case 0xD0:
-            len = 1;
-            break;
+        char *buffer = realloc( segment->buffer, size * 2 );
+        if( !buffer )
+            return -1;
+
+        segment->buffer = buffer;
+        size *= 2;
     }
 
-    uint8_t data[ len ];
+    return 0;
+}
 
-    if( memRead( mfd, data, len ) == -1 )
-        return -1;
-    track->offset += len;
+/**
+ * Thread of parallel rendering
+ *
+ * @param[in] arg Pointer to a worker
+ * @return NULL
+ */
+static void *segmentProc( void *arg )
+{
+    PKMWORKER worker = arg;
+    PKMPARALLEL par = worker->par;
 
-    data[ 0 ] &= 0x7F;
-    data[ 1 ] &= 0x7F;
+    pthread_mutex_lock( &par->mutex );
 
-    /* pass MIDI event to fluidsynth */
-    switch( event )
+    while( 1 )
     {
-        case 0x80:  /* note off */
-            fluid_synth_noteoff( synth, channel, data[ 0 ]);
-            break;
+        /* do not render too far ahead of written segments */
+        while( !par->failed && par->next < par->segCount
+               && par->next >= par->written + par->window )
+            pthread_cond_wait( &par->cond, &par->mutex );
 
-        case 0x90:  /* note on */
-            fluid_synth_noteon( synth, channel, data[ 0 ], data[ 1 ]);
+        if( par->failed || par->next == par->segCount )
             break;
 
-        case 0xA0: /* polyphonic aftertouch */
-            /* not supported */
-            break;
+        int i = par->next++;
 
-        case 0xB0:  /* control mode hnage */
-            fluid_synth_cc( synth, channel, data[ 0 ], data[ 1 ]);
-            break;
+        pthread_mutex_unlock( &par->mutex );
 
-        case 0xC0:  /* program change */
-            fluid_synth_program_change( synth, channel, data[ 0 ]);
-            break;
+        int rc = renderSegment( par, worker->seg, i );
 
-        case 0xD0:  /* channel key pressure */
-            fluid_synth_channel_pressure( synth, channel, data[ 0 ]);
-            break;
+        pthread_mutex_lock( &par->mutex );
 
-        case 0xE0: /* pitch bend */
-            fluid_synth_pitch_bend( synth, channel,
-                                    ( data[ 1 ] << 7) | data[ 0 ]);
-            break;
+        par->segments[ i ].rc = rc;
+        par->segments[ i ].done = true;
 
-        case 0xF0:
-            if( status == 0xF8 )
-                track->nextTick++;
-            else
-                return decodeOS2SysExEvent( track );
-            break;
+        if( rc == -1 )
+            par->failed = true;
+
+        pthread_cond_broadcast( &par->cond );
     }
 
-    return 0;
+    pthread_mutex_unlock( &par->mutex );
+
+    return NULL;
 }
 
 /**
- * Decode MIDI messages
+ * Render MIDI in parallel segments
  *
- * @param[in] track Pointer to a track
- * @param[in] mode Decode mode
- * @return 0 on success, -1 on error or on finished
+ * @param[in] dec Pointer to a deocder
+ * @param[in] jobs A number of segments rendered at once
+ * @param[in] overlap Time to warm up before a segment in ms
+ * @param[in] write Function to write rendered samples
+ * @param[in] arg Argument to @a write
+ * @return 0 on success, -1 on error
  */
-static int decode( PKMDEC dec, int mode )
+int kmdecRenderParallel( PKMDEC dec, int jobs, int overlap,
+                         KMDECWRITEFUNC write, void *arg )
 {
-    uint32_t nextTick = END_OF_TRACK;
+    if( !dec || jobs < 1 || overlap < 0 || !write
+        || dec->timing != KMDEC_TIMING_SAMPLE || dec->resampler )
+        return -1;
 
-    /* update next tick of a track if already decoded */
-    for( int i = 0; i < dec->header.tracks; i++ )
+    /* split by duration, and use seek index */
+    finishScan( dec, true );
+
+    if( __atomic_load_n( &dec->streaming, __ATOMIC_ACQUIRE ))
+        return -1;
+
+    KMPARALLEL par = { .segments = NULL };
+    PKMWORKER workers = NULL;
+    int created = 0;
+    int rc = -1;
+
+    uint64_t total = dec->duration * dec->sampleRate / CLOCK_BASE;
+    uint64_t minSamples = ( uint64_t )MIN_SEGMENT * dec->sampleRate / 1000;
+    uint64_t maxSamples = ( uint64_t )MAX_SEGMENT * dec->sampleRate / 1000;
+
+    par.segSamples = total / (( uint64_t )jobs * SEGMENTS_PER_JOB );
+    par.segSamples = MAX( MIN( par.segSamples, maxSamples ), minSamples );
+    par.segCount = total / par.segSamples + 1;
+    par.overlap = ( uint64_t )overlap * dec->sampleRate / 1000;
+
+    par.frameSize = outSampleSize( dec );
+
+    if( jobs > par.segCount )
+        jobs = par.segCount;
+
+    par.window = jobs * 2;
+
+    par.segments = calloc( par.segCount, sizeof( *par.segments ));
+    workers = calloc( jobs, sizeof( *workers ));
+    if( !par.segments || !workers )
+        goto exit_free;
+
+    if( pthread_mutex_init( &par.mutex, NULL ))
+        goto exit_free;
+
+    if( pthread_cond_init( &par.cond, NULL ))
+        goto exit_mutex_destroy;
+
+    /* synthesizers are created here, not by threads */
+    for( created = 0; created < jobs; created++ )
     {
-        PKMTRK track = dec->tracks + i;
+        PKMWORKER worker = workers + created;
+
+        worker->par = &par;
+        worker->seg = openSegment( dec );
+        if( !worker->seg )
+            break;
 
-        if( track->nextTick <= dec->tick )
+        if( pthread_create( &worker->thread, NULL, segmentProc, worker ))
         {
-            if( track->dec->header.format == OS2MIDI )
-            {
-                if( decodeOS2Event( track ) == -1 )
-                    return -1;
-            }
-            else if( decodeEvent( track ) == -1 )
-                return -1;
-        }
+            closeSegment( worker->seg );
 
-        if( nextTick > track->nextTick )
-            nextTick = track->nextTick;
+            break;
+        }
     }
 
-    /* finished ? */
-    if( nextTick == END_OF_TRACK )
-        return -1;
+    if( created == 0 )
+        goto exit_cond_destroy;
 
-    /* generate samples if new message was decoded every MIDI clock */
-    if( nextTick > dec->tick )
+    /* write segments in order */
+    for( int i = 0; i < par.segCount; i++ )
     {
-        int ticksPerSec = dec->header.division * CLOCK_BASE / dec->tempo;
-        int delta = ticksPerSec * dec->clockUnit / CLOCK_BASE;
+        PKMSEGMENT segment = par.segments + i;
 
-        /*
-         * delta should be 1 at least. Otherwise tick does not progress
-         * any more until tempo is changed to set delta to a value bigger
-         * than 0.
-         */
-        if( delta == 0 )
-            delta = 1;
+        pthread_mutex_lock( &par.mutex );
+        while( !segment->done && !par.failed )
+            pthread_cond_wait( &par.cond, &par.mutex );
+        pthread_mutex_unlock( &par.mutex );
 
-        if( dec->tick + delta > nextTick )
-            delta = nextTick - dec->tick;
-
-        if( mode == DECODE_PLAY )
-        {
-            int samples = delta * dec->sampleRate / ticksPerSec;
-            int len = samples * dec->sampleSize;
+        if( !segment->done || segment->rc == -1 )
+            break;
 
-            free( dec->buffer );
-            dec->buffer = malloc( len );
-            if( !dec->buffer )
-                return -1;
+        int written = write( arg, segment->buffer, segment->len );
 
-            dec->synth_write( dec->synth, samples,
-                              dec->buffer, 0, 2, dec->buffer, 1, 2 );
+        free( segment->buffer );
+        segment->buffer = NULL;
 
-            dec->bufLen = len;
-            dec->bufPos = 0;
-        }
+        pthread_mutex_lock( &par.mutex );
+        par.written++;
+        if( written == -1 )
+            par.failed = true;
+        pthread_cond_broadcast( &par.cond );
+        pthread_mutex_unlock( &par.mutex );
 
-        /* accumulate ticks */
-        dec->tick += delta;
+        if( written == -1 )
+            break;
 
-        /* accumulate clocks */
-        dec->clock += CLOCK_BASE * delta / ticksPerSec;
+        if( i == par.segCount - 1 )
+            rc = 0;
     }
 
-    return 0;
-}
+    /* stop workers on error */
+    pthread_mutex_lock( &par.mutex );
+    if( rc == -1 )
+        par.failed = true;
+    pthread_cond_broadcast( &par.cond );
+    pthread_mutex_unlock( &par.mutex );
 
-static int defaultOpen( const char *name )
-{
-    return open( name, O_RDONLY | O_BINARY );
-}
+    while( created > 0 )
+    {
+        PKMWORKER worker = workers + --created;
 
-static int defaultRead( int fd, void *buf, size_t n )
-{
-    return read( fd, buf, n );
-}
+        pthread_join( worker->thread, NULL );
+        closeSegment( worker->seg );
+    }
 
-static int defaultSeek( int fd, long offset, int origin )
-{
-    static int origins[] = { SEEK_SET, SEEK_CUR, SEEK_END };
+exit_cond_destroy:
+    pthread_cond_destroy( &par.cond );
 
-    if( origin >= sizeof( origins ) / sizeof( origins[ 0 ]))
-    {
-        errno = EINVAL;
-        return -1;
-    }
+exit_mutex_destroy:
+    pthread_mutex_destroy( &par.mutex );
 
-    return lseek( fd, offset, origins[ origin ]);
-}
+exit_free:
+    for( int i = 0; par.segments && i < par.segCount; i++ )
+        free( par.segments[ i ].buffer );
 
-static int defaultTell( int fd )
-{
-    return tell( fd );
-}
+    free( par.segments );
+    free( workers );
 
-static int defaultClose( int fd )
-{
-    return close( fd );
+    return rc;
 }
 
 /**
- * Open decoder
+ * Take events sent into a queue of live events
  *
- * @param[in] fd File descriptor of a midi file
- * @param[in] sf2name Sound font file to open
- * @param[in] pkai Pointer to audio information
- * @param[in] closeFd Flag to indicate to close fd
- * @param[in] io IO functions to use
- * @return Decoder on success, NULL on error
+ * Events are positioned from the current sample position.
+ *
+ * @param[in] dec Pointer to a decoder
  */
-static
-PKMDEC openEx( int fd, const char *sf2name, PKMDECAUDIOINFO pkai,
-               bool closeFd, PKMDECIOFUNCS io)
-{
-    static KMDECIOFUNCS defaultIO = {
-        .open = defaultOpen,
-        .read = defaultRead,
-        .seek = defaultSeek,
-        .tell = defaultTell,
-        .close = defaultClose,
-    };
-
-    PKMDEC dec;
-
-    if( !io )
-        io = &defaultIO;
+static void takeLiveEvents( PKMDEC dec )
+{
+    PKMLIVE live = dec->live;
 
-    dec = calloc( 1, sizeof( *dec ));
-    if( !dec )
-        return NULL;
+    pthread_mutex_lock( &live->mutex );
 
-    /* init `sf' first in order to call kmdecClose() on failure */
-    dec->sf = -1;
+    int n = MIN( live->queueCount, MAX_LIVE_EVENTS - live->pendingCount );
 
-    dec->fd = fd;
-    dec->closeFd = closeFd;
+    for( int i = 0; i < n; i++ )
+    {
+        KMLIVEEVENT ev = live->queue[ i ];
+        int j;
 
-    dec->io = io;
+        ev.pos = dec->samplePos + ev.offset;
 
-    dec->mfd = memOpen( fd, io );
-    if( !dec->mfd )
-        goto fail;
+        /* keep an order of events at the same position */
+        for( j = live->pendingCount; j > 0; j-- )
+        {
+            if( live->pending[ j - 1 ].pos <= ev.pos )
+                break;
 
-    if( initMidiInfo( dec ) == -1 )
-        goto fail;
+            live->pending[ j ] = live->pending[ j - 1 ];
+        }
 
-    dec->settings = new_fluid_settings();
-    if( !dec->settings )
-        goto fail;
+        live->pending[ j ] = ev;
+        live->pendingCount++;
+    }
 
-    dec->synth = new_fluid_synth( dec->settings );
-    if( !dec->synth )
-        goto fail;
+    int left = live->queueCount - n;
 
-    dec->sf = fluid_synth_sfload( dec->synth, sf2name, 1 );
-    if( dec->sf == -1 )
-        goto fail;
+    memmove( live->queue, live->queue + n, left * sizeof( *live->queue ));
 
-    char *sampleFormat;
-    if( pkai->bps == KMDEC_BPS_S16 )
-    {
-        sampleFormat = "16bits";
-        dec->synth_write = fluid_synth_write_s16;
-    }
-    else if( pkai->bps == KMDEC_BPS_FLOAT )
-    {
-        sampleFormat = "float";
-        dec->synth_write = fluid_synth_write_float;
-    }
-    else
-        goto fail;
+    /* seen by a rendering thread without locking */
+    __atomic_store_n( &live->queueCount, left, __ATOMIC_RELAXED );
 
-    if( !fluid_settings_setstr( dec->settings, "audio.sample-format",
-                                               sampleFormat )
-        || !fluid_settings_setint( dec->settings, "synth.audio-channels",
-                                   pkai->channels >> 1 )
-        || !fluid_settings_setnum( dec->settings, "synth.sample-rate",
-                                   pkai->sampleRate))
-        goto fail;
+    pthread_mutex_unlock( &live->mutex );
+}
 
-    /* get clock unit from fluidsynth in ms */
-    if( !fluid_settings_getint( dec->settings, "synth.min-note-length",
-                                &dec->clockUnit ))
-        dec->clockUnit = 10;
-    dec->clockUnit *= CLOCK_BASE / 1000;    /* ms to us */
+/**
+ * Play live events due at the current position
+ *
+ * With KMDEC_TIMING_CLOCK, all the events are due.
+ *
+ * @param[in] dec Pointer to a decoder
+ * @return Sample position of a next live event, UINT64_MAX if none
+ */
+static uint64_t playLiveEvents( PKMDEC dec )
+{
+    PKMLIVE live = dec->live;
 
-    dec->sampleRate = pkai->sampleRate;
-    dec->sampleSize = pkai->channels * ( pkai->bps >> 3 );
+    if( !live )
+        return UINT64_MAX;
 
-    dec->tempo = DEFAULT_TEMPO;
-    dec->numerator = DEFAULT_NUMERATOR;
-    dec->denominator = DEFAULT_DENOMINATOR;
+    if( __atomic_load_n( &live->queueCount, __ATOMIC_RELAXED ) > 0 )
+        takeLiveEvents( dec );
 
-    /* calculate total samples */
-    while( decode( dec, DECODE_SEEK ) != -1 )
-        /* nothing */;
+    bool sample = dec->timing == KMDEC_TIMING_SAMPLE;
+    int n;
 
-    dec->duration = dec->clock;
+    for( n = 0; n < live->pendingCount; n++ )
+    {
+        PKMLIVEEVENT pending = live->pending + n;
 
-    /* reset decoder to intial status */
-    if( reset( dec ) == -1 )
-        goto fail;
+        if( sample && pending->pos > dec->samplePos )
+            break;
 
-    return dec;
+        KMEVENT ev = {
+            .tick = dec->tick,
+            .status = pending->status,
+            .data = { pending->data[ 0 ], pending->data[ 1 ]},
+        };
 
-fail:
-    kmdecClose( dec );
+        playEvent( dec, &ev, DECODE_PLAY );
+    }
 
-    return NULL;
+    live->pendingCount -= n;
+    memmove( live->pending, live->pending + n,
+             live->pendingCount * sizeof( *live->pending ));
+
+    return live->pendingCount > 0 ? live->pending[ 0 ].pos : UINT64_MAX;
 }
 
 /**
- * Open decoder with a file name
+ * Send a live event to be played with MIDI
  *
- * @param[in] name File name to open
- * @param[in] sf2name Sound font file to open
- * @param[in] pkai Pointer to audio information
- * @return Decoder on success, NULL on error
+ * @param[in] dec Pointer to a deocder
+ * @param[in] offset Samples from the start of a next block to play at
+ * @param[in] status Status byte of a channel event
+ * @param[in] data0 First data byte
+ * @param[in] data1 Second data byte
+ * @return 0 on success, -1 on error
  */
-PKMDEC kmdecOpen( const char *name, const char *sf2name, PKMDECAUDIOINFO pkai )
+int kmdecSendEvent( PKMDEC dec, int offset, int status, int data0,
+                    int data1 )
 {
-    return kmdecOpenEx( name, sf2name, pkai, NULL );
+    if( !dec || !dec->live || offset < 0 || status < 0x80 || status > 0xEF
+        || data0 < 0 || data0 > 0x7F || data1 < 0 || data1 > 0x7F )
+        return -1;
+
+    PKMLIVE live = dec->live;
+    int rc = -1;
+
+    /* an offset is in samples of a synthesizer */
+    if( dec->resampler )
+        offset = ( uint64_t )offset * dec->resampler->down
+                 / dec->resampler->up;
+
+    pthread_mutex_lock( &live->mutex );
+
+    if( live->queueCount < MAX_LIVE_EVENTS )
+    {
+        PKMLIVEEVENT ev = live->queue + live->queueCount;
+
+        ev->offset = offset;
+        ev->status = status;
+        ev->data[ 0 ] = data0;
+        ev->data[ 1 ] = data1;
+
+        /* seen by a rendering thread without locking */
+        __atomic_store_n( &live->queueCount, live->queueCount + 1,
+                          __ATOMIC_RELAXED );
+
+        rc = 0;
+    }
+
+    pthread_mutex_unlock( &live->mutex );
+
+    return rc;
 }
 
 /**
- * Open decoder with a file name
+ * Convert a tick to time
  *
- * @param[in] name File name to open
- * @param[in] sf2name Sound font file to open
- * @param[in] pkai Pointer to audio information
- * @param[in] io Pointer to IO functions. If NULL, file IOs is used
- * @return Decoder on success, NULL on error
+ * @param[in] dec Pointer to a deocder
+ * @param[in] tick Tick
+ * @return Time of @a tick in milli-seconds, -1 on error
  */
-PKMDEC kmdecOpenEx( const char *name, const char *sf2name,
-                    PKMDECAUDIOINFO pkai, PKMDECIOFUNCS io )
+int kmdecTickToMs( PKMDEC dec, int tick )
 {
-    int fd;
+    if( !dec || tick < 0 )
+        return -1;
 
-    if( io )
-        fd = io->open( name );
-    else
-        fd = defaultOpen( name );
+    int64_t ms = -1;
 
-    if( fd == -1)
-        return NULL;
+    lockTempo( dec );
+
+    if( dec->tempoCount > 0 )
+    {
+        uint64_t num = mapTime( findTempo( dec, tick, false ), tick );
+
+        ms = num / (( uint64_t )dec->header.division * 1000 );
+    }
+
+    unlockTempo( dec );
 
-    return openEx( fd, sf2name, pkai, true, io );
+    return MIN( ms, INT_MAX );
 }
 
 /**
- * Open decoder with a file descriptor
+ * Find a tick at time with tempo map
  *
- * @param[in] fd File descriptor of a midi file
- * @param[in] sf2name Sound font file to open
- * @param[in] pkai Pointer to audio information
- * @return Decoder on success, NULL on error
+ * @param[in] dec Pointer to a deocder, whose tempo map is locked
+ * @param[in] ms Time in milli-seconds
+ * @param[out] tick Tick at @a ms
+ * @return Pointer to an entry in effect on success, NULL on error
  */
-PKMDEC kmdecOpenFd( int fd, const char *sf2name, PKMDECAUDIOINFO pkai )
+static PKMTEMPO findTick( PKMDEC dec, int ms, uint32_t *tick )
 {
-    return kmdecOpenFdEx( fd, sf2name, pkai, NULL );
+    if( dec->tempoCount == 0 )
+        return NULL;
+
+    uint64_t num = ( uint64_t )ms * 1000 * dec->header.division;
+    PKMTEMPO entry = findTempo( dec, num, true );
+    uint64_t ticks = ( num - entry->timeNum ) / MAX( entry->tempo, 1 );
+
+    *tick = entry->tick + MIN( ticks, INT_MAX - entry->tick );
+
+    return entry;
 }
 
 /**
- * Open decoder with a file descriptor
+ * Convert time to a tick
  *
- * @param[in] fd File descriptor of a midi file
- * @param[in] sf2name Sound font file to open
- * @param[in] pkai Pointer to audio information
- * @param[in] io Pointer to IO functions. If NULL, file IOs is used
- * @return Decoder on success, NULL on error
+ * @param[in] dec Pointer to a deocder
+ * @param[in] ms Time in milli-seconds
+ * @return Tick at @a ms, -1 on error
  */
-PKMDEC kmdecOpenFdEx( int fd, const char *sf2name,
-                    PKMDECAUDIOINFO pkai, PKMDECIOFUNCS io )
+int kmdecMsToTick( PKMDEC dec, int ms )
 {
-    return openEx( fd, sf2name, pkai, false, io );
+    if( !dec || ms < 0 )
+        return -1;
+
+    uint32_t tick;
+    int rc;
+
+    lockTempo( dec );
+
+    rc = findTick( dec, ms, &tick ) ? ( int )tick : -1;
+
+    unlockTempo( dec );
+
+    return rc;
 }
 
 /**
- * Close decoder
+ * Get a musical position at time
  *
  * @param[in] dec Pointer to a deocder
+ * @param[in] ms Time in milli-seconds
+ * @param[out] beat Pointer to a musical position
  * @return 0 on success, -1 on error
  */
-void kmdecClose( PKMDEC dec )
+int kmdecGetBeat( PKMDEC dec, int ms, PKMDECBEAT beat )
 {
-    if( !dec )
-        return;
-
-    free( dec->buffer );
+    if( !dec || ms < 0 || !beat )
+        return -1;
 
-    if( dec->sf != -1 )
-        fluid_synth_sfunload( dec->synth, dec->sf, 1 );
-    delete_fluid_synth( dec->synth );
-    delete_fluid_settings( dec->settings );
+    uint32_t tick;
+    int rc = -1;
 
-    free( dec->tracks );
+    lockTempo( dec );
 
-    memClose( dec->mfd );
+    PKMTEMPO entry = findTick( dec, ms, &tick );
+    if( entry )
+    {
+        /* count from where time signature is set */
+        uint32_t ticks = tick - entry->sigTick;
+        uint32_t beatTicks = BEAT_TICKS( dec, entry );
+        uint32_t barTicks = BAR_TICKS( dec, entry );
+
+        beat->bar = entry->sigBar + ticks / barTicks;
+        beat->beat = ticks % barTicks / beatTicks;
+        beat->tick = ticks % beatTicks;
+        beat->numerator = entry->numerator;
+        beat->denominator = entry->denominator;
+        beat->tempo = entry->tempo;
+
+        rc = 0;
+    }
 
-    if( dec->closeFd )
-        dec->io->close( dec->fd );
+    unlockTempo( dec );
 
-    free( dec );
+    return rc;
 }
 
 /**
- * Fill the given buffer with decoded MIDI messages
+ * Get tempo at time
  *
  * @param[in] dec Pointer to a deocder
- * @param[out] buffer where to store the decoded messages
- * @param[in] size Size of buffer in bytes
- * @return Size filled in buffer in bytes
+ * @param[in] ms Time in milli-seconds
+ * @return Tempo in us per quarter note, -1 on error
  */
-int kmdecDecode( PKMDEC dec, void *buffer, int size )
+int kmdecGetTempo( PKMDEC dec, int ms )
 {
-    if( !dec )
-        return 0;
+    KMDECBEAT beat;
 
-    int total = 0;
+    if( kmdecGetBeat( dec, ms, &beat ) == -1 )
+        return -1;
 
-    while( size > 0 )
-    {
-        if( dec->bufLen == 0 && decode( dec, DECODE_PLAY ) == -1 )
-            break;
+    return beat.tempo;
+}
 
-        int len = MIN( size, dec->bufLen );
-        memcpy( buffer, dec->buffer + dec->bufPos, len );
+/**
+ * Pool of decoders
+ */
+typedef struct kmdecpool
+{
+    PKMDEC *decs;           /**< decoders, idle ones first */
+    int count;              /**< a number of decoders */
+    int idleCount;          /**< a number of decoders not checked out */
+    pthread_mutex_t mutex;  /**< mutex for checking out */
+    pthread_cond_t cond;    /**< cond for waiting for a decoder */
+} KMDECPOOL;
+
+/* MIDI with no events loaded into an idle decoder */
+static const uint8_t emptyMidi[] =
+{
+    'M', 'T', 'h', 'd', 0, 0, 0, 6, 0, 0, 0, 1, 0, 96,
+    'M', 'T', 'r', 'k', 0, 0, 0, 4, 0, 0xFF, 0x2F, 0
+};
 
-        buffer = ( char * )buffer + len;
-        size -= len;
+/**
+ * Create a pool of decoders
+ *
+ * @param[in] count A number of decoders
+ * @param[in] sf2name Sound font file to open
+ * @param[in] pkai Pointer to audio information
+ * @param[in] opts Pointer to options. If NULL, defaults are used
+ * @return Pool on success, NULL on error
+ */
+PKMDECPOOL kmdecPoolCreate( int count, const char *sf2name,
+                            PKMDECAUDIOINFO pkai, PKMDECOPTIONS opts )
+{
+    PKMDECPOOL pool;
 
-        dec->bufPos += len;
-        dec->bufLen -= len;
+    if( count <= 0 )
+        return NULL;
 
-        total += len;
+    pool = calloc( 1, sizeof( *pool ));
+    if( !pool )
+        return NULL;
+
+    pool->decs = calloc( count, sizeof( *pool->decs ));
+    if( !pool->decs )
+        goto fail_free;
+
+    if( pthread_mutex_init( &pool->mutex, NULL ))
+        goto fail_free;
+
+    if( pthread_cond_init( &pool->cond, NULL ))
+        goto fail_mutex;
+
+    /* a sound font is loaded once, and shared by decoders */
+    for( ; pool->count < count; pool->count++ )
+    {
+        PKMDEC dec = kmdecOpenMem( emptyMidi, sizeof( emptyMidi ), sf2name,
+                                   pkai, opts );
+        if( !dec )
+            goto fail_close;
+
+        dec->recycle = true;
+
+        pool->decs[ pool->count ] = dec;
     }
 
-    return total;
+    pool->idleCount = pool->count;
+
+    return pool;
+
+fail_close:
+    while( pool->count > 0 )
+        kmdecClose( pool->decs[ --pool->count ]);
+
+    pthread_cond_destroy( &pool->cond );
+
+fail_mutex:
+    pthread_mutex_destroy( &pool->mutex );
+
+fail_free:
+    free( pool->decs );
+    free( pool );
+
+    return NULL;
 }
 
 /**
- * Get duration of MIDI file in milli-seconds
+ * Destroy a pool of decoders
  *
- * @param[in] dec Pointer to a deocder
- * @return Length of MIDI in milli-seconds
+ * @param[in] pool Pointer to a pool
  */
-int kmdecGetDuration( PKMDEC dec )
+void kmdecPoolDestroy( PKMDECPOOL pool )
 {
-    if( !dec )
-        return -1;
+    if( !pool )
+        return;
 
-    return 1000 * dec->duration / CLOCK_BASE;
+    for( int i = 0; i < pool->count; i++ )
+        kmdecClose( pool->decs[ i ]);
+
+    pthread_cond_destroy( &pool->cond );
+    pthread_mutex_destroy( &pool->mutex );
+
+    free( pool->decs );
+    free( pool );
 }
 
 /**
- * Get current position of decoder in milli-seconds
+ * Check out a decoder from a pool, and load a MIDI file into it
  *
- * @param[in] dec Pointer to a deocder
- * @return Current position of decoder in milli-seconds
+ * @param[in] pool Pointer to a pool
+ * @param[in] name File name to open
+ * @param[in] io Pointer to IO functions. If NULL, file IOs is used
+ * @param[in] wait Flag to wait for a decoder if all are checked out
+ * @return Decoder on success, NULL on error or if none is idle
  */
-int kmdecGetPosition( PKMDEC dec )
+PKMDEC kmdecPoolGet( PKMDECPOOL pool, const char *name, PKMDECIOFUNCS io,
+                     int wait )
 {
-    if( !dec )
-        return -1;
+    PKMDEC dec = NULL;
+
+    if( !pool || !name )
+        return NULL;
+
+    pthread_mutex_lock( &pool->mutex );
+
+    while( wait && pool->idleCount == 0 )
+        pthread_cond_wait( &pool->cond, &pool->mutex );
+
+    if( pool->idleCount > 0 )
+        dec = pool->decs[ --pool->idleCount ];
+
+    pthread_mutex_unlock( &pool->mutex );
+
+    /* load out of a lock, other decoders can be checked out meanwhile */
+    if( dec && kmdecLoad( dec, name, io ) == -1 )
+    {
+        kmdecPoolPut( pool, dec );
+
+        dec = NULL;
+    }
 
-    return 1000 * dec->clock / CLOCK_BASE;
+    return dec;
 }
 
 /**
- * Seek to the given position
+ * Return a decoder checked out by kmdecPoolGet() to a pool
  *
- * @param[in] dec Pointer to a deocder
- * @param[in] offset Offset in ms
- * @param[in] origin Origin of seek
+ * @param[in] pool Pointer to a pool
+ * @param[in] dec Pointer to a decoder
  * @return 0 on success, -1 on error
  */
-int kmdecSeek( PKMDEC dec, int offset, int origin )
+int kmdecPoolPut( PKMDECPOOL pool, PKMDEC dec )
 {
-    if( !dec )
+    int i;
+
+    if( !pool || !dec )
         return -1;
 
-    uint64_t clock, originClock;
+    pthread_mutex_lock( &pool->mutex );
 
-    switch( origin )
+    for( i = pool->idleCount; i < pool->count; i++ )
     {
-        case KMDEC_SEEK_SET:
-            originClock = 0;
+        if( pool->decs[ i ] == dec )
             break;
+    }
 
-        case KMDEC_SEEK_CUR:
-            originClock = dec->clock;
-            break;
+    pthread_mutex_unlock( &pool->mutex );
 
-        case KMDEC_SEEK_END:
-            originClock = dec->duration;
-            break;
+    /* not checked out from this pool */
+    if( i == pool->count )
+        return -1;
 
-        default:
-            return -1;
-    }
+    uint64_t clock = currentClock( dec );
 
-    clock = originClock + CLOCK_BASE * offset / 1000;
-    /* wrapped around ? */
-    if( offset < 0 && clock > originClock )
-        clock = 0;
-    else if( clock > dec->duration )
-        clock = dec->duration;
+    stopAsync( dec );
 
-    if( clock < dec->clock )
-        reset( dec );
+    /* close a MIDI file, and keep its buffers to reuse */
+    loadMidi( dec, newMidi( memOpenBuffer( emptyMidi, sizeof( emptyMidi )),
+                            -1, false, &defaultIO, &dec->filter, NULL ),
+              clock );
+
+    /* live events are for the MIDI returned */
+    pthread_mutex_lock( &dec->live->mutex );
+    dec->live->queueCount = 0;
+    pthread_mutex_unlock( &dec->live->mutex );
 
-    while( dec->clock < clock && decode( dec, DECODE_SEEK ) != -1 )
+    pthread_mutex_lock( &pool->mutex );
+
+    /* a decoder may have been moved by other returns */
+    for( i = pool->idleCount; pool->decs[ i ] != dec; i++ )
         /* nothing */;
 
-    if( dec->clock >= clock )
-        return 0;
+    pool->decs[ i ] = pool->decs[ pool->idleCount ];
+    pool->decs[ pool->idleCount++ ] = dec;
 
-    return -1;
-}
+    pthread_cond_signal( &pool->cond );
+
+    pthread_mutex_unlock( &pool->mutex );
 
+    return 0;
+}
@@ -25,6 +25,8 @@
 #ifndef KMIDIDEC_H
 #define KMIDIDEC_H
 
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -38,6 +40,10 @@ extern "C" {
  */
 #define KMDEC_BPS_S16   16
 #define KMDEC_BPS_FLOAT 32
+#define KMDEC_BPS_S32   ( 0x100 | 32 )  /**< converted from float */
+
+/** bits per sample of KMDEC_BPS_* */
+#define KMDEC_BPS_BITS( bps )   (( bps ) & 0xFF )
 /** @} */
 
 /**
@@ -49,16 +55,231 @@ extern "C" {
 #define KMDEC_SEEK_END  2   /**< from the end */
 /** @} */
 
+/**
+ * @defgroup kmdecformats MIDI formats
+ * {
+ */
+#define KMDEC_FORMAT_SMF0       0       /**< SMF format 0 */
+#define KMDEC_FORMAT_SMF1       1       /**< SMF format 1 */
+#define KMDEC_FORMAT_OS2MIDI    0xFFFF  /**< OS/2 real-time MIDI data */
+/** @} */
+
+/**
+ * @defgroup kmdectimings Timing modes
+ * {
+ */
+#define KMDEC_TIMING_CLOCK  0   /**< render in chunks of MIDI clock unit */
+#define KMDEC_TIMING_SAMPLE 1   /**< render up to exact sample of events */
+/** @} */
+
+/**
+ * @defgroup kmdecpresets Performance presets
+ * {
+ */
+#define KMDEC_PRESET_DEFAULT    0   /**< defaults of fluidsynth */
+#define KMDEC_PRESET_PREVIEW    1   /**< low polyphony, no effects and
+                                         linear interpolation */
+#define KMDEC_PRESET_REALTIME   2   /**< moderate polyphony, effects and
+                                         4th order interpolation */
+#define KMDEC_PRESET_OFFLINE_HQ 3   /**< high polyphony, effects and
+                                         7th order interpolation */
+/** @} */
+
+/**
+ * @defgroup kmdeceffects Switches of effects
+ * {
+ */
+#define KMDEC_EFFECT_DEFAULT    0   /**< by a preset */
+#define KMDEC_EFFECT_ON         1   /**< on */
+#define KMDEC_EFFECT_OFF        2   /**< off */
+/** @} */
+
+/**
+ * @defgroup kmdecinterps Interpolation methods
+ * {
+ */
+#define KMDEC_INTERP_DEFAULT    0   /**< by a preset */
+#define KMDEC_INTERP_NONE       1   /**< no interpolation */
+#define KMDEC_INTERP_LINEAR     2   /**< linear interpolation */
+#define KMDEC_INTERP_4THORDER   4   /**< 4th order interpolation */
+#define KMDEC_INTERP_7THORDER   7   /**< 7th order interpolation */
+/** @} */
+
+/**
+ * @defgroup kmdecdithers Conversion to s16
+ * {
+ */
+#define KMDEC_DITHER_DEFAULT    0   /**< converted by fluidsynth */
+#define KMDEC_DITHER_NONE       1   /**< rendered in float, and converted
+                                         by kmididec without dither */
+#define KMDEC_DITHER_TPDF       2   /**< rendered in float, and converted
+                                         by kmididec with TPDF dither */
+/** @} */
+
+/**
+ * @defgroup kmdecevents Event types of statistics
+ * {
+ */
+#define KMDEC_EVENT_NOTEOFF         0   /**< note off */
+#define KMDEC_EVENT_NOTEON          1   /**< note on */
+#define KMDEC_EVENT_KEYPRESSURE     2   /**< polyphonic key pressure */
+#define KMDEC_EVENT_CONTROL         3   /**< control change */
+#define KMDEC_EVENT_PROGRAM         4   /**< program change */
+#define KMDEC_EVENT_CHPRESSURE      5   /**< channel pressure */
+#define KMDEC_EVENT_PITCHBEND       6   /**< pitch bend */
+#define KMDEC_EVENT_SYSEX           7   /**< system exclusive */
+#define KMDEC_EVENT_META            8   /**< meta event */
+#define KMDEC_EVENT_TYPES           9   /**< a number of event types */
+/** @} */
+
 /**
  * Audio information
  */
 typedef struct kmdecaudioinfo
 {
-    int bps;        /**< bits per sample */
+    int bps;        /**< bits per sample, KMDEC_BPS_* */
     int channels;   /**< a number of channels */
     int sampleRate; /**< samples per second */
 } KMDECAUDIOINFO, *PKMDECAUDIOINFO;
 
+/**
+ * Function to filter channel events
+ *
+ * @param[in] arg Argument of a filter
+ * @param[in] track Index of a track
+ * @param[in] status Status byte
+ * @param[in] data0 First data byte
+ * @param[in] data1 Second data byte, 0 if none
+ * @return Non-zero to keep an event, 0 to ignore it
+ */
+typedef int ( *KMDECFILTERFUNC )( void *arg, int track, int status,
+                                  int data0, int data1 );
+
+/**
+ * Filter of events
+ *
+ * Channel events are filtered when MIDI is loaded, so ignored ones are not
+ * played at all. Meta and SysEx events are always kept for timing.
+ */
+typedef struct kmdecfilter
+{
+    unsigned muteChannels;  /**< bit mask of 16 channels to ignore */
+    uint64_t muteTracks;    /**< bit mask of the first 64 tracks to ignore */
+    KMDECFILTERFUNC func;   /**< function to filter events, NULL for none */
+    void *arg;              /**< argument to @a func */
+} KMDECFILTER, *PKMDECFILTER;
+
+/**
+ * Function to receive meta and SysEx events played
+ *
+ * @a data points to MIDI data without a copy, so it is valid only while
+ * the function is called.
+ *
+ * @param[in] arg Argument given with options
+ * @param[in] status 0xFF for meta events, 0xF0 or 0xF7 for SysEx events
+ * @param[in] type Type of a meta event, 0 for SysEx events
+ * @param[in] data Data of an event, without F0 for SysEx events
+ * @param[in] len Length of @a data in bytes
+ */
+typedef void ( *KMDECDATAFUNC )( void *arg, int status, int type,
+                                 const void *data, int len );
+
+/**
+ * Musical position
+ */
+typedef struct kmdecbeat
+{
+    int bar;            /**< bar from 0 */
+    int beat;           /**< beat in a bar from 0 */
+    int tick;           /**< tick in a beat from 0 */
+    int numerator;      /**< beats per bar */
+    int denominator;    /**< note value of a beat */
+    int tempo;          /**< tempo in us per quarter note */
+} KMDECBEAT, *PKMDECBEAT;
+
+/**
+ * Decoder options
+ */
+typedef struct kmdecoptions
+{
+    int seekInterval;   /**< interval of seek index in ms, 0 to disable */
+    int timing;         /**< timing mode, KMDEC_TIMING_* */
+    int stems;          /**< a number of stems from 1 to 16, 0 to disable,
+                             others fail kmdecOpenEx() */
+    const unsigned char *stemMap;   /**< stem of each of 16 channels,
+                                         NULL for channel % stems */
+    int preset;         /**< performance preset, KMDEC_PRESET_* */
+    int cpuCores;       /**< CPU cores for fluidsynth, 0 for default */
+    int polyphony;      /**< maximum voices, 0 for a preset */
+    int reverb;         /**< reverb, KMDEC_EFFECT_* */
+    int chorus;         /**< chorus, KMDEC_EFFECT_* */
+    int interpolation;  /**< interpolation, KMDEC_INTERP_* */
+    int dither;         /**< conversion to s16, KMDEC_DITHER_*. s32 is
+                             converted by kmididec without dither */
+    int stats;          /**< non-zero to collect statistics of rendering */
+    int deferDuration;  /**< non-zero to calculate duration and seek index
+                             in background */
+    int loop;           /**< non-zero to loop between loop points of CC111
+                             or markers of loopStart and loopEnd, or over
+                             whole MIDI without them */
+    int cacheSize;      /**< memory budget of render cache in bytes to play
+                             rendered samples again, 0 to disable */
+    PKMDECFILTER filter;    /**< filter of events, NULL for none. Kept for
+                                 kmdecLoad() */
+    int stream;         /**< non-zero to decode a file while reading it
+                             through IO functions, which may be called by
+                             an asynchronous thread. Tracks of format 1
+                             are read at their positions on demand if
+                             seek works, otherwise all but the last track
+                             are read first. Duration is unknown
+                             until the end is decoded. Kept for
+                             kmdecLoad(). Not used by kmdecOpenMem() and
+                             kmdecOpenMap() */
+    KMDECDATAFUNC dataFunc; /**< function called with meta and SysEx
+                                 events when played, NULL for none. Called
+                                 by an asynchronous thread ahead of samples
+                                 with kmdecSetAsync() */
+    void *dataArg;          /**< argument to @a dataFunc */
+    int renderRate;     /**< sample rate of a synthesizer, 0 for a sample
+                             rate of audio information. If different,
+                             samples are resampled to the latter. Not
+                             supported with stems and
+                             kmdecRenderParallel() */
+} KMDECOPTIONS, *PKMDECOPTIONS;
+
+/**
+ * Statistics of a decoder
+ *
+ * Events and parsing time are always collected. Others are collected only
+ * if enabled with KMDECOPTIONS. Time spent in stems is summed up over
+ * threads.
+ */
+typedef struct kmdecstats
+{
+    uint64_t events[ KMDEC_EVENT_TYPES ];   /**< events decoded by type,
+                                                 KMDEC_EVENT_* */
+    uint64_t chunks;        /**< chunks rendered by synthesizers */
+    uint64_t samples;       /**< samples rendered by synthesizers */
+    uint64_t bytesCopied;   /**< bytes copied out of internal buffers */
+    int peakVoices;         /**< peak active voices of a synthesizer */
+    uint64_t parseNs;       /**< ns spent in parsing MIDI data */
+    uint64_t scheduleNs;    /**< ns spent in playing events */
+    uint64_t synthNs;       /**< ns spent in synthesizers */
+    uint64_t copyNs;        /**< ns spent in copying samples */
+    uint64_t convertNs;     /**< ns spent in converting samples */
+} KMDECSTATS, *PKMDECSTATS;
+
+/**
+ * MIDI information
+ */
+typedef struct kmdecmidiinfo
+{
+    int format;     /**< MIDI format */
+    int tracks;     /**< a number of tracks */
+    int division;   /**< ticks per quarter note */
+    int duration;   /**< length of MIDI in milli-seconds */
+} KMDECMIDIINFO, *PKMDECMIDIINFO;
+
 typedef struct kmdec *PKMDEC;
 
 /**
@@ -73,6 +294,16 @@ typedef struct kmdeciofuncs
     int ( *close )( int );                /**< close */
 } KMDECIOFUNCS, *PKMDECIOFUNCS;
 
+/**
+ * Function to write samples rendered by kmdecRenderParallel()
+ *
+ * @param[in] arg Argument given to kmdecRenderParallel()
+ * @param[in] buf Rendered samples
+ * @param[in] len Length of @a buf in bytes
+ * @return 0 on success, -1 to stop rendering
+ */
+typedef int ( *KMDECWRITEFUNC )( void *arg, const void *buf, int len );
+
 /**
  * Open decoder with a file name
  *
@@ -96,6 +327,20 @@ PKMDEC kmdecOpen( const char *name, const char *sf2name,
 PKMDEC kmdecOpenEx( const char *name, const char *sf2name,
                   PKMDECAUDIOINFO pkai, PKMDECIOFUNCS io );
 
+/**
+ * Open decoder with a file name and options
+ *
+ * @param[in] name File name to open
+ * @param[in] sf2name Sound font file to open
+ * @param[in] pkai Pointer to audio information
+ * @param[in] io Pointer to IO functions. If NULL, file IOs is used
+ * @param[in] opts Pointer to options. If NULL, defaults are used
+ * @return Decoder on success, NULL on error
+ */
+PKMDEC kmdecOpenOpt( const char *name, const char *sf2name,
+                     PKMDECAUDIOINFO pkai, PKMDECIOFUNCS io,
+                     PKMDECOPTIONS opts );
+
 /**
  * Open decoder with a file descriptor
  *
@@ -118,6 +363,114 @@ PKMDEC kmdecOpenFd( int fd, const char *sf2name, PKMDECAUDIOINFO pkai );
 PKMDEC kmdecOpenFdEx( int fd, const char *sf2name, PKMDECAUDIOINFO pkai,
                       PKMDECIOFUNCS io );
 
+/**
+ * Open decoder with a file descriptor and options
+ *
+ * @param[in] fd File descriptor of a midi file
+ * @param[in] sf2name Sound font file to open
+ * @param[in] pkai Pointer to audio information
+ * @param[in] io Pointer to IO functions. If NULL, file IOs is used
+ * @param[in] opts Pointer to options. If NULL, defaults are used
+ * @return Decoder on success, NULL on error
+ */
+PKMDEC kmdecOpenFdOpt( int fd, const char *sf2name, PKMDECAUDIOINFO pkai,
+                       PKMDECIOFUNCS io, PKMDECOPTIONS opts );
+
+/**
+ * Open decoder with MIDI data in a memory buffer
+ *
+ * MIDI data is not copied, so @a buf should be valid until kmdecClose().
+ *
+ * @param[in] buf MIDI data
+ * @param[in] len Length of @a buf in bytes
+ * @param[in] sf2name Sound font file to open
+ * @param[in] pkai Pointer to audio information
+ * @param[in] opts Pointer to options. If NULL, defaults are used
+ * @return Decoder on success, NULL on error
+ */
+PKMDEC kmdecOpenMem( const void *buf, size_t len, const char *sf2name,
+                     PKMDECAUDIOINFO pkai, PKMDECOPTIONS opts );
+
+/**
+ * Open decoder with a memory-mapped file
+ *
+ * If memory-mapping is not available, a file is read at once.
+ *
+ * @param[in] name File name to map
+ * @param[in] sf2name Sound font file to open
+ * @param[in] pkai Pointer to audio information
+ * @param[in] opts Pointer to options. If NULL, defaults are used
+ * @return Decoder on success, NULL on error
+ */
+PKMDEC kmdecOpenMap( const char *name, const char *sf2name,
+                     PKMDECAUDIOINFO pkai, PKMDECOPTIONS opts );
+
+/**
+ * Probe MIDI information of a file name without a synthesizer
+ *
+ * @param[in] name File name to open
+ * @param[in] io Pointer to IO functions. If NULL, file IOs is used
+ * @param[out] info Pointer to MIDI information
+ * @return 0 on success, -1 on error
+ */
+int kmdecProbe( const char *name, PKMDECIOFUNCS io, PKMDECMIDIINFO info );
+
+/**
+ * Probe MIDI information of a file descriptor without a synthesizer
+ *
+ * @param[in] fd File descriptor of a midi file
+ * @param[in] io Pointer to IO functions. If NULL, file IOs is used
+ * @param[out] info Pointer to MIDI information
+ * @return 0 on success, -1 on error
+ */
+int kmdecProbeFd( int fd, PKMDECIOFUNCS io, PKMDECMIDIINFO info );
+
+/**
+ * Load a new MIDI file into a decoder
+ *
+ * A synthesizer and a sound font of a decoder are kept, and the decoder is
+ * reset to the beginning of the new MIDI.
+ *
+ * @param[in] dec Pointer to a deocder
+ * @param[in] name File name to open
+ * @param[in] io Pointer to IO functions. If NULL, file IOs is used
+ * @return 0 on success, -1 on error. On error, the current MIDI is kept
+ */
+int kmdecLoad( PKMDEC dec, const char *name, PKMDECIOFUNCS io );
+
+/**
+ * Load a new MIDI file descriptor into a decoder
+ *
+ * A synthesizer and a sound font of a decoder are kept, and the decoder is
+ * reset to the beginning of the new MIDI.
+ *
+ * @param[in] dec Pointer to a deocder
+ * @param[in] fd File descriptor of a midi file
+ * @param[in] io Pointer to IO functions. If NULL, file IOs is used
+ * @return 0 on success, -1 on error. On error, the current MIDI is kept
+ */
+int kmdecLoadFd( PKMDEC dec, int fd, PKMDECIOFUNCS io );
+
+/**
+ * Load a sound font into the cache shared by decoders
+ *
+ * Decoders opened with the same sound font file share one loaded sound
+ * font. A preloaded sound font stays loaded until released, even if no
+ * decoders use it.
+ *
+ * @param[in] sf2name Sound font file to load
+ * @return 0 on success, -1 on error
+ */
+int kmdecPreloadSoundFont( const char *sf2name );
+
+/**
+ * Release a sound font loaded by kmdecPreloadSoundFont()
+ *
+ * @param[in] sf2name Sound font file to release
+ * @return 0 on success, -1 on error
+ */
+int kmdecReleaseSoundFont( const char *sf2name );
+
 /**
  * Close decoder
  *
@@ -129,6 +482,11 @@ void kmdecClose( PKMDEC dec );
 /**
  * Fill the given buffer with decoded MIDI messages
  *
+ * If render cache is enabled with KMDECOPTIONS, samples rendered once are
+ * played from it, and a loop wraps around without a gap. Render cache and
+ * loop are applied only to this function, and @a size is rounded down to
+ * a multiple of a sample then.
+ *
  * @param[in] dec Pointer to a deocder
  * @param[out] buffer where to store the decoded messages
  * @param[in] size Size of buffer in bytes
@@ -136,14 +494,65 @@ void kmdecClose( PKMDEC dec );
  */
 int kmdecDecode( PKMDEC dec, void *buffer, int size );
 
+/**
+ * Fill buffers of left and right channels with decoded MIDI messages
+ *
+ * Samples are not interleaved. If possible, they are rendered directly into
+ * @a buffers.
+ *
+ * @param[in] dec Pointer to a deocder
+ * @param[out] buffers Array of buffers of left and right channels
+ * @param[in] size Size of each buffer in bytes
+ * @return Size filled in each buffer in bytes
+ */
+int kmdecDecodePlanar( PKMDEC dec, void *buffers[], int size );
+
+/**
+ * Fill buffers of stems with decoded MIDI messages
+ *
+ * Each stem is rendered by its own synthesizer in its own thread. Stems
+ * should be enabled with KMDECOPTIONS. kmdecDecode() fills a buffer with
+ * the mix of stems. Not available with asynchronous rendering.
+ *
+ * @param[in] dec Pointer to a deocder
+ * @param[out] buffers Array of buffers of stems
+ * @param[in] size Size of each buffer in bytes
+ * @return Size filled in each buffer in bytes
+ */
+int kmdecDecodeStems( PKMDEC dec, void *buffers[], int size );
+
+/**
+ * Get statistics of a decoder
+ *
+ * @param[in] dec Pointer to a deocder
+ * @param[out] stats Pointer to statistics
+ * @return 0 on success, -1 on error
+ */
+int kmdecGetStats( PKMDEC dec, PKMDECSTATS stats );
+
 /**
  * Get length of MIDI in milli-seconds
  *
+ * If duration is calculated in background, wait for it.
+ *
  * @param[in] dec Pointer to a deocder
- * @return Length of MIDI in milli-seconds
+ * @return Length of MIDI in milli-seconds, -1 if a stream is not decoded
+ *         to the end yet
  */
 int kmdecGetDuration( PKMDEC dec );
 
+/**
+ * Check if length of MIDI is ready
+ *
+ * Duration is not ready only while it is calculated in background, or
+ * while a stream is decoded. In the meantime, kmdecSeek() works without
+ * seek index.
+ *
+ * @param[in] dec Pointer to a deocder
+ * @return 1 if ready, 0 if not ready, -1 on error
+ */
+int kmdecIsDurationReady( PKMDEC dec );
+
 /**
  * Get current position of decoder in milli-seconds
  *
@@ -162,6 +571,162 @@ int kmdecGetPosition( PKMDEC dec );
  */
 int kmdecSeek( PKMDEC dec, int offset, int origin );
 
+/**
+ * Set asynchronous rendering
+ *
+ * If enabled, a background thread renders samples ahead into a ring buffer,
+ * and kmdecDecode() just copies them out of it without blocking. If the
+ * thread falls behind, kmdecDecode() fills the rest with silence.
+ * kmdecSeek() and kmdecLoad() discard samples rendered ahead.
+ *
+ * @param[in] dec Pointer to a deocder
+ * @param[in] size Size of a ring buffer in bytes, 0 to disable
+ * @return 0 on success, -1 on error
+ */
+int kmdecSetAsync( PKMDEC dec, int size );
+
+/**
+ * Render whole MIDI in parallel segments
+ *
+ * The timeline is split into segments rendered at once by their own
+ * synthesizers, and the segments are written in order. Each segment starts
+ * from the nearest entry of seek index, and is warmed up for @a overlap ms
+ * so that sounding notes and effects are settled at its start. A decoder
+ * should be opened with KMDEC_TIMING_SAMPLE, and its position is not
+ * changed. Stems are mixed by one synthesizer. A stream should be decoded
+ * to the end first.
+ *
+ * @param[in] dec Pointer to a deocder
+ * @param[in] jobs A number of segments rendered at once
+ * @param[in] overlap Time to warm up before a segment in ms
+ * @param[in] write Function to write rendered samples
+ * @param[in] arg Argument to @a write
+ * @return 0 on success, -1 on error
+ */
+int kmdecRenderParallel( PKMDEC dec, int jobs, int overlap,
+                         KMDECWRITEFUNC write, void *arg );
+
+/**
+ * Send a live event to be played with MIDI
+ *
+ * A channel event is queued from any thread, and played by the same
+ * synthesizer while samples are rendered. With KMDEC_TIMING_SAMPLE, it is
+ * played @a offset samples after the start of the block rendered next,
+ * and rendering is split there. With KMDEC_TIMING_CLOCK, it is played at
+ * the start of a next step of a clock unit. Events are delayed by samples
+ * rendered ahead by kmdecSetAsync(), are not played over samples from
+ * render cache, and are discarded by kmdecSeek() if not played yet.
+ *
+ * @param[in] dec Pointer to a deocder
+ * @param[in] offset Samples from the start of a next block to play at
+ * @param[in] status Status byte of a channel event, 0x80 to 0xEF
+ * @param[in] data0 First data byte
+ * @param[in] data1 Second data byte, ignored if not used
+ * @return 0 on success, -1 on error or if a queue is full
+ */
+int kmdecSendEvent( PKMDEC dec, int offset, int status, int data0,
+                    int data1 );
+
+/**
+ * Convert a tick to time
+ *
+ * Conversions use a tempo map built when MIDI is loaded, without playing
+ * it. For a stream, the last tempo is assumed after events decoded so far.
+ *
+ * @param[in] dec Pointer to a deocder
+ * @param[in] tick Tick
+ * @return Time of @a tick in milli-seconds, -1 on error
+ */
+int kmdecTickToMs( PKMDEC dec, int tick );
+
+/**
+ * Convert time to a tick
+ *
+ * @param[in] dec Pointer to a deocder
+ * @param[in] ms Time in milli-seconds
+ * @return Tick at @a ms, -1 on error
+ */
+int kmdecMsToTick( PKMDEC dec, int ms );
+
+/**
+ * Get a musical position at time
+ *
+ * A new time signature starts a new bar.
+ *
+ * @param[in] dec Pointer to a deocder
+ * @param[in] ms Time in milli-seconds
+ * @param[out] beat Pointer to a musical position
+ * @return 0 on success, -1 on error
+ */
+int kmdecGetBeat( PKMDEC dec, int ms, PKMDECBEAT beat );
+
+/**
+ * Get tempo at time
+ *
+ * @param[in] dec Pointer to a deocder
+ * @param[in] ms Time in milli-seconds
+ * @return Tempo in us per quarter note, -1 on error
+ */
+int kmdecGetTempo( PKMDEC dec, int ms );
+
+/**
+ * Pool of decoders
+ */
+typedef struct kmdecpool *PKMDECPOOL;
+
+/**
+ * Create a pool of decoders
+ *
+ * Decoders are opened with a synthesizer and a sound font in advance, and
+ * are checked out by kmdecPoolGet() to render a MIDI file. Buffers of MIDI
+ * data of a decoder are kept across loads, and reused if large enough.
+ *
+ * @param[in] count A number of decoders
+ * @param[in] sf2name Sound font file to open
+ * @param[in] pkai Pointer to audio information
+ * @param[in] opts Pointer to options. If NULL, defaults are used
+ * @return Pool on success, NULL on error
+ */
+PKMDECPOOL kmdecPoolCreate( int count, const char *sf2name,
+                            PKMDECAUDIOINFO pkai, PKMDECOPTIONS opts );
+
+/**
+ * Destroy a pool of decoders
+ *
+ * Decoders checked out are closed as well.
+ *
+ * @param[in] pool Pointer to a pool
+ */
+void kmdecPoolDestroy( PKMDECPOOL pool );
+
+/**
+ * Check out a decoder from a pool, and load a MIDI file into it
+ *
+ * A decoder is reset to the beginning of the MIDI as kmdecLoad() does.
+ * Settings changed by a previous user, such as kmdecSetAsync(), are kept.
+ * A decoder must be returned by kmdecPoolPut() instead of kmdecClose().
+ *
+ * @param[in] pool Pointer to a pool
+ * @param[in] name File name to open
+ * @param[in] io Pointer to IO functions. If NULL, file IOs is used
+ * @param[in] wait Flag to wait for a decoder if all are checked out
+ * @return Decoder on success, NULL on error or if none is idle
+ */
+PKMDEC kmdecPoolGet( PKMDECPOOL pool, const char *name, PKMDECIOFUNCS io,
+                     int wait );
+
+/**
+ * Return a decoder checked out by kmdecPoolGet() to a pool
+ *
+ * A MIDI file of a decoder is closed, and live events not played yet are
+ * discarded.
+ *
+ * @param[in] pool Pointer to a pool
+ * @param[in] dec Pointer to a decoder
+ * @return 0 on success, -1 on error
+ */
+int kmdecPoolPut( PKMDECPOOL pool, PKMDEC dec );
+
 #ifdef __cplusplus
 }
 #endif
@@ -38,20 +38,17 @@
 #define SAMPLES 2048
 #define SAMPLE_SIZE ( 2/* 16bits */ * 2/* 2 CH */ )
 
-#define USE_FLOAT 1
+#define USE_DITHER 1
+
+#define SEEK_INTERVAL 5000  /* ms */
+
+#define ASYNC_BUFFER_SIZE ( 256 * 1024 )    /* bytes */
 
 /* callback for KAI */
 static ULONG APIENTRY kaiCallback( PVOID pCBData,
                                    PVOID pBuffer, ULONG ulBufferSize )
 {
-#if USE_FLOAT
-    float buf[ ulBufferSize / sizeof( short )];
-
-    return kaiFloatToS16( pBuffer, ulBufferSize,
-                          buf, kmdecDecode( pCBData, buf, sizeof( buf )));
-#else
     return kmdecDecode( pCBData, pBuffer, ulBufferSize );
-#endif
 }
 
 /* convert ms to time */
@@ -140,15 +137,20 @@ int main( int argc, char *argv[])
     PKMDEC dec;
     KMDECAUDIOINFO audioInfo =
     {
-#if USE_FLOAT
-        .bps = KMDEC_BPS_FLOAT,
-#else
         .bps = KMDEC_BPS_S16,
-#endif
         .channels = 2,
         .sampleRate = SAMPLE_RATE
     };
 
+    KMDECOPTIONS opts =
+    {
+        .seekInterval = SEEK_INTERVAL,
+        .deferDuration = 1,
+#if USE_DITHER
+        .dither = KMDEC_DITHER_TPDF,
+#endif
+    };
+
     KAISPEC  ksWanted, ksObtained;
     HKAI     hkai;
 
@@ -161,7 +163,7 @@ int main( int argc, char *argv[])
         return rc;
     }
 
-    dec = kmdecOpenEx( argv[ 1 ], argv[ 2 ], &audioInfo, &io );
+    dec = kmdecOpenOpt( argv[ 1 ], argv[ 2 ], &audioInfo, &io, &opts );
     if( !dec )
     {
         fprintf( stderr, "Failed to init kmdec\n");
@@ -169,6 +171,9 @@ int main( int argc, char *argv[])
         return rc;
     }
 
+    /* render in background, or synchronously on error */
+    kmdecSetAsync( dec, ASYNC_BUFFER_SIZE );
+
     if( kaiInit( KAIM_AUTO ))
     {
         fprintf( stderr, "Failed to init kai\n");
@@ -195,10 +200,9 @@ int main( int argc, char *argv[])
         goto exit_kai_done;
     }
 
-    int H, M, S, HUND;
+    int H = 0, M = 0, S = 0, HUND = 0;
     int h, m, s, hund;
-
-    msToTime( kmdecGetDuration( dec ), &H, &M, &S, &HUND );
+    BOOL durationReady = FALSE;
 
     kaiPlay( hkai );
 
@@ -207,6 +211,13 @@ int main( int argc, char *argv[])
 
     while( kaiStatus( hkai ) != KAIS_COMPLETED )
     {
+        /* duration is calculated while playing */
+        if( !durationReady && kmdecIsDurationReady( dec ) == 1 )
+        {
+            msToTime( kmdecGetDuration( dec ), &H, &M, &S, &HUND );
+            durationReady = TRUE;
+        }
+
         msToTime( kmdecGetPosition( dec ), &h, &m, &s, &hund );
         printf("Playing time: %02d:%02d:%02d.%02d of %02d:%02d:%02d.%02d\r",
                h, m, s, hund, H, M, S, HUND );
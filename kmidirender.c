@@ -0,0 +1,428 @@
+/****************************************************************************
+**
+** K MIDI Render - Batch MIDI renderer
+**
+** Copyright (C) 2018 by KO Myung-Hun <komh@chollian.net>
+**
+** This file is part of K MIDI DECoder.
+**
+** $BEGIN_LICENSE$
+**
+** GNU General Public License Usage
+** This file may be used under the terms of the GNU
+** General Public License version 3.0 as published by the Free Software
+** Foundation and appearing in the file LICENSE.GPL included in the
+** packaging of this file.  Please review the following information to
+** ensure the GNU General Public License version 3.0 requirements will be
+** met: http://www.gnu.org/copyleft/gpl.html.
+**
+** $END_LICENSE$
+**
+****************************************************************************/
+
+/** @file kmidirender.c */
+
+#define INCL_DOS
+#include <os2.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#include <pthread.h>
+
+#include "kmididec.h"
+
+#ifndef QSV_NUMPROCESSORS
+#define QSV_NUMPROCESSORS   26
+#endif
+
+#define SAMPLE_RATE 44100
+#define CHANNELS    2
+#define SAMPLE_SIZE ( 2/* 16bits */ * CHANNELS )
+
+#define BUF_SIZE    ( 64 * 1024 )
+
+#define MAX_JOBS    64
+
+/* for splitting a file into segments */
+#define SEEK_INTERVAL   5000    /* ms */
+#define OVERLAP         2000    /* ms */
+
+#define WAV_HEADER_SIZE 44
+
+/* render options */
+static int sampleRate = SAMPLE_RATE;
+static int renderRate = 0;
+static int preset = KMDEC_PRESET_DEFAULT;
+static bool rawOutput = false;
+static bool splitFile = false;
+static int segmentJobs = 1;
+static const char *outDir = NULL;
+static const char *sf2name;
+
+/* jobs */
+static char **midiFiles;
+static int midiCount;
+static int nextMidi = 0;
+static int failCount = 0;
+static pthread_mutex_t jobMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* store a 16-bit value in little endian */
+static void putLE16( uint8_t *p, uint16_t v )
+{
+    p[ 0 ] = v & 0xFF;
+    p[ 1 ] = ( v >> 8 ) & 0xFF;
+}
+
+/* store a 32-bit value in little endian */
+static void putLE32( uint8_t *p, uint32_t v )
+{
+    putLE16( p, v & 0xFFFF );
+    putLE16( p + 2, ( v >> 16 ) & 0xFFFF );
+}
+
+/* write a WAV header */
+static int writeWavHeader( FILE *fp, uint32_t dataSize )
+{
+    uint8_t header[ WAV_HEADER_SIZE ];
+
+    memcpy( header, "RIFF", 4 );
+    putLE32( header + 4, WAV_HEADER_SIZE - 8 + dataSize );
+    memcpy( header + 8, "WAVE", 4 );
+
+    memcpy( header + 12, "fmt ", 4 );
+    putLE32( header + 16, 16 );
+    putLE16( header + 20, 1 );   /* PCM */
+    putLE16( header + 22, CHANNELS );
+    putLE32( header + 24, sampleRate );
+    putLE32( header + 28, sampleRate * SAMPLE_SIZE );
+    putLE16( header + 32, SAMPLE_SIZE );
+    putLE16( header + 34, 16 );
+
+    memcpy( header + 36, "data", 4 );
+    putLE32( header + 40, dataSize );
+
+    return fwrite( header, sizeof( header ), 1, fp ) == 1 ? 0 : -1;
+}
+
+/**
+ * Output of a file
+ */
+typedef struct output
+{
+    FILE *fp;           /**< output file */
+    uint32_t dataSize;  /**< bytes written */
+} OUTPUT, *POUTPUT;
+
+/* write samples into an output file */
+static int writeData( void *arg, const void *buf, int len )
+{
+    POUTPUT out = arg;
+
+    if( fwrite( buf, 1, len, out->fp ) != len )
+        return -1;
+
+    out->dataSize += len;
+
+    return 0;
+}
+
+/* make an output file name from a MIDI file name */
+static char *makeOutName( const char *midiName )
+{
+    const char *ext = rawOutput ? ".raw" : ".wav";
+    const char *base = midiName;
+    const char *p;
+    char *outName;
+    int len;
+
+    if( outDir )
+    {
+        for( p = midiName; *p; p++ )
+        {
+            if( *p == '/' || *p == '\\' || *p == ':')
+                base = p + 1;
+        }
+    }
+
+    /* strip an extension */
+    p = strrchr( base, '.');
+    if( !p || strpbrk( p, "/\\:"))
+        p = base + strlen( base );
+    len = p - base;
+
+    outName = malloc(( outDir ? strlen( outDir ) + 1 : 0 ) + len
+                     + strlen( ext ) + 1 );
+    if( !outName )
+        return NULL;
+
+    if( outDir )
+        sprintf( outName, "%s/%.*s%s", outDir, len, base, ext );
+    else
+        sprintf( outName, "%.*s%s", len, base, ext );
+
+    return outName;
+}
+
+/* render a MIDI file */
+static int render( const char *midiName )
+{
+    KMDECAUDIOINFO audioInfo =
+    {
+        .bps = KMDEC_BPS_S16,
+        .channels = CHANNELS,
+        .sampleRate = sampleRate
+    };
+
+    KMDECOPTIONS opts =
+    {
+        .seekInterval = splitFile ? SEEK_INTERVAL : 0,
+        .timing = KMDEC_TIMING_SAMPLE,
+        .preset = preset,
+        .renderRate = renderRate,
+    };
+
+    PKMDEC dec;
+    FILE *fp;
+    OUTPUT out = { NULL, 0 };
+    char *outName;
+    char *buf;
+    int len;
+    int rc = -1;
+
+    outName = makeOutName( midiName );
+    buf = malloc( BUF_SIZE );
+    if( !outName || !buf )
+        goto exit_free;
+
+    dec = kmdecOpenOpt( midiName, sf2name, &audioInfo, NULL, &opts );
+    if( !dec )
+        goto exit_free;
+
+    fp = fopen( outName, "wb");
+    if( !fp )
+        goto exit_kmdec_close;
+
+    if( !rawOutput && writeWavHeader( fp, 0 ) == -1 )
+        goto exit_fclose;
+
+    out.fp = fp;
+
+    if( splitFile )
+    {
+        if( kmdecRenderParallel( dec, segmentJobs, OVERLAP,
+                                 writeData, &out ) == -1 )
+            goto exit_fclose;
+    }
+    else
+    {
+        while(( len = kmdecDecode( dec, buf, BUF_SIZE )) > 0 )
+        {
+            if( writeData( &out, buf, len ) == -1 )
+                goto exit_fclose;
+        }
+    }
+
+    /* fill sizes */
+    if( !rawOutput
+        && ( fseek( fp, 0, SEEK_SET ) == -1
+             || writeWavHeader( fp, out.dataSize ) == -1 ))
+        goto exit_fclose;
+
+    rc = 0;
+
+exit_fclose:
+    if( fclose( fp ) != 0 )
+        rc = -1;
+
+    if( rc == -1 )
+        remove( outName );
+
+exit_kmdec_close:
+    kmdecClose( dec );
+
+exit_free:
+    pthread_mutex_lock( &jobMutex );
+    if( rc == 0 )
+        printf("%s -> %s\n", midiName, outName );
+    else
+        fprintf( stderr, "Failed to render %s\n", midiName );
+    pthread_mutex_unlock( &jobMutex );
+
+    free( buf );
+    free( outName );
+
+    return rc;
+}
+
+/* worker thread */
+static void *worker( void *arg )
+{
+    while( 1 )
+    {
+        int i;
+
+        pthread_mutex_lock( &jobMutex );
+        i = nextMidi++;
+        pthread_mutex_unlock( &jobMutex );
+
+        if( i >= midiCount )
+            break;
+
+        if( render( midiFiles[ i ]) == -1 )
+        {
+            pthread_mutex_lock( &jobMutex );
+            failCount++;
+            pthread_mutex_unlock( &jobMutex );
+        }
+    }
+
+    return NULL;
+}
+
+/* get a number of processors */
+static int numProcessors( void )
+{
+    ULONG cpus;
+
+    if( DosQuerySysInfo( QSV_NUMPROCESSORS, QSV_NUMPROCESSORS,
+                         &cpus, sizeof( cpus )))
+        cpus = 1;
+
+    return cpus;
+}
+
+static void usage( void )
+{
+    fprintf( stderr,
+        "Usage : kmidirender [options] sound-font-file MIDI-file...\n"
+        "Options :\n"
+        "    -j jobs    Render jobs files at once, default is CPU count\n"
+        "    -r rate    Sample rate, default is %d\n"
+        "    -R rate    Render at rate, and resample to sample rate\n"
+        "    -o dir     Output directory, default is where MIDI file is\n"
+        "    -p         Write raw PCM instead of WAV\n"
+        "    -s         Split each file into segments rendered by jobs\n"
+        "    -q quality Quality, one of preview, realtime and hq\n",
+        SAMPLE_RATE );
+}
+
+int main( int argc, char *argv[])
+{
+    pthread_t threads[ MAX_JOBS ];
+    int jobs = 0;
+    int created;
+    int opt;
+    int rc = 1;
+
+    while(( opt = getopt( argc, argv, "j:r:R:o:psq:")) != -1 )
+    {
+        switch( opt )
+        {
+            case 'j':
+                jobs = atoi( optarg );
+                break;
+
+            case 'r':
+                sampleRate = atoi( optarg );
+                break;
+
+            case 'R':
+                renderRate = atoi( optarg );
+                break;
+
+            case 'o':
+                outDir = optarg;
+                break;
+
+            case 'p':
+                rawOutput = true;
+                break;
+
+            case 's':
+                splitFile = true;
+                break;
+
+            case 'q':
+                if( !strcmp( optarg, "preview"))
+                    preset = KMDEC_PRESET_PREVIEW;
+                else if( !strcmp( optarg, "realtime"))
+                    preset = KMDEC_PRESET_REALTIME;
+                else if( !strcmp( optarg, "hq"))
+                    preset = KMDEC_PRESET_OFFLINE_HQ;
+                else
+                {
+                    usage();
+
+                    return rc;
+                }
+                break;
+
+            default:
+                usage();
+
+                return rc;
+        }
+    }
+
+    /* segments are not resampled */
+    if( argc - optind < 2 || jobs < 0 || sampleRate <= 0 || renderRate < 0
+        || ( splitFile && renderRate ))
+    {
+        usage();
+
+        return rc;
+    }
+
+    sf2name = argv[ optind ];
+    midiFiles = argv + optind + 1;
+    midiCount = argc - optind - 1;
+
+    if( jobs == 0 )
+        jobs = numProcessors();
+
+    /* render files one by one, and segments of each file by jobs */
+    if( splitFile )
+    {
+        segmentJobs = jobs;
+        jobs = 1;
+    }
+
+    if( jobs > midiCount )
+        jobs = midiCount;
+
+    if( jobs > MAX_JOBS )
+        jobs = MAX_JOBS;
+
+    /* load a sound font once for all the workers */
+    if( kmdecPreloadSoundFont( sf2name ) == -1 )
+    {
+        fprintf( stderr, "Failed to load %s\n", sf2name );
+
+        return rc;
+    }
+
+    for( created = 0; created < jobs; created++ )
+    {
+        if( pthread_create( &threads[ created ], NULL, worker, NULL ))
+            break;
+    }
+
+    /* render in the main thread if no worker */
+    if( created == 0 )
+        worker( NULL );
+
+    while( created > 0 )
+        pthread_join( threads[ --created ], NULL );
+
+    kmdecReleaseSoundFont( sf2name );
+
+    if( failCount == 0 )
+        rc = 0;
+
+    return rc;
+}
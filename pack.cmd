@@ -12,6 +12,7 @@ sVerHeader = 'kmididec.h'
 
 sDistFiles = 'kmidi.exe' '/',
              'kmidimmio.exe' '/',
+             'kmidirender.exe' '/',
              'README' '/',
              'kmididec.h' '/include',
              'kmidide0.dll' '/lib',